@@ -0,0 +1,672 @@
+#ifndef BATCH_H_INCLUDED
+#define BATCH_H_INCLUDED
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <stdexcept>
+#include <utility>
+
+#include <boost/variant.hpp>
+
+#include "calculator.h"
+#include "functions.h"
+#include "polynomial.h"
+#include "simd.h"
+#include "thread_pool.h"
+#include "tree.h"
+
+// Evaluates expressions over many rows at once. Variables are bound to
+// columns, one contiguous array of values per variable, and the expressions
+// are compiled into a flat list of instructions that each apply one vector
+// kernel to a block of rows. Blocks are sized so that every intermediate
+// result of a block stays in the L1 data cache.
+//
+// Arithmetic matches eval_expression_tree bit for bit. Built-in function
+// calls use their batch kernels, whose error bounds are in functions.h.
+
+class batch_columns
+{
+    std::size_t row_count;
+    std::unordered_map<std::string, const double*> data;
+
+public:
+    explicit batch_columns(std::size_t _rows): row_count(_rows) {}
+
+    // The column must hold rows() values and outlive the evaluations
+    void bind(std::string name, const double* column)
+    {
+        data[std::move(name)] = column;
+    }
+
+    const double* find(const std::string& name) const
+    {
+        auto it = data.find(name);
+        return it != data.end() ? it->second : nullptr;
+    }
+
+    std::size_t rows() const
+    {
+        return row_count;
+    }
+};
+
+// Block buffers for one evaluating thread; reusable across evaluations and
+// programs
+class batch_scratch
+{
+    std::vector<double> buffer;
+
+public:
+    double* reserve(std::size_t n)
+    {
+        if(buffer.size() < n)
+            buffer.resize(n);
+        return buffer.data();
+    }
+};
+
+namespace batch_detail
+{
+    struct negate_kernel
+    {
+        static const unsigned int arity = 1;
+        static double scalar(const double* a) { return -a[0]; }
+        template <typename Isa>
+        static typename Isa::vec apply(const typename Isa::vec* a) { return -a[0]; }
+    };
+
+    struct add_kernel
+    {
+        static const unsigned int arity = 2;
+        static double scalar(const double* a) { return a[0] + a[1]; }
+        template <typename Isa>
+        static typename Isa::vec apply(const typename Isa::vec* a) { return a[0] + a[1]; }
+    };
+
+    struct subtract_kernel
+    {
+        static const unsigned int arity = 2;
+        static double scalar(const double* a) { return a[0] - a[1]; }
+        template <typename Isa>
+        static typename Isa::vec apply(const typename Isa::vec* a) { return a[0] - a[1]; }
+    };
+
+    struct multiply_kernel
+    {
+        static const unsigned int arity = 2;
+        static double scalar(const double* a) { return a[0] * a[1]; }
+        template <typename Isa>
+        static typename Isa::vec apply(const typename Isa::vec* a) { return a[0] * a[1]; }
+    };
+
+    struct divide_kernel
+    {
+        static const unsigned int arity = 2;
+        static double scalar(const double* a) { return a[0] / a[1]; }
+        template <typename Isa>
+        static typename Isa::vec apply(const typename Isa::vec* a) { return a[0] / a[1]; }
+    };
+
+    // Fused exactly when multiply_add is, so polynomial nodes round the
+    // same way as in eval_expression_tree
+    struct multiply_add_kernel
+    {
+        static const unsigned int arity = 3;
+        static double scalar(const double* a) { return multiply_add(a[0], a[1], a[2]); }
+        template <typename Isa>
+        static typename Isa::vec apply(const typename Isa::vec* a)
+        {
+#ifdef FP_FAST_FMA
+            return Isa::fma(a[0], a[1], a[2]);
+#else
+            return Isa::multiply_add(a[0], a[1], a[2]);
+#endif
+        }
+    };
+
+    // There is no vector pow; it runs through libm a row at a time
+    struct exponentiate_kernel
+    {
+        static const unsigned int arity = 2;
+        static double scalar(const double* a) { return std::pow(a[0], a[1]); }
+    };
+    // Moves a column, constant or shared value into an output
+    struct copy_kernel
+    {
+        static const unsigned int arity = 1;
+        static double scalar(const double* a) { return a[0]; }
+        template <typename Isa>
+        static typename Isa::vec apply(const typename Isa::vec* a) { return a[0]; }
+    };
+
+    typedef void (*kernel_function)(const double* const* args, double* out, std::size_t n);
+
+    enum class operand_kind
+    {
+        Register,
+        Column,
+        Output
+    };
+
+    struct operand
+    {
+        operand_kind kind;
+        unsigned int index;
+    };
+
+    const unsigned int max_operands = 3;
+
+    struct instruction
+    {
+        kernel_function kernel;
+        unsigned int arity;
+        operand args[max_operands];
+        operand dest;
+    };
+
+    // A node of the graph all the expressions are compiled into. Leaves
+    // (columns and constants) have no kernel and a fixed location. Other
+    // values only refer to values created before them, so their ids are
+    // already in an order they can be computed in.
+    struct value
+    {
+        kernel_function kernel;
+        unsigned int arity;
+        unsigned int args[max_operands];
+        operand leaf;
+        unsigned int uses;
+    };
+
+    struct value_key
+    {
+        kernel_function kernel;
+        unsigned int arity;
+        unsigned int args[max_operands];
+
+        bool operator==(const value_key& k) const
+        {
+            return kernel == k.kernel && arity == k.arity && std::equal(args, args + arity, k.args);
+        }
+    };
+
+    struct value_key_hash
+    {
+        std::size_t operator()(const value_key& k) const
+        {
+            std::size_t h = std::hash<kernel_function>()(k.kernel);
+            for(unsigned int i = 0; i < k.arity; ++i)
+                h = h * 1000003 ^ k.args[i];
+            return h;
+        }
+    };
+}
+
+// Computes any number of expressions in one pass over the rows. The
+// expressions are merged into one graph in which structurally identical
+// subexpressions, within or across expressions, are a single value, so
+// each is computed once per block however many outputs use it. Sums and
+// products match with their operands in either order, which rounds the
+// same.
+class batch_program
+{
+    typedef batch_detail::operand operand;
+    typedef batch_detail::operand_kind operand_kind;
+    typedef batch_detail::instruction instruction;
+    typedef batch_detail::value value;
+
+    std::vector<instruction> code;
+    std::vector<std::string> column_names;
+    std::vector<std::pair<unsigned int, double>> constants;
+    unsigned int register_count;
+    std::size_t rows_per_block;
+    std::size_t output_count;
+
+    // Compilation state
+    std::vector<value> values;
+    std::unordered_map<batch_detail::value_key, unsigned int, batch_detail::value_key_hash> computed;
+    std::unordered_map<std::string, unsigned int> column_values;
+    std::unordered_map<std::uint64_t, unsigned int> constant_values;
+    std::vector<unsigned int> free_registers;
+
+    unsigned int leaf(operand o)
+    {
+        value v;
+        v.kernel = nullptr;
+        v.arity = 0;
+        v.leaf = o;
+        v.uses = 0;
+        values.push_back(v);
+        return static_cast<unsigned int>(values.size() - 1);
+    }
+
+    unsigned int constant(double d)
+    {
+        std::uint64_t bits;
+        std::memcpy(&bits, &d, sizeof(d));
+        auto it = constant_values.find(bits);
+        if(it != constant_values.end())
+            return it->second;
+
+        // Constants are filled in once per evaluation, so they never share
+        // a register with a temporary
+        unsigned int r = register_count++;
+        constants.emplace_back(r, d);
+        return constant_values[bits] = leaf(operand{operand_kind::Register, r});
+    }
+
+    unsigned int column(const std::string& name)
+    {
+        auto it = column_values.find(name);
+        if(it != column_values.end())
+            return it->second;
+
+        unsigned int c = static_cast<unsigned int>(column_names.size());
+        column_names.push_back(name);
+        return column_values[name] = leaf(operand{operand_kind::Column, c});
+    }
+
+    unsigned int node(batch_detail::kernel_function kernel, const unsigned int* args, unsigned int arity, bool commutative = false)
+    {
+        batch_detail::value_key k;
+        k.kernel = kernel;
+        k.arity = arity;
+        std::copy_n(args, arity, k.args);
+        if(commutative && k.args[1] < k.args[0])
+            std::swap(k.args[0], k.args[1]);
+
+        auto it = computed.find(k);
+        if(it != computed.end())
+            return it->second;
+
+        value v;
+        v.kernel = kernel;
+        v.arity = arity;
+        std::copy_n(k.args, arity, v.args);
+        v.uses = 0;
+        for(unsigned int i = 0; i < arity; ++i)
+            ++values[k.args[i]].uses;
+
+        values.push_back(v);
+        return computed[k] = static_cast<unsigned int>(values.size() - 1);
+    }
+
+    template <typename Kernel>
+    unsigned int node(const unsigned int* args, bool commutative = false)
+    {
+        return node(&function_detail::map_batch<Kernel>, args, Kernel::arity, commutative);
+    }
+
+    template <typename Kernel>
+    unsigned int binary(const t_binary_op<double>& t, bool commutative = false)
+    {
+        unsigned int args[] = {compile(t.ops[0]), compile(t.ops[1])};
+        return node<Kernel>(args, commutative);
+    }
+
+    // Same association as reduce_operands, for identical rounding
+    template <typename Kernel>
+    unsigned int nary(const t_nary_op<double>& t)
+    {
+        return reduce_operands<unsigned int>(t.ops.size(), [&](std::size_t i) { return compile(t.ops[i]); },
+                                             [&](unsigned int lhs, unsigned int rhs)
+                                             {
+                                                 unsigned int args[] = {lhs, rhs};
+                                                 return node<Kernel>(args, true);
+                                             });
+    }
+
+    unsigned int polynomial(const t_polynomial<double>& t)
+    {
+        std::size_t n = t.coeffs.size();
+        if(n == 0)
+            return constant(0);
+
+        unsigned int x = column(t.var);
+
+        // Same association as evaluate_polynomial, for identical rounding
+        if(n < estrin_min_coefficients)
+        {
+            unsigned int r = compile(t.coeffs[n-1]);
+            for(std::size_t k = n - 1; k > 0; --k)
+            {
+                unsigned int args[] = {r, x, compile(t.coeffs[k-1])};
+                r = node<batch_detail::multiply_add_kernel>(args);
+            }
+            return r;
+        }
+
+        std::vector<unsigned int> c;
+        for(const auto& i : t.coeffs)
+            c.push_back(compile(i));
+
+        while(n > 1)
+        {
+            std::size_t half = n / 2;
+            for(std::size_t i = 0; i < half; ++i)
+            {
+                unsigned int args[] = {c[2*i+1], x, c[2*i]};
+                c[i] = node<batch_detail::multiply_add_kernel>(args);
+            }
+            if(n % 2)
+                c[half] = c[n-1];
+
+            n = half + n % 2;
+            if(n > 1)
+            {
+                unsigned int args[] = {x, x};
+                x = node<batch_detail::multiply_kernel>(args);
+            }
+        }
+        return c[0];
+    }
+
+    unsigned int compile(const t_expression<double>& t)
+    {
+        struct visitor_t : public boost::static_visitor<unsigned int>
+        {
+            batch_program& p;
+
+            visitor_t(batch_program& _p): p(_p) {}
+
+            unsigned int operator()(double n)
+            {
+                return p.constant(n);
+            }
+            unsigned int operator()(const t_var_occurrance<double>& t)
+            {
+                return p.column(t.name);
+            }
+            unsigned int operator()(const t_arg_placeholder<double>& t)
+            {
+                throw std::logic_error("t_arg_placeholder encountered while evaluating expression");
+            }
+            unsigned int operator()(const t_func_invocation<double>& t)
+            {
+                const builtin_function* f = find_builtin_function(t.name);
+                if(!f)
+                    throw eval_error("Undefined function");
+                if(t.args.size() != f->arity)
+                    throw eval_error("Wrong number of arguments to " + t.name);
+
+                unsigned int args[batch_detail::max_operands];
+                for(unsigned int i = 0; i < f->arity; ++i)
+                    args[i] = p.compile(t.args[i]);
+                return p.node(f->batch, args, f->arity);
+            }
+            unsigned int operator()(const t_negate<double>& t)
+            {
+                unsigned int args[] = {p.compile(t.op)};
+                return p.node<batch_detail::negate_kernel>(args);
+            }
+            unsigned int operator()(const t_add<double>& t)
+            {
+                return p.binary<batch_detail::add_kernel>(t, true);
+            }
+            unsigned int operator()(const t_subtract<double>& t)
+            {
+                return p.binary<batch_detail::subtract_kernel>(t);
+            }
+            unsigned int operator()(const t_multiply<double>& t)
+            {
+                return p.binary<batch_detail::multiply_kernel>(t, true);
+            }
+            unsigned int operator()(const t_divide<double>& t)
+            {
+                return p.binary<batch_detail::divide_kernel>(t);
+            }
+            unsigned int operator()(const t_exponentiate<double>& t)
+            {
+                unsigned int args[] = {p.compile(t.ops[0]), p.compile(t.ops[1])};
+                return p.node(&function_detail::map_scalar<batch_detail::exponentiate_kernel>, args, 2);
+            }
+            unsigned int operator()(const t_polynomial<double>& t)
+            {
+                return p.polynomial(t);
+            }
+            unsigned int operator()(const t_sum<double>& t)
+            {
+                return p.nary<batch_detail::add_kernel>(t);
+            }
+            unsigned int operator()(const t_product<double>& t)
+            {
+                return p.nary<batch_detail::multiply_kernel>(t);
+            }
+        } visitor(*this);
+
+        return boost::apply_visitor(visitor, t);
+    }
+
+    unsigned int allocate()
+    {
+        if(free_registers.empty())
+            return register_count++;
+        unsigned int r = free_registers.back();
+        free_registers.pop_back();
+        return r;
+    }
+
+    void copy(const operand& from, std::size_t output)
+    {
+        instruction i;
+        i.kernel = &function_detail::map_batch<batch_detail::copy_kernel>;
+        i.arity = 1;
+        i.args[0] = from;
+        i.dest = operand{operand_kind::Output, static_cast<unsigned int>(output)};
+        code.push_back(i);
+    }
+
+    // Emits the values in id order. A value's register is freed after its
+    // last use, before the destination of that instruction is allocated, so
+    // a result may overwrite an input; kernels read each element before
+    // writing it. A value that is one output and nothing else is written
+    // straight into the output array.
+    void schedule(const std::vector<unsigned int>& outputs)
+    {
+        std::vector<std::vector<std::size_t>> output_of(values.size());
+        for(std::size_t k = 0; k < outputs.size(); ++k)
+            output_of[outputs[k]].push_back(k);
+
+        std::vector<unsigned int> remaining(values.size());
+        std::vector<operand> location(values.size());
+        for(std::size_t id = 0; id < values.size(); ++id)
+        {
+            remaining[id] = values[id].uses;
+            if(values[id].kernel)
+                continue;
+
+            location[id] = values[id].leaf;
+            for(std::size_t k : output_of[id])
+                copy(location[id], k);
+        }
+
+        for(std::size_t id = 0; id < values.size(); ++id)
+        {
+            const value& v = values[id];
+            if(!v.kernel)
+                continue;
+
+            instruction i;
+            i.kernel = v.kernel;
+            i.arity = v.arity;
+            for(unsigned int k = 0; k < v.arity; ++k)
+            {
+                i.args[k] = location[v.args[k]];
+                if(--remaining[v.args[k]] == 0 && values[v.args[k]].kernel)
+                    free_registers.push_back(location[v.args[k]].index);
+            }
+
+            bool direct = remaining[id] == 0 && output_of[id].size() == 1;
+            if(direct)
+                i.dest = operand{operand_kind::Output, static_cast<unsigned int>(output_of[id][0])};
+            else
+                i.dest = operand{operand_kind::Register, allocate()};
+            code.push_back(i);
+            location[id] = i.dest;
+
+            if(!direct)
+            {
+                for(std::size_t k : output_of[id])
+                    copy(location[id], k);
+                if(remaining[id] == 0)
+                    free_registers.push_back(location[id].index);
+            }
+        }
+    }
+
+    double* target(const operand& o, double* registers, double* const* out, std::size_t first) const
+    {
+        if(o.kind == operand_kind::Output)
+            return out[o.index] + first;
+        return registers + o.index * rows_per_block;
+    }
+
+    const double* source(const operand& o, double* registers, const double* const* columns, std::size_t first) const
+    {
+        if(o.kind == operand_kind::Column)
+            return columns[o.index] + first;
+        return registers + o.index * rows_per_block;
+    }
+
+    void check_single_output() const
+    {
+        if(output_count != 1)
+            throw std::logic_error("batch_program with several outputs evaluated into one");
+    }
+
+public:
+    // Budget for the block buffers of one evaluation
+    static const std::size_t cache_bytes = 32 * 1024;
+
+    explicit batch_program(const std::vector<t_expression<double>>& expressions): register_count(0), output_count(expressions.size())
+    {
+        std::vector<unsigned int> outputs;
+        for(const auto& t : expressions)
+            outputs.push_back(compile(t));
+        schedule(outputs);
+
+        std::size_t per_row = sizeof(double) * std::max(register_count, 1u);
+        rows_per_block = std::min<std::size_t>(4096, std::max<std::size_t>(256, cache_bytes / per_row / 8 * 8));
+
+        values.clear();
+        computed.clear();
+        column_values.clear();
+        constant_values.clear();
+        free_registers.clear();
+    }
+
+    explicit batch_program(const t_expression<double>& t): batch_program(std::vector<t_expression<double>>(1, t)) {}
+
+    // Variables the expressions read, in the order they first appear
+    const std::vector<std::string>& variables() const
+    {
+        return column_names;
+    }
+
+    std::size_t outputs() const
+    {
+        return output_count;
+    }
+
+    // Instructions run per block, copies included
+    std::size_t size() const
+    {
+        return code.size();
+    }
+
+    std::size_t block_rows() const
+    {
+        return rows_per_block;
+    }
+
+    std::size_t scratch_size() const
+    {
+        return register_count * rows_per_block;
+    }
+
+    // Computes rows [first, last) of every output; out[k] receives
+    // expression k and is indexed by row like the columns
+    void evaluate(const batch_columns& columns, double* const* out, std::size_t first, std::size_t last, batch_scratch& scratch) const
+    {
+        std::vector<const double*> bound(column_names.size());
+        for(std::size_t i = 0; i < column_names.size(); ++i)
+        {
+            bound[i] = columns.find(column_names[i]);
+            if(!bound[i])
+                throw eval_error("Undefined variable");
+        }
+
+        double* registers = scratch.reserve(scratch_size());
+        for(const auto& c : constants)
+            std::fill_n(registers + c.first * rows_per_block, rows_per_block, c.second);
+
+        const double* args[batch_detail::max_operands];
+        for(std::size_t row = first; row < last; row += rows_per_block)
+        {
+            std::size_t n = std::min(rows_per_block, last - row);
+
+            for(const auto& i : code)
+            {
+                for(unsigned int k = 0; k < i.arity; ++k)
+                    args[k] = source(i.args[k], registers, bound.data(), row);
+                i.kernel(args, target(i.dest, registers, out, row), n);
+            }
+        }
+    }
+
+    void evaluate(const batch_columns& columns, double* const* out) const
+    {
+        batch_scratch scratch;
+        evaluate(columns, out, 0, columns.rows(), scratch);
+    }
+
+    // Splits the rows into chunks of whole blocks and evaluates them as
+    // tasks on pool, at least four per thread for balance. Every thread
+    // keeps its own scratch buffers; the program and columns are only read.
+    void evaluate(work_stealing_pool& pool, const batch_columns& columns, double* const* out) const
+    {
+        std::size_t rows = columns.rows();
+        std::size_t chunk = rows / (4 * pool.size()) / rows_per_block * rows_per_block;
+        chunk = std::min(std::max(chunk, rows_per_block), 64 * rows_per_block);
+
+        task_group group(pool);
+        for(std::size_t first = 0; first < rows; first += chunk)
+        {
+            std::size_t last = std::min(rows, first + chunk);
+            group.run([this, &columns, out, first, last]
+            {
+                static thread_local batch_scratch scratch;
+                evaluate(columns, out, first, last, scratch);
+            });
+        }
+        group.wait();
+    }
+
+    // Single-expression forms
+    void evaluate(const batch_columns& columns, double* out, std::size_t first, std::size_t last, batch_scratch& scratch) const
+    {
+        check_single_output();
+        evaluate(columns, &out, first, last, scratch);
+    }
+
+    void evaluate(const batch_columns& columns, double* out) const
+    {
+        check_single_output();
+        evaluate(columns, &out);
+    }
+
+    void evaluate(work_stealing_pool& pool, const batch_columns& columns, double* out) const
+    {
+        check_single_output();
+        evaluate(pool, columns, &out);
+    }
+};
+
+#endif // BATCH_H_INCLUDED
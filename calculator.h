@@ -2,19 +2,28 @@
 #define CALCULATOR_H_INCLUDED
 
 #include <string>
-#include <unordered_map>
+#include <functional>
+#include <vector>
 
+#include <cmath>
 #include <exception>
+#include <limits>
+#include <stdexcept>
 #include <utility>
 
 #include <boost/variant.hpp>
 
+#include "cost.h"
+#include "expected.h"
+#include "functions.h"
+#include "polynomial.h"
 #include "tree.h"
+#include "variable_store.h"
 
 template <typename NumType>
 struct calculator_state
 {
-    std::unordered_map<std::string, NumType> variable_set;
+    variable_store<NumType> variable_set;
 };
 
 class eval_error : public std::exception
@@ -31,14 +40,42 @@ public:
     }
 };
 
+// Other variable stores (concurrent_state.h) take part in evaluation by
+// overloading this; null means undefined
 template <typename NumType>
-NumType eval_expression_tree(const calculator_state<double>& c, const t_expression<NumType>& t)
+const NumType* lookup_variable(const calculator_state<NumType>& c, const std::string& name)
 {
-    struct visitor_t : public boost::static_visitor<NumType>
+    return c.variable_set.find(name);
+}
+
+namespace calculator_detail
+{
+    // With an error slot, failures are recorded there (the first one wins)
+    // and evaluation carries on with NaN; without one, they throw eval_error
+    template <typename NumType, typename State>
+    struct evaluator : public boost::static_visitor<NumType>
     {
-        const calculator_state<double>& c;
+        const State& c;
+        error_info* error;
 
-        visitor_t(const calculator_state<double>& _c): c(_c) {}
+        evaluator(const State& _c, error_info* _error): c(_c), error(_error) {}
+
+        NumType fail(error_code code, const std::string& name)
+        {
+            if(!error)
+            {
+                error_info e;
+                e.code = code;
+                e.name = name;
+                throw eval_error(e.message());
+            }
+            if(!*error)
+            {
+                error->code = code;
+                error->name = name;
+            }
+            return std::numeric_limits<NumType>::quiet_NaN();
+        }
 
         NumType operator()(const NumType& n)
         {
@@ -46,15 +83,15 @@ NumType eval_expression_tree(const calculator_state<double>& c, const t_expressi
         }
         NumType operator()(const t_var_occurrance<NumType>& t)
         {
-            auto it = c.variable_set.find(t.name);
+            const auto* value = lookup_variable(c, t.name);
 
-            if(it != c.variable_set.end())
+            if(value)
             {
-                return it->second;
+                return *value;
             }
             else
             {
-                throw eval_error("Undefined variable");
+                return fail(error_code::UndefinedVariable, t.name);
             }
         }
         NumType operator()(const t_arg_placeholder<NumType>& t)
@@ -63,7 +100,16 @@ NumType eval_expression_tree(const calculator_state<double>& c, const t_expressi
         }
         NumType operator()(const t_func_invocation<NumType>& t)
         {
-            throw eval_error("Unimplemented");
+            const builtin_function* f = find_builtin_function(t.name);
+            if(!f)
+                return fail(error_code::UndefinedFunction, t.name);
+            if(t.args.size() != f->arity)
+                return fail(error_code::WrongArgumentCount, t.name);
+
+            double args[builtin_max_arity];
+            for(unsigned int i = 0; i < f->arity; ++i)
+                args[i] = boost::apply_visitor(*this, t.args[i]);
+            return f->scalar(args);
         }
         NumType operator()(const t_negate<NumType>& t)
         {
@@ -89,11 +135,83 @@ NumType eval_expression_tree(const calculator_state<double>& c, const t_expressi
         {
             return std::pow(boost::apply_visitor(*this, t.ops[0]), boost::apply_visitor(*this, t.ops[1]));
         }
-    } visitor(c);
+        NumType operator()(const t_polynomial<NumType>& t)
+        {
+            NumType x = (*this)(t_var_occurrance<NumType>(t.var));
+
+            NumType small[32];
+            std::vector<NumType> large;
+            NumType* coeffs = small;
+            if(t.coeffs.size() > 32)
+            {
+                large.resize(t.coeffs.size());
+                coeffs = large.data();
+            }
+
+            for(std::size_t i = 0; i < t.coeffs.size(); ++i)
+                coeffs[i] = boost::apply_visitor(*this, t.coeffs[i]);
+
+            return evaluate_polynomial(coeffs, t.coeffs.size(), x);
+        }
+        NumType operator()(const t_sum<NumType>& t)
+        {
+            return reduce_operands<NumType>(t.ops.size(), [&](std::size_t i) { return boost::apply_visitor(*this, t.ops[i]); },
+                                            std::plus<NumType>());
+        }
+        NumType operator()(const t_product<NumType>& t)
+        {
+            return reduce_operands<NumType>(t.ops.size(), [&](std::size_t i) { return boost::apply_visitor(*this, t.ops[i]); },
+                                            std::multiplies<NumType>());
+        }
+    };
+}
 
+template <typename NumType, typename State>
+NumType eval_expression_tree(const State& c, const t_expression<NumType>& t)
+{
+    calculator_detail::evaluator<NumType, State> visitor(c, nullptr);
     return boost::apply_visitor(visitor, t);
 }
 
+// Never throws on undefined variables or functions or bad calls
+template <typename NumType, typename State>
+expected<NumType> try_eval_expression_tree(const State& c, const t_expression<NumType>& t)
+{
+    error_info error;
+    calculator_detail::evaluator<NumType, State> visitor(c, &error);
+    NumType n = boost::apply_visitor(visitor, t);
+    if(error)
+        return expected<NumType>(std::move(error));
+    return expected<NumType>(n);
+}
+
+// Admission check for untrusted expressions: throws eval_error if the
+// estimated cost of t exceeds the limits
+template <typename NumType>
+void check_expression_limits(const t_expression<NumType>& t, const resource_limits& limits)
+{
+    error_info error = check_limits(estimate_cost(t), limits);
+    if(error)
+        throw eval_error(error.message());
+}
+
+// Evaluation does not start if the estimated cost exceeds the limits
+template <typename NumType, typename State>
+NumType eval_expression_tree(const State& c, const t_expression<NumType>& t, const resource_limits& limits)
+{
+    check_expression_limits(t, limits);
+    return eval_expression_tree(c, t);
+}
+
+template <typename NumType, typename State>
+expected<NumType> try_eval_expression_tree(const State& c, const t_expression<NumType>& t, const resource_limits& limits)
+{
+    error_info error = check_limits(estimate_cost(t), limits);
+    if(error)
+        return expected<NumType>(std::move(error));
+    return try_eval_expression_tree(c, t);
+}
+
 template <typename NumType>
 void process_variable_definition(calculator_state<NumType>& c, const t_var_definition<NumType>& t)
 {
@@ -0,0 +1,101 @@
+#ifndef CHAR_SCAN_H_INCLUDED
+#define CHAR_SCAN_H_INCLUDED
+
+#include <cstddef>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Character class scans for the lexer's hot loops. Each returns a pointer to
+// the first character in [first, last) outside the class, or last. The
+// classes match the "C" locale: isspace is " \t\n\v\f\r", islower is a-z.
+// Vector widths are chosen at compile time; bytes >= 0x80 compare as
+// negative and so never fall in either class, as with the scalar tests.
+
+inline bool is_space_char(char c)
+{
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+inline bool is_lower_char(char c)
+{
+    return c >= 'a' && c <= 'z';
+}
+
+namespace char_scan_detail
+{
+#if defined(__AVX2__)
+    typedef __m256i vec;
+    const std::size_t width = 32;
+
+    inline vec load(const char* p) { return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p)); }
+    inline vec splat(char c) { return _mm256_set1_epi8(c); }
+    inline vec eq(vec a, vec b) { return _mm256_cmpeq_epi8(a, b); }
+    inline vec gt(vec a, vec b) { return _mm256_cmpgt_epi8(a, b); }
+    inline vec both(vec a, vec b) { return _mm256_and_si256(a, b); }
+    inline unsigned int mask(vec a) { return static_cast<unsigned int>(_mm256_movemask_epi8(a)); }
+    const unsigned int full_mask = 0xFFFFFFFFu;
+#elif defined(__SSE2__)
+    typedef __m128i vec;
+    const std::size_t width = 16;
+
+    inline vec load(const char* p) { return _mm_loadu_si128(reinterpret_cast<const __m128i*>(p)); }
+    inline vec splat(char c) { return _mm_set1_epi8(c); }
+    inline vec eq(vec a, vec b) { return _mm_cmpeq_epi8(a, b); }
+    inline vec gt(vec a, vec b) { return _mm_cmpgt_epi8(a, b); }
+    inline vec both(vec a, vec b) { return _mm_and_si128(a, b); }
+    inline unsigned int mask(vec a) { return static_cast<unsigned int>(_mm_movemask_epi8(a)); }
+    const unsigned int full_mask = 0xFFFFu;
+#endif
+
+#if defined(__AVX2__) || defined(__SSE2__)
+    // Bit i of the result is set if byte i lies in [lo, hi]
+    inline unsigned int in_range(vec v, char lo, char hi)
+    {
+        return mask(both(gt(v, splat(lo - 1)), gt(splat(hi + 1), v)));
+    }
+
+    inline unsigned int first_set(unsigned int m)
+    {
+        return __builtin_ctz(m);
+    }
+#endif
+}
+
+inline const char* find_not_space(const char* first, const char* last)
+{
+#if defined(__AVX2__) || defined(__SSE2__)
+    using namespace char_scan_detail;
+
+    for(; static_cast<std::size_t>(last - first) >= width; first += width)
+    {
+        vec v = load(first);
+        unsigned int spaces = mask(eq(v, splat(' '))) | in_range(v, '\t', '\r');
+        if(spaces != full_mask)
+            return first + first_set(~spaces & full_mask);
+    }
+#endif
+    while(first != last && is_space_char(*first)) ++first;
+    return first;
+}
+
+inline const char* find_not_lower(const char* first, const char* last)
+{
+#if defined(__AVX2__) || defined(__SSE2__)
+    using namespace char_scan_detail;
+
+    for(; static_cast<std::size_t>(last - first) >= width; first += width)
+    {
+        unsigned int lower = in_range(load(first), 'a', 'z');
+        if(lower != full_mask)
+            return first + first_set(~lower & full_mask);
+    }
+#endif
+    while(first != last && is_lower_char(*first)) ++first;
+    return first;
+}
+
+#endif // CHAR_SCAN_H_INCLUDED
@@ -0,0 +1,127 @@
+#ifndef CHUNKED_INPUT_H_INCLUDED
+#define CHUNKED_INPUT_H_INCLUDED
+
+#include <istream>
+#include <streambuf>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <algorithm>
+#include <cstddef>
+#include <iterator>
+
+// Reads a stream in large blocks so the lexer can scan straight out of a
+// buffer instead of pulling one character at a time through the streambuf
+class chunked_reader
+{
+    std::istream& is;
+    std::vector<char> buf;
+    const char* head;
+    const char* tail;
+
+public:
+
+    static const std::size_t default_chunk_size = 1 << 16;
+
+    chunked_reader(std::istream& _is, std::size_t chunk_size = default_chunk_size): is(_is), buf(chunk_size), head(nullptr), tail(nullptr)
+    {
+        refill();
+    }
+
+    // Takes up to a chunk of what the stream already holds. Only when it
+    // holds nothing does this block, and then just until some input
+    // arrives, so a parser over a terminal sees each line as it is typed
+    // rather than waiting for a full chunk. A stream buffer that cannot
+    // say what it holds, such as std::cin while synced with stdio, is
+    // read a character at a time. Returns false once the stream is
+    // exhausted.
+    bool refill()
+    {
+        typedef std::char_traits<char> traits;
+
+        std::streambuf* sb = is.rdbuf();
+        std::streamsize n = 0;
+        if(sb && !traits::eq_int_type(sb->sgetc(), traits::eof()))
+        {
+            std::streamsize available = std::max<std::streamsize>(sb->in_avail(), 1);
+            n = sb->sgetn(buf.data(), std::min<std::streamsize>(available, buf.size()));
+        }
+        else
+            is.setstate(std::ios::eofbit);
+
+        head = buf.data();
+        tail = head + n;
+        return head != tail;
+    }
+
+    const char*& cursor() { return head; }
+    const char* limit() const { return tail; }
+
+    bool at_end() const { return head == tail; }
+};
+
+class chunked_istream_iterator
+{
+    std::shared_ptr<chunked_reader> reader;
+
+    struct postfix_proxy
+    {
+        char c;
+
+        char operator*() const { return c; }
+    };
+
+public:
+
+    typedef std::input_iterator_tag iterator_category;
+    typedef char value_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef const char* pointer;
+    typedef char reference;
+
+    chunked_istream_iterator() {}
+    chunked_istream_iterator(std::istream& is, std::size_t chunk_size = chunked_reader::default_chunk_size): reader(std::make_shared<chunked_reader>(is, chunk_size)) {}
+
+    chunked_reader* source() const
+    {
+        return reader.get();
+    }
+
+    bool at_end() const
+    {
+        return !reader || reader->at_end();
+    }
+
+    char operator*() const
+    {
+        return *reader->cursor();
+    }
+
+    chunked_istream_iterator& operator++()
+    {
+        if(++reader->cursor() == reader->limit())
+            reader->refill();
+        return *this;
+    }
+
+    postfix_proxy operator++(int)
+    {
+        postfix_proxy p = {**this};
+        ++*this;
+        return p;
+    }
+
+    friend bool operator==(const chunked_istream_iterator& a, const chunked_istream_iterator& b)
+    {
+        return a.at_end() == b.at_end();
+    }
+
+    friend bool operator!=(const chunked_istream_iterator& a, const chunked_istream_iterator& b)
+    {
+        return !(a == b);
+    }
+};
+
+#endif // CHUNKED_INPUT_H_INCLUDED
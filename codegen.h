@@ -0,0 +1,581 @@
+#ifndef CODEGEN_H_INCLUDED
+#define CODEGEN_H_INCLUDED
+
+#include <fstream>
+#include <iterator>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <cerrno>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <stdexcept>
+#include <utility>
+
+#include <dlfcn.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <boost/variant.hpp>
+
+#include "batch.h"
+#include "calculator.h"
+#include "functions.h"
+#include "polynomial.h"
+#include "tree.h"
+
+// Ahead-of-time backend: expressions are written out as C, built into a
+// shared object by the system compiler and loaded with dlopen. Each
+// expression k becomes
+//
+//     double mep_expr_k(const double* values);
+//     void mep_batch_k(const double* const* columns, double* out, size_t n);
+//
+// reading its variables in the order variables(k) lists them. Objects are
+// cached on disk under a hash of the source, compiler and flags, so a
+// library of expressions is compiled once and later runs only load it.
+//
+// The code is compiled without floating-point contraction and calls libm,
+// so with the same libm it rounds exactly as eval_expression_tree does.
+
+class codegen_error : public std::exception
+{
+    std::string msg;
+
+public:
+
+    codegen_error(std::string _msg): msg(std::move(_msg)) {}
+
+    const char* what() const noexcept
+    {
+        return msg.c_str();
+    }
+};
+
+struct codegen_options
+{
+    // Defaults to $CC, or cc
+    std::string compiler;
+    std::string flags;
+    // Defaults to $MEP_CACHE, or $HOME/.cache/mep
+    std::string cache_directory;
+
+    codegen_options(): flags("-O2") {}
+};
+
+namespace codegen_detail
+{
+    // Flags the generated code relies on, whatever the caller's flags are
+    const char* const required_flags = "-std=c99 -fPIC -shared -ffp-contract=off";
+
+    // Mirrors multiply_add, evaluate_polynomial and the min and max
+    // kernels of functions.h. Whether to fuse is decided by this program's
+    // build, not by the flags the generated code is compiled with, and is
+    // written into the source as MEP_USE_FMA.
+    const char* const prelude =
+        "#include <math.h>\n"
+        "#include <stddef.h>\n"
+        "\n"
+        "static double mep_multiply_add(double a, double b, double c)\n"
+        "{\n"
+        "#if MEP_USE_FMA\n"
+        "    return fma(a, b, c);\n"
+        "#else\n"
+        "    return a * b + c;\n"
+        "#endif\n"
+        "}\n"
+        "\n"
+        "static double mep_polynomial(double* c, size_t n, double x)\n"
+        "{\n"
+        "    if(n == 0)\n"
+        "        return 0;\n"
+        "    if(n < MEP_ESTRIN_MIN)\n"
+        "    {\n"
+        "        double r = c[n-1];\n"
+        "        for(size_t k = n - 1; k > 0; --k)\n"
+        "            r = mep_multiply_add(r, x, c[k-1]);\n"
+        "        return r;\n"
+        "    }\n"
+        "    while(n > 1)\n"
+        "    {\n"
+        "        size_t half = n / 2;\n"
+        "        for(size_t i = 0; i < half; ++i)\n"
+        "            c[i] = mep_multiply_add(c[2*i+1], x, c[2*i]);\n"
+        "        if(n % 2)\n"
+        "            c[half] = c[n-1];\n"
+        "        n = half + n % 2;\n"
+        "        x = x * x;\n"
+        "    }\n"
+        "    return c[0];\n"
+        "}\n"
+        "\n"
+        "static double mep_min(double a, double b) { return b < a ? b : a; }\n"
+        "static double mep_max(double a, double b) { return b > a ? b : a; }\n"
+        "\n";
+
+    inline std::string c_function_name(const std::string& name)
+    {
+        static const std::unordered_map<std::string, std::string> names = {
+            {"sqrt", "sqrt"}, {"exp", "exp"}, {"log", "log"}, {"sin", "sin"}, {"cos", "cos"},
+            {"tanh", "tanh"}, {"abs", "fabs"}, {"min", "mep_min"}, {"max", "mep_max"}
+        };
+        auto it = names.find(name);
+        return it != names.end() ? it->second : std::string();
+    }
+
+    inline std::string c_constant(double d)
+    {
+        if(std::isnan(d))
+            return "NAN";
+        if(std::isinf(d))
+            return d < 0 ? "(-HUGE_VAL)" : "HUGE_VAL";
+
+        char buf[32];
+        std::snprintf(buf, sizeof(buf), "%.17g", d);
+        std::string s = buf;
+        if(s.find_first_of(".e") == std::string::npos)
+            s += ".0";
+        return "(" + s + ")";
+    }
+
+    // Writes t as a C expression, naming variable i by variable(i). Every
+    // operation is parenthesized, so C precedence never regroups it.
+    class expression_writer
+    {
+        std::ostream& o;
+        std::unordered_map<std::string, std::size_t>& slots;
+        std::vector<std::string>& names;
+        std::string (*variable)(std::size_t);
+
+        void write_variable(const std::string& name)
+        {
+            auto it = slots.find(name);
+            if(it == slots.end())
+            {
+                it = slots.emplace(name, names.size()).first;
+                names.push_back(name);
+            }
+            o << variable(it->second);
+        }
+
+        void binary(const t_binary_op<double>& t, const char* op)
+        {
+            o << '(';
+            write(t.ops[0]);
+            o << ' ' << op << ' ';
+            write(t.ops[1]);
+            o << ')';
+        }
+
+        // Parenthesized in the association of reduce_operands, which C
+        // keeps with -ffp-contract=off
+        void nary(const t_nary_op<double>& t, const char* op)
+        {
+            std::string text = reduce_operands<std::string>(t.ops.size(),
+                [&](std::size_t i)
+                {
+                    std::ostringstream operand;
+                    expression_writer(operand, slots, names, variable).write(t.ops[i]);
+                    return operand.str();
+                },
+                [&](const std::string& lhs, const std::string& rhs) { return '(' + lhs + ' ' + op + ' ' + rhs + ')'; });
+            o << text;
+        }
+
+    public:
+        expression_writer(std::ostream& _o, std::unordered_map<std::string, std::size_t>& _slots,
+                          std::vector<std::string>& _names, std::string (*_variable)(std::size_t)):
+            o(_o), slots(_slots), names(_names), variable(_variable) {}
+
+        void write(const t_expression<double>& t)
+        {
+            struct visitor_t : public boost::static_visitor<void>
+            {
+                expression_writer& w;
+
+                visitor_t(expression_writer& _w): w(_w) {}
+
+                void operator()(double n)
+                {
+                    w.o << c_constant(n);
+                }
+                void operator()(const t_var_occurrance<double>& t)
+                {
+                    w.write_variable(t.name);
+                }
+                void operator()(const t_arg_placeholder<double>& t)
+                {
+                    throw std::logic_error("t_arg_placeholder encountered while generating code");
+                }
+                void operator()(const t_func_invocation<double>& t)
+                {
+                    const builtin_function* f = find_builtin_function(t.name);
+                    if(!f)
+                        throw eval_error("Undefined function");
+                    if(t.args.size() != f->arity)
+                        throw eval_error("Wrong number of arguments to " + t.name);
+
+                    w.o << c_function_name(t.name) << '(';
+                    for(std::size_t i = 0; i < t.args.size(); ++i)
+                    {
+                        if(i)
+                            w.o << ", ";
+                        w.write(t.args[i]);
+                    }
+                    w.o << ')';
+                }
+                void operator()(const t_negate<double>& t)
+                {
+                    w.o << "(-";
+                    w.write(t.op);
+                    w.o << ')';
+                }
+                void operator()(const t_add<double>& t)
+                {
+                    w.binary(t, "+");
+                }
+                void operator()(const t_subtract<double>& t)
+                {
+                    w.binary(t, "-");
+                }
+                void operator()(const t_multiply<double>& t)
+                {
+                    w.binary(t, "*");
+                }
+                void operator()(const t_divide<double>& t)
+                {
+                    w.binary(t, "/");
+                }
+                void operator()(const t_exponentiate<double>& t)
+                {
+                    w.o << "pow(";
+                    w.write(t.ops[0]);
+                    w.o << ", ";
+                    w.write(t.ops[1]);
+                    w.o << ')';
+                }
+                void operator()(const t_polynomial<double>& t)
+                {
+                    if(t.coeffs.empty())
+                    {
+                        w.o << c_constant(0);
+                        return;
+                    }
+
+                    // A compound literal, since mep_polynomial overwrites
+                    // its coefficients
+                    w.o << "mep_polynomial((double[]){";
+                    for(std::size_t i = 0; i < t.coeffs.size(); ++i)
+                    {
+                        if(i)
+                            w.o << ", ";
+                        w.write(t.coeffs[i]);
+                    }
+                    w.o << "}, " << t.coeffs.size() << ", ";
+                    w.write_variable(t.var);
+                    w.o << ')';
+                }
+                void operator()(const t_sum<double>& t)
+                {
+                    w.nary(t, "+");
+                }
+                void operator()(const t_product<double>& t)
+                {
+                    w.nary(t, "*");
+                }
+            } visitor(*this);
+
+            boost::apply_visitor(visitor, t);
+        }
+    };
+
+    inline std::string scalar_variable(std::size_t i)
+    {
+        return "values[" + std::to_string(i) + "]";
+    }
+
+    inline std::string column_variable(std::size_t i)
+    {
+        return "c" + std::to_string(i) + "[i]";
+    }
+
+    // 64-bit FNV-1a
+    inline std::uint64_t content_hash(const std::string& s)
+    {
+        std::uint64_t h = 14695981039346656037ULL;
+        for(unsigned char c : s)
+        {
+            h ^= c;
+            h *= 1099511628211ULL;
+        }
+        return h;
+    }
+
+    inline std::string quote(const std::string& s)
+    {
+        std::string r = "'";
+        for(char c : s)
+        {
+            if(c == '\'')
+                r += "'\\''";
+            else
+                r += c;
+        }
+        return r + "'";
+    }
+
+    // Creates path and any missing parents
+    inline void make_directories(const std::string& path)
+    {
+        for(std::size_t i = 1; i <= path.size(); ++i)
+        {
+            if(i == path.size() || path[i] == '/')
+            {
+                std::string prefix = path.substr(0, i);
+                if(mkdir(prefix.c_str(), 0755) != 0 && errno != EEXIST)
+                    throw codegen_error("Cannot create directory " + prefix);
+            }
+        }
+    }
+
+    inline std::string environment(const char* name, const std::string& otherwise)
+    {
+        const char* v = std::getenv(name);
+        return v && *v ? std::string(v) : otherwise;
+    }
+}
+
+// Writes the C source for expressions. variables[k] receives the variables
+// of expression k in the order its functions read them.
+inline std::string generate_c_source(const std::vector<t_expression<double>>& expressions, std::vector<std::vector<std::string>>& variables)
+{
+    using namespace codegen_detail;
+
+    std::ostringstream o;
+    o << "#define MEP_ESTRIN_MIN " << estrin_min_coefficients << '\n';
+#ifdef FP_FAST_FMA
+    o << "#define MEP_USE_FMA 1\n";
+#else
+    o << "#define MEP_USE_FMA 0\n";
+#endif
+    o << prelude;
+
+    variables.assign(expressions.size(), std::vector<std::string>());
+    for(std::size_t k = 0; k < expressions.size(); ++k)
+    {
+        std::unordered_map<std::string, std::size_t> slots;
+        std::vector<std::string>& names = variables[k];
+
+        o << "double mep_expr_" << k << "(const double* values)\n{\n    (void)values;\n    return ";
+        expression_writer(o, slots, names, &scalar_variable).write(expressions[k]);
+        o << ";\n}\n\n";
+
+        // Same slots, so the batch function finds the scalar one's order
+        std::ostringstream body;
+        expression_writer(body, slots, names, &column_variable).write(expressions[k]);
+
+        o << "void mep_batch_" << k << "(const double* const* columns, double* restrict out, size_t n)\n{\n    (void)columns;\n";
+        for(std::size_t i = 0; i < names.size(); ++i)
+            o << "    const double* restrict c" << i << " = columns[" << i << "];\n";
+        o << "    for(size_t i = 0; i < n; ++i)\n        out[i] = " << body.str() << ";\n}\n\n";
+    }
+    return o.str();
+}
+
+// Expressions built into native code and loaded into this process
+class native_expressions
+{
+    typedef double (*scalar_function)(const double*);
+    typedef void (*batch_function)(const double* const*, double*, std::size_t);
+
+    void* handle;
+    std::string path;
+    bool from_cache;
+    std::vector<std::vector<std::string>> names;
+    std::vector<scalar_function> scalar;
+    std::vector<batch_function> batch;
+
+    void* symbol(const std::string& name)
+    {
+        void* p = dlsym(handle, name.c_str());
+        if(!p)
+            throw codegen_error("Missing symbol " + name + " in " + path);
+        return p;
+    }
+
+    void load(std::uint64_t hash)
+    {
+        handle = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+        if(!handle)
+            throw codegen_error("Cannot load " + path + ": " + dlerror());
+
+        // Guards against a file at the cached name that was not built from
+        // this source
+        if(*static_cast<const std::uint64_t*>(symbol("mep_content_hash")) != hash)
+        {
+            dlclose(handle);
+            handle = nullptr;
+            throw codegen_error("Cached object " + path + " does not match its source");
+        }
+
+        for(std::size_t k = 0; k < names.size(); ++k)
+        {
+            std::string n = std::to_string(k);
+            scalar.push_back(reinterpret_cast<scalar_function>(symbol("mep_expr_" + n)));
+            batch.push_back(reinterpret_cast<batch_function>(symbol("mep_batch_" + n)));
+        }
+    }
+
+    void build(const std::string& source, const std::string& compiler, const std::string& flags, const std::string& stem)
+    {
+        using codegen_detail::quote;
+
+        // Built under names unique to this process and renamed into place,
+        // so concurrent builders never see each other's partial files
+        std::string tag = "." + std::to_string(getpid());
+        std::string c_path = stem + ".c", tmp_c = c_path + tag + ".c", tmp_so = path + tag, log = stem + tag + ".log";
+
+        {
+            std::ofstream os(tmp_c, std::ios::binary);
+            os << source;
+            if(!os)
+                throw codegen_error("Cannot write " + tmp_c);
+        }
+
+        std::string command = compiler + " " + flags + " " + codegen_detail::required_flags + " -o " + quote(tmp_so) + " " +
+                              quote(tmp_c) + " -lm 2> " + quote(log);
+        int status = std::system(command.c_str());
+        if(status != 0)
+        {
+            std::ifstream is(log);
+            std::string output((std::istreambuf_iterator<char>(is)), std::istreambuf_iterator<char>());
+            std::remove(tmp_c.c_str());
+            std::remove(tmp_so.c_str());
+            std::remove(log.c_str());
+            throw codegen_error("Compilation failed: " + command + "\n" + output);
+        }
+
+        std::remove(log.c_str());
+        if(std::rename(tmp_so.c_str(), path.c_str()) != 0 || std::rename(tmp_c.c_str(), c_path.c_str()) != 0)
+            throw codegen_error("Cannot move the compiled object to " + path);
+    }
+
+public:
+    explicit native_expressions(const std::vector<t_expression<double>>& expressions, const codegen_options& options = codegen_options()):
+        handle(nullptr), from_cache(true)
+    {
+        using namespace codegen_detail;
+
+        std::string compiler = options.compiler.empty() ? environment("CC", "cc") : options.compiler;
+        std::string directory = options.cache_directory;
+        if(directory.empty())
+            directory = environment("MEP_CACHE", environment("HOME", ".") + "/.cache/mep");
+
+        std::string source = generate_c_source(expressions, names);
+        std::uint64_t hash = content_hash(compiler + '\n' + options.flags + '\n' + required_flags + '\n' + source);
+
+        char hex[17];
+        std::snprintf(hex, sizeof(hex), "%016llx", static_cast<unsigned long long>(hash));
+        source += "const unsigned long long mep_content_hash = 0x" + std::string(hex) + "ULL;\n";
+
+        make_directories(directory);
+        std::string stem = directory + "/mep-" + hex;
+        path = stem + ".so";
+
+        if(access(path.c_str(), R_OK) != 0)
+        {
+            from_cache = false;
+            build(source, compiler, options.flags, stem);
+        }
+        load(hash);
+    }
+
+    explicit native_expressions(const t_expression<double>& t, const codegen_options& options = codegen_options()):
+        native_expressions(std::vector<t_expression<double>>(1, t), options) {}
+
+    ~native_expressions()
+    {
+        if(handle)
+            dlclose(handle);
+    }
+
+    native_expressions(const native_expressions&) = delete;
+    native_expressions& operator=(const native_expressions&) = delete;
+
+    std::size_t size() const
+    {
+        return names.size();
+    }
+
+    const std::vector<std::string>& variables(std::size_t k) const
+    {
+        return names[k];
+    }
+
+    // True if the object was already in the cache and nothing was compiled
+    bool cached() const
+    {
+        return from_cache;
+    }
+
+    const std::string& library_path() const
+    {
+        return path;
+    }
+
+    // values holds variables(k) in order
+    double evaluate(std::size_t k, const double* values) const
+    {
+        return scalar[k](values);
+    }
+
+    template <typename State>
+    double evaluate(std::size_t k, const State& c) const
+    {
+        double small[16];
+        std::vector<double> large;
+        double* values = small;
+        if(names[k].size() > 16)
+        {
+            large.resize(names[k].size());
+            values = large.data();
+        }
+
+        for(std::size_t i = 0; i < names[k].size(); ++i)
+        {
+            const double* value = lookup_variable(c, names[k][i]);
+            if(!value)
+                throw eval_error("Undefined variable");
+            values[i] = *value;
+        }
+        return scalar[k](values);
+    }
+
+    // Computes out[first, last) for expression k; out is indexed by row
+    // like the columns
+    void evaluate(std::size_t k, const batch_columns& columns, double* out, std::size_t first, std::size_t last) const
+    {
+        std::vector<const double*> bound(names[k].size());
+        for(std::size_t i = 0; i < bound.size(); ++i)
+        {
+            bound[i] = columns.find(names[k][i]);
+            if(!bound[i])
+                throw eval_error("Undefined variable");
+            bound[i] += first;
+        }
+        batch[k](bound.data(), out + first, last - first);
+    }
+
+    void evaluate(std::size_t k, const batch_columns& columns, double* out) const
+    {
+        evaluate(k, columns, out, 0, columns.rows());
+    }
+};
+
+#endif // CODEGEN_H_INCLUDED
@@ -0,0 +1,376 @@
+#ifndef CONCURRENT_STATE_H_INCLUDED
+#define CONCURRENT_STATE_H_INCLUDED
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <atomic>
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <thread>
+
+#include "calculator.h"
+#include "tree.h"
+
+// Variables shared by many evaluating threads and updated by writers.
+// Each version of the variable set is an immutable hash array mapped trie:
+// a definition copies only the nodes on the path to its key and shares the
+// rest with the previous version, so publishing a version costs O(log n)
+// however many variables there are. Readers hold versions through
+// shared_ptr and never see one change under them; a version and any nodes
+// no later version shares are freed when its last reader lets go.
+
+namespace concurrent_state_detail
+{
+    const unsigned int bits_per_level = 5;
+    const unsigned int hash_bits = sizeof(std::size_t) * CHAR_BIT;
+
+    inline unsigned int popcount(std::uint32_t x)
+    {
+        return static_cast<unsigned int>(__builtin_popcount(x));
+    }
+
+    template <typename NumType>
+    struct entry
+    {
+        std::string name;
+        std::size_t hash;
+        NumType value;
+    };
+
+    template <typename NumType>
+    struct node;
+
+    // Exactly one of child and leaf is set
+    template <typename NumType>
+    struct slot
+    {
+        std::shared_ptr<const node<NumType>> child;
+        std::shared_ptr<const entry<NumType>> leaf;
+    };
+
+    // Below hash_bits of depth the hash is used up, and entries whose full
+    // hashes collide are kept unordered in collisions instead of slots
+    template <typename NumType>
+    struct node
+    {
+        std::uint32_t bitmap;
+        std::vector<slot<NumType>> slots;
+        std::vector<std::shared_ptr<const entry<NumType>>> collisions;
+
+        node(): bitmap(0) {}
+    };
+
+    template <typename NumType>
+    const NumType* find(const node<NumType>* n, std::size_t hash, const std::string& name)
+    {
+        for(unsigned int shift = 0; n; shift += bits_per_level)
+        {
+            if(shift >= hash_bits)
+            {
+                for(const auto& e : n->collisions)
+                {
+                    if(e->name == name)
+                        return &e->value;
+                }
+                return nullptr;
+            }
+
+            std::uint32_t bit = std::uint32_t(1) << ((hash >> shift) & 31);
+            if(!(n->bitmap & bit))
+                return nullptr;
+
+            const slot<NumType>& s = n->slots[popcount(n->bitmap & (bit - 1))];
+            if(s.leaf)
+                return s.leaf->hash == hash && s.leaf->name == name ? &s.leaf->value : nullptr;
+            n = s.child.get();
+        }
+        return nullptr;
+    }
+
+    // Returns a copy of n (which may be null) with e added or replacing the
+    // entry of the same name; added is set if the name was new
+    template <typename NumType>
+    std::shared_ptr<const node<NumType>> insert(const node<NumType>* n, unsigned int shift,
+                                                std::shared_ptr<const entry<NumType>> e, bool& added)
+    {
+        std::shared_ptr<node<NumType>> result = n ? std::make_shared<node<NumType>>(*n) : std::make_shared<node<NumType>>();
+
+        if(shift >= hash_bits)
+        {
+            for(auto& c : result->collisions)
+            {
+                if(c->name == e->name)
+                {
+                    c = std::move(e);
+                    return result;
+                }
+            }
+            result->collisions.push_back(std::move(e));
+            added = true;
+            return result;
+        }
+
+        std::uint32_t bit = std::uint32_t(1) << ((e->hash >> shift) & 31);
+        std::size_t pos = popcount(result->bitmap & (bit - 1));
+
+        if(!(result->bitmap & bit))
+        {
+            slot<NumType> s;
+            s.leaf = std::move(e);
+            result->slots.insert(result->slots.begin() + pos, std::move(s));
+            result->bitmap |= bit;
+            added = true;
+            return result;
+        }
+
+        slot<NumType>& s = result->slots[pos];
+        if(s.child)
+        {
+            s.child = insert(s.child.get(), shift + bits_per_level, std::move(e), added);
+        }
+        else if(s.leaf->name == e->name)
+        {
+            s.leaf = std::move(e);
+        }
+        else
+        {
+            bool unused = false;
+            std::shared_ptr<const node<NumType>> child = insert<NumType>(nullptr, shift + bits_per_level, std::move(s.leaf), unused);
+            s.child = insert(child.get(), shift + bits_per_level, std::move(e), added);
+        }
+        return result;
+    }
+
+    template <typename NumType, typename Function>
+    void for_each(const node<NumType>* n, Function& f)
+    {
+        if(!n)
+            return;
+        for(const auto& s : n->slots)
+        {
+            if(s.leaf)
+                f(s.leaf->name, s.leaf->value);
+            else
+                for_each(s.child.get(), f);
+        }
+        for(const auto& e : n->collisions)
+            f(e->name, e->value);
+    }
+}
+
+template <typename NumType>
+class concurrent_calculator_state;
+
+// One immutable version of the variable set. Copies are cheap and share
+// structure; with() returns a new version and leaves this one unchanged.
+template <typename NumType>
+class state_snapshot
+{
+    std::shared_ptr<const concurrent_state_detail::node<NumType>> root;
+    std::size_t count;
+    std::uint64_t number;
+
+    friend class concurrent_calculator_state<NumType>;
+
+public:
+    state_snapshot(): count(0), number(0) {}
+
+    // Null if name is undefined in this version
+    const NumType* find(const std::string& name) const
+    {
+        return concurrent_state_detail::find(root.get(), std::hash<std::string>()(name), name);
+    }
+
+    std::size_t size() const
+    {
+        return count;
+    }
+
+    std::uint64_t version() const
+    {
+        return number;
+    }
+
+    state_snapshot with(const std::string& name, NumType value) const
+    {
+        std::shared_ptr<const concurrent_state_detail::entry<NumType>> e(
+            new concurrent_state_detail::entry<NumType>{name, std::hash<std::string>()(name), value});
+
+        state_snapshot result;
+        bool added = false;
+        result.root = concurrent_state_detail::insert(root.get(), 0, std::move(e), added);
+        result.count = count + (added ? 1 : 0);
+        result.number = number + 1;
+        return result;
+    }
+
+    // Calls f(name, value) for every variable, in no particular order
+    template <typename Function>
+    void for_each(Function f) const
+    {
+        concurrent_state_detail::for_each(root.get(), f);
+    }
+};
+
+template <typename NumType>
+const NumType* lookup_variable(const state_snapshot<NumType>& c, const std::string& name)
+{
+    return c.find(name);
+}
+
+// Holds the current version behind a plain atomic pointer, so readers
+// never take a lock, not even the spinlock std::atomic_load uses for a
+// shared_ptr. A reader enters the current epoch by incrementing its
+// counter, copies the shared_ptr out of the published holder and leaves
+// again; it retries only if a writer flipped the epoch in between. Writers
+// are serialized with each other, publish a new holder, flip the epoch and
+// wait for the readers of the previous one to leave before freeing the old
+// holder. Every reader sees either all of a write or none of it.
+template <typename NumType>
+class concurrent_calculator_state
+{
+    struct holder
+    {
+        std::shared_ptr<const state_snapshot<NumType>> snapshot;
+    };
+
+    std::atomic<holder*> current;
+    std::atomic<std::uint64_t> published;
+    std::atomic<unsigned int> epoch;
+    mutable std::atomic<std::size_t> readers[2];
+    std::mutex writer;
+
+    // Callers hold writer
+    void publish(state_snapshot<NumType> next)
+    {
+        std::uint64_t version = next.version();
+        holder* previous = current.exchange(new holder{std::make_shared<state_snapshot<NumType>>(std::move(next))});
+        published.store(version, std::memory_order_release);
+
+        unsigned int old = epoch.fetch_add(1);
+        while(readers[old & 1].load() != 0)
+            std::this_thread::yield();
+        delete previous;
+    }
+
+public:
+    concurrent_calculator_state(): current(new holder{std::make_shared<state_snapshot<NumType>>()}), published(0), epoch(0)
+    {
+        readers[0].store(0);
+        readers[1].store(0);
+    }
+
+    explicit concurrent_calculator_state(const calculator_state<NumType>& initial): concurrent_calculator_state()
+    {
+        std::vector<std::pair<std::string, NumType>> values;
+        values.reserve(initial.variable_set.size());
+        initial.variable_set.for_each([&values](const std::string& name, NumType value)
+        {
+            values.emplace_back(name, value);
+        });
+        define(values);
+    }
+
+    ~concurrent_calculator_state()
+    {
+        delete current.load();
+    }
+
+    concurrent_calculator_state(const concurrent_calculator_state&) = delete;
+    concurrent_calculator_state& operator=(const concurrent_calculator_state&) = delete;
+
+    std::shared_ptr<const state_snapshot<NumType>> snapshot() const
+    {
+        unsigned int e;
+        for(;;)
+        {
+            e = epoch.load();
+            readers[e & 1].fetch_add(1);
+            if(epoch.load() == e)
+                break;
+            readers[e & 1].fetch_sub(1);
+        }
+
+        std::shared_ptr<const state_snapshot<NumType>> s = current.load()->snapshot;
+        readers[e & 1].fetch_sub(1);
+        return s;
+    }
+
+    std::uint64_t version() const
+    {
+        return published.load(std::memory_order_acquire);
+    }
+
+    void define(const std::string& name, NumType value)
+    {
+        std::lock_guard<std::mutex> guard(writer);
+        publish(snapshot()->with(name, value));
+    }
+
+    // All of values become visible in a single version
+    void define(const std::vector<std::pair<std::string, NumType>>& values)
+    {
+        std::lock_guard<std::mutex> guard(writer);
+        if(values.empty())
+            return;
+
+        state_snapshot<NumType> next = *snapshot();
+        std::uint64_t number = next.version() + 1;
+        for(const auto& v : values)
+            next = next.with(v.first, v.second);
+        next.number = number;
+        publish(std::move(next));
+    }
+
+    // Evaluated against the latest version; another writer cannot slip in
+    // between the evaluation and the publication
+    NumType define(const t_var_definition<NumType>& t)
+    {
+        std::lock_guard<std::mutex> guard(writer);
+        std::shared_ptr<const state_snapshot<NumType>> s = snapshot();
+        NumType n = eval_expression_tree(*s, t.val);
+        publish(s->with(t.name, n));
+        return n;
+    }
+
+    calculator_state<NumType> to_calculator_state() const
+    {
+        calculator_state<NumType> c;
+        std::shared_ptr<const state_snapshot<NumType>> s = snapshot();
+        c.variable_set.reserve(s->size());
+        s->for_each([&c](const std::string& name, NumType value)
+        {
+            c.variable_set[name] = value;
+        });
+        return c;
+    }
+};
+
+// Per-thread handle that keeps the snapshot it last loaded and reloads only
+// when the published version moves, so repeated reads of an unchanged state
+// touch one atomic integer. The snapshot returned stays valid until the
+// next call to current() on this reader.
+template <typename NumType>
+class snapshot_reader
+{
+    const concurrent_calculator_state<NumType>& state;
+    std::shared_ptr<const state_snapshot<NumType>> held;
+
+public:
+    explicit snapshot_reader(const concurrent_calculator_state<NumType>& _state): state(_state) {}
+
+    const state_snapshot<NumType>& current()
+    {
+        if(!held || held->version() != state.version())
+            held = state.snapshot();
+        return *held;
+    }
+};
+
+#endif // CONCURRENT_STATE_H_INCLUDED
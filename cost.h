@@ -0,0 +1,177 @@
+#ifndef COST_H_INCLUDED
+#define COST_H_INCLUDED
+
+#include <string>
+#include <vector>
+
+#include <algorithm>
+#include <cstddef>
+#include <limits>
+#include <type_traits>
+
+#include <boost/variant.hpp>
+
+#include "expected.h"
+#include "functions.h"
+#include "tree.h"
+
+// Bounds on the work one statement may cause, for callers that run
+// untrusted input. Tokens, nodes and depth are enforced while parsing, so
+// an oversized statement is rejected before its tree is built; depth also
+// bounds the parser's recursion. Operations are checked against
+// estimate_cost before evaluation starts. Expressions have no loops, so
+// the estimate fixes the work up front and nothing needs counting while
+// evaluating. Every limit defaults to unlimited.
+struct resource_limits
+{
+    std::size_t max_tokens;
+    std::size_t max_nodes;
+    std::size_t max_depth;
+    double max_operations;
+
+    resource_limits():
+        max_tokens(std::numeric_limits<std::size_t>::max()),
+        max_nodes(std::numeric_limits<std::size_t>::max()),
+        max_depth(std::numeric_limits<std::size_t>::max()),
+        max_operations(std::numeric_limits<double>::infinity()) {}
+};
+
+// What evaluating an expression with eval_expression_tree takes, from the
+// tree alone. operations is in units of an addition: every node costs one
+// for its dispatch, plus a weight for the operation itself. memory is the
+// bytes the tree occupies.
+struct expression_cost
+{
+    std::size_t nodes;
+    std::size_t depth;
+    double operations;
+    std::size_t memory;
+
+    expression_cost(): nodes(0), depth(0), operations(0), memory(0) {}
+};
+
+namespace cost_detail
+{
+    const double variable_weight = 4;
+    const double divide_weight = 4;
+    const double exponentiate_weight = 40;
+
+    template <typename NumType>
+    struct estimator : public boost::static_visitor<void>
+    {
+        expression_cost& cost;
+        std::size_t level;
+
+        estimator(expression_cost& _cost, std::size_t _level): cost(_cost), level(_level) {}
+
+        void visit(const t_expression<NumType>& t, std::size_t child_level) const
+        {
+            estimator child(cost, child_level);
+            boost::apply_visitor(child, t);
+        }
+
+        // Accounts for the node itself; T is what its variant alternative
+        // allocates
+        template <typename T>
+        void node(double weight) const
+        {
+            ++cost.nodes;
+            cost.depth = std::max(cost.depth, level);
+            cost.operations += 1 + weight;
+            cost.memory += sizeof(t_expression<NumType>);
+            if(!std::is_same<T, NumType>::value)
+                cost.memory += sizeof(T);
+        }
+
+        void children(const std::vector<t_expression<NumType>>& ops) const
+        {
+            cost.memory += ops.capacity() * sizeof(t_expression<NumType>);
+            for(const auto& i : ops)
+                visit(i, level + 1);
+        }
+
+        void operator()(const NumType& n) const
+        {
+            node<NumType>(0);
+        }
+        void operator()(const t_var_occurrance<NumType>& t) const
+        {
+            node<t_var_occurrance<NumType>>(variable_weight);
+            cost.memory += t.name.capacity();
+        }
+        void operator()(const t_arg_placeholder<NumType>& t) const
+        {
+            node<t_arg_placeholder<NumType>>(0);
+        }
+        void operator()(const t_func_invocation<NumType>& t) const
+        {
+            const builtin_function* f = find_builtin_function(t.name);
+            node<t_func_invocation<NumType>>(f ? f->cost : 0);
+            cost.memory += t.name.capacity();
+            children(t.args);
+        }
+        void operator()(const t_negate<NumType>& t) const
+        {
+            node<t_negate<NumType>>(0);
+            visit(t.op, level + 1);
+        }
+        template <typename T>
+        void binary(const T& t, double weight) const
+        {
+            node<T>(weight);
+            visit(t.ops[0], level + 1);
+            visit(t.ops[1], level + 1);
+        }
+        void operator()(const t_add<NumType>& t) const { binary(t, 0); }
+        void operator()(const t_subtract<NumType>& t) const { binary(t, 0); }
+        void operator()(const t_multiply<NumType>& t) const { binary(t, 0); }
+        void operator()(const t_divide<NumType>& t) const { binary(t, divide_weight); }
+        void operator()(const t_exponentiate<NumType>& t) const { binary(t, exponentiate_weight); }
+        void operator()(const t_polynomial<NumType>& t) const
+        {
+            // A multiply-add per coefficient, and the variable's lookup
+            node<t_polynomial<NumType>>(variable_weight + 2 * double(t.coeffs.size()));
+            cost.memory += t.var.capacity();
+            children(t.coeffs);
+        }
+        void operator()(const t_sum<NumType>& t) const
+        {
+            node<t_sum<NumType>>(t.ops.empty() ? 0 : double(t.ops.size() - 1));
+            children(t.ops);
+        }
+        void operator()(const t_product<NumType>& t) const
+        {
+            node<t_product<NumType>>(t.ops.empty() ? 0 : double(t.ops.size() - 1));
+            children(t.ops);
+        }
+    };
+}
+
+// Recurses as deep as the tree; trees parsed under a max_depth are safe
+template <typename NumType>
+expression_cost estimate_cost(const t_expression<NumType>& t)
+{
+    expression_cost cost;
+    cost_detail::estimator<NumType> e(cost, 1);
+    boost::apply_visitor(e, t);
+    return cost;
+}
+
+// The first limit the cost exceeds, if any. Tokens are only known while
+// parsing and are not checked here.
+inline error_info check_limits(const expression_cost& cost, const resource_limits& limits)
+{
+    error_info e;
+    if(cost.nodes > limits.max_nodes)
+        e.name = "max_nodes";
+    else if(cost.depth > limits.max_depth)
+        e.name = "max_depth";
+    else if(cost.operations > limits.max_operations)
+        e.name = "max_operations";
+    else
+        return e;
+    e.code = error_code::LimitExceeded;
+    return e;
+}
+
+#endif // COST_H_INCLUDED
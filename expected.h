@@ -0,0 +1,128 @@
+#ifndef EXPECTED_H_INCLUDED
+#define EXPECTED_H_INCLUDED
+
+#include <sstream>
+#include <string>
+
+#include <cstddef>
+#include <stdexcept>
+#include <utility>
+
+#include "lexer.h"
+
+// Results of the non-throwing entry points (try_parse, try_eval_expression_tree).
+// A failure is recorded as plain data, and its message is only formatted if
+// message() is called; the text matches what the throwing versions put in
+// their exceptions.
+
+enum class error_code
+{
+    None,
+    InvalidToken,
+    UnexpectedToken,
+    UndefinedVariable,
+    UndefinedFunction,
+    WrongArgumentCount,
+    LimitExceeded
+};
+
+const std::size_t no_position = ~std::size_t(0);
+
+struct error_info
+{
+    error_code code;
+    // Offset of the offending token in the input, or no_position where
+    // it is not known (evaluation, and parses over input iterators)
+    std::size_t position;
+
+    // UnexpectedToken: the grammar rule, what it expected, and the token
+    // found instead
+    const char* rule;
+    const char* expected;
+    token_tag found;
+    char found_char;
+    double found_number;
+
+    // The undefined variable or function, the function called with the
+    // wrong number of arguments, or the resource_limits field exceeded
+    std::string name;
+
+    error_info(): code(error_code::None), position(no_position), rule(""), expected(""), found(token_tag::Invalid), found_char(0), found_number(0) {}
+
+    explicit operator bool() const
+    {
+        return code != error_code::None;
+    }
+
+    std::string message() const
+    {
+        switch(code)
+        {
+        case error_code::None:
+            return "No error";
+        case error_code::InvalidToken:
+            return "Unexpected character in input to lexer";
+        case error_code::UndefinedVariable:
+            return "Undefined variable";
+        case error_code::UndefinedFunction:
+            return "Undefined function";
+        case error_code::WrongArgumentCount:
+            return "Wrong number of arguments to " + name;
+        case error_code::LimitExceeded:
+            return "Exceeded " + name;
+        case error_code::UnexpectedToken:
+            break;
+        }
+
+        std::ostringstream o;
+        o << "In rule " << rule << ": expected " << expected << ", got ";
+
+        if(found == token_tag::EOI)
+            o << "end-of-input.";
+        else if(found == token_tag::Character)
+            o << '\'' << found_char << "'.";
+        else if(found == token_tag::Number)
+            o << "number " << found_number << '.';
+        else
+            o << "invalid token.";
+        return o.str();
+    }
+};
+
+template <typename T>
+class expected
+{
+    T val;
+    error_info err;
+
+public:
+    expected(T _val): val(std::move(_val)) {}
+    expected(error_info _err): val(), err(std::move(_err)) {}
+
+    explicit operator bool() const
+    {
+        return !err;
+    }
+
+    // Only valid on success
+    const T& value() const
+    {
+        if(err)
+            throw std::logic_error("value() of a failed result: " + err.message());
+        return val;
+    }
+
+    T& value()
+    {
+        if(err)
+            throw std::logic_error("value() of a failed result: " + err.message());
+        return val;
+    }
+
+    const error_info& error() const
+    {
+        return err;
+    }
+};
+
+#endif // EXPECTED_H_INCLUDED
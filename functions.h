@@ -0,0 +1,441 @@
+#ifndef FUNCTIONS_H_INCLUDED
+#define FUNCTIONS_H_INCLUDED
+
+#include <string>
+#include <unordered_map>
+
+#include <cmath>
+#include <cstddef>
+
+#include "simd.h"
+
+// Built-in functions callable from expressions. Each has a scalar
+// implementation, used by eval_expression_tree, and a batch implementation
+// over arrays that runs vector kernels at the best available SIMD level.
+//
+// The vector kernels are not libm; max_ulp records the largest error
+// against the scalar version measured over several million arguments
+// spread across each function's domain. Lanes outside a kernel's fast range
+// (non-finite values, |x| > 1e5 for sin/cos, exp results that overflow or
+// go subnormal, non-normal log arguments) are computed by the scalar
+// version, so special values behave exactly as in libm.
+//
+// cost is the rough price of one scalar call in units of an addition, for
+// estimate_cost.
+
+const unsigned int builtin_max_arity = 2;
+
+struct builtin_function
+{
+    const char* name;
+    unsigned int arity;
+    double (*scalar)(const double* args);
+    void (*batch)(const double* const* args, double* out, std::size_t n);
+    double max_ulp;
+    double cost;
+};
+
+namespace function_detail
+{
+#ifdef MEP_SIMD_X86
+
+    // Rounds to the nearest integer by adding and removing 1.5 * 2^52; the
+    // integer is then also readable from the low bits of the sum
+    const double round_shift = 6755399441055744.0;
+
+    template <typename Isa>
+    typename Isa::vec polynomial(const typename Isa::vec& x, const double* c, std::size_t n)
+    {
+        typename Isa::vec r = Isa::splat(c[n-1]);
+        for(std::size_t k = n - 1; k > 0; --k)
+            r = Isa::fma(r, x, Isa::splat(c[k-1]));
+        return r;
+    }
+
+    template <typename Kernel, typename Isa>
+    typename Isa::vec scalar_lanes(const typename Isa::vec* a)
+    {
+        typename Isa::vec r;
+        double args[Kernel::arity];
+        for(std::size_t i = 0; i < Isa::width; ++i)
+        {
+            for(unsigned int k = 0; k < Kernel::arity; ++k)
+                args[k] = a[k][i];
+            r[i] = Kernel::scalar(args);
+        }
+        return r;
+    }
+
+    // exp for -708 < x < 709: x = n ln2 + r with |r| <= ln2/2, a degree 13
+    // Taylor polynomial for e^r, then 2^n spliced into the exponent bits
+    template <typename Isa>
+    typename Isa::vec exp_core(const typename Isa::vec& x)
+    {
+        typedef typename Isa::vec vec;
+        typedef typename Isa::ivec ivec;
+
+        static const double coeffs[] = {1.0, 1.0, 1.0 / 2, 1.0 / 6, 1.0 / 24, 1.0 / 120, 1.0 / 720, 1.0 / 5040, 1.0 / 40320,
+                                        1.0 / 362880, 1.0 / 3628800, 1.0 / 39916800, 1.0 / 479001600, 1.0 / 6227020800};
+
+        vec t = Isa::fma(x, Isa::splat(1.4426950408889634), Isa::splat(round_shift));
+        vec n = t - round_shift;
+        vec r = x - n * 6.93147180369123816490e-01;
+        r = r - n * 1.90821492927058770002e-10;
+
+        vec p = polynomial<Isa>(r, coeffs, sizeof(coeffs) / sizeof(coeffs[0]));
+        ivec e = (ivec)t - (ivec)Isa::splat(round_shift);
+        return p * (vec)((e + 1023) << 52);
+    }
+
+    struct exp_kernel
+    {
+        static const unsigned int arity = 1;
+
+        static double scalar(const double* a)
+        {
+            return std::exp(a[0]);
+        }
+
+        template <typename Isa>
+        static typename Isa::vec apply(const typename Isa::vec* a)
+        {
+            typename Isa::vec x = a[0];
+            if(Isa::any(~((x > -708.0) & (x < 709.0))))
+                return scalar_lanes<exp_kernel, Isa>(a);
+            return exp_core<Isa>(x);
+        }
+    };
+
+    // x = 2^e m with sqrt(1/2) <= m < sqrt(2), and log m = 2 atanh f where
+    // f = (m-1)/(m+1), |f| < 0.172, summed to f^21
+    struct log_kernel
+    {
+        static const unsigned int arity = 1;
+
+        static double scalar(const double* a)
+        {
+            return std::log(a[0]);
+        }
+
+        template <typename Isa>
+        static typename Isa::vec apply(const typename Isa::vec* a)
+        {
+            typedef typename Isa::vec vec;
+            typedef typename Isa::ivec ivec;
+
+            static const double coeffs[] = {1.0 / 3, 1.0 / 5, 1.0 / 7, 1.0 / 9, 1.0 / 11, 1.0 / 13, 1.0 / 15, 1.0 / 17, 1.0 / 19, 1.0 / 21};
+
+            vec x = a[0];
+            if(Isa::any(~((x >= 2.2250738585072014e-308) & (x <= 1.7976931348623157e308))))
+                return scalar_lanes<log_kernel, Isa>(a);
+
+            ivec bits = (ivec)x;
+            ivec e = (bits >> 52) - 1023;
+            vec m = (vec)((bits & 0x000FFFFFFFFFFFFFLL) | 0x3FF0000000000000LL);
+
+            ivec big = m > 1.4142135623730951;
+            m = big ? m * 0.5 : m;
+            e = e - big;
+
+            vec ed = (vec)(e + (ivec)Isa::splat(round_shift)) - round_shift;
+
+            vec f = (m - 1.0) / (m + 1.0);
+            vec f2 = f + f;
+            vec s = f * f;
+            vec q = s * polynomial<Isa>(s, coeffs, sizeof(coeffs) / sizeof(coeffs[0]));
+            vec logm = Isa::fma(f2, q, f2);
+
+            return ed * 6.93147180369123816490e-01 + (logm + ed * 1.90821492927058770002e-10);
+        }
+    };
+
+    // Reduces x by multiples of pi/2 in three parts (Cody-Waite), then picks
+    // the sine or cosine Taylor polynomial on [-pi/4, pi/4] by quadrant
+    template <typename Isa>
+    typename Isa::vec sincos_core(const typename Isa::vec& x, long long quadrant_offset)
+    {
+        typedef typename Isa::vec vec;
+        typedef typename Isa::ivec ivec;
+
+        static const double sin_coeffs[] = {-1.0 / 6, 1.0 / 120, -1.0 / 5040, 1.0 / 362880, -1.0 / 39916800,
+                                            1.0 / 6227020800, -1.0 / 1307674368000, 1.0 / 355687428096000};
+        static const double cos_coeffs[] = {1.0, -1.0 / 2, 1.0 / 24, -1.0 / 720, 1.0 / 40320, -1.0 / 3628800,
+                                            1.0 / 479001600, -1.0 / 87178291200, 1.0 / 20922789888000};
+
+        vec t = Isa::fma(x, Isa::splat(0.63661977236758134308), Isa::splat(round_shift));
+        vec n = t - round_shift;
+        vec r = x - n * 1.57079632673412561417e+00;
+        r = r - n * 6.07710050630396597660e-11;
+        r = r - n * 2.02226624871116645580e-21;
+
+        vec s = r * r;
+        vec sin_r = Isa::fma(r * s, polynomial<Isa>(s, sin_coeffs, sizeof(sin_coeffs) / sizeof(sin_coeffs[0])), r);
+        vec cos_r = polynomial<Isa>(s, cos_coeffs, sizeof(cos_coeffs) / sizeof(cos_coeffs[0]));
+
+        ivec q = (ivec)t - (ivec)Isa::splat(round_shift) + quadrant_offset;
+        vec result = (q & 1) != 0 ? cos_r : sin_r;
+        return (vec)((ivec)result ^ ((q & 2) << 62));
+    }
+
+    struct sin_kernel
+    {
+        static const unsigned int arity = 1;
+
+        static double scalar(const double* a)
+        {
+            return std::sin(a[0]);
+        }
+
+        template <typename Isa>
+        static typename Isa::vec apply(const typename Isa::vec* a)
+        {
+            if(Isa::any(~((a[0] >= -1e5) & (a[0] <= 1e5))))
+                return scalar_lanes<sin_kernel, Isa>(a);
+            // The polynomial turns -0 into +0; sin(±0) is the argument itself
+            typename Isa::vec r = sincos_core<Isa>(a[0], 0);
+            return a[0] == 0.0 ? a[0] : r;
+        }
+    };
+
+    struct cos_kernel
+    {
+        static const unsigned int arity = 1;
+
+        static double scalar(const double* a)
+        {
+            return std::cos(a[0]);
+        }
+
+        template <typename Isa>
+        static typename Isa::vec apply(const typename Isa::vec* a)
+        {
+            if(Isa::any(~((a[0] >= -1e5) & (a[0] <= 1e5))))
+                return scalar_lanes<cos_kernel, Isa>(a);
+            return sincos_core<Isa>(a[0], 1);
+        }
+    };
+
+    // Odd Taylor series below |x| = 0.5, (e^2|x| - 1)/(e^2|x| + 1) above,
+    // with the sign restored afterwards
+    struct tanh_kernel
+    {
+        static const unsigned int arity = 1;
+
+        static double scalar(const double* a)
+        {
+            return std::tanh(a[0]);
+        }
+
+        template <typename Isa>
+        static typename Isa::vec apply(const typename Isa::vec* a)
+        {
+            typedef typename Isa::vec vec;
+            typedef typename Isa::ivec ivec;
+
+            static const double coeffs[] = {-0.3333333333333333, 0.13333333333333333, -0.05396825396825397, 0.021869488536155203,
+                                            -0.008863235529902197, 0.003592128036572481, -0.0014558343870513183, 0.000590027440945586,
+                                            -0.00023912911424355248, 9.691537956929451e-05, -3.927832388331683e-05, 1.5918905069328964e-05,
+                                            -6.451689215655431e-06, 2.6147711512907546e-06, -1.0597268320104654e-06, 4.294911078273806e-07};
+
+            vec x = a[0];
+            if(Isa::any(x != x))
+                return scalar_lanes<tanh_kernel, Isa>(a);
+
+            ivec sign = (ivec)x & (-0x7FFFFFFFFFFFFFFFLL - 1);
+            vec ax = (vec)((ivec)x ^ sign);
+
+            vec s = ax * ax;
+            vec small = Isa::fma(ax * s, polynomial<Isa>(s, coeffs, sizeof(coeffs) / sizeof(coeffs[0])), ax);
+
+            vec e = exp_core<Isa>((ax < 22.0 ? ax : Isa::splat(22.0)) * 2.0);
+            vec large = (e - 1.0) / (e + 1.0);
+
+            return (vec)((ivec)(ax < 0.5 ? small : large) | sign);
+        }
+    };
+
+    struct sqrt_kernel
+    {
+        static const unsigned int arity = 1;
+
+        static double scalar(const double* a)
+        {
+            return std::sqrt(a[0]);
+        }
+
+        template <typename Isa>
+        static typename Isa::vec apply(const typename Isa::vec* a)
+        {
+            return Isa::sqrt(a[0]);
+        }
+    };
+
+    struct abs_kernel
+    {
+        static const unsigned int arity = 1;
+
+        static double scalar(const double* a)
+        {
+            return std::fabs(a[0]);
+        }
+
+        template <typename Isa>
+        static typename Isa::vec apply(const typename Isa::vec* a)
+        {
+            typedef typename Isa::ivec ivec;
+            return (typename Isa::vec)((ivec)a[0] & 0x7FFFFFFFFFFFFFFFLL);
+        }
+    };
+
+    // min and max return the first argument unless the second compares
+    // strictly smaller (larger), matching the SSE min/max instructions
+    struct min_kernel
+    {
+        static const unsigned int arity = 2;
+
+        static double scalar(const double* a)
+        {
+            return a[1] < a[0] ? a[1] : a[0];
+        }
+
+        template <typename Isa>
+        static typename Isa::vec apply(const typename Isa::vec* a)
+        {
+            return a[1] < a[0] ? a[1] : a[0];
+        }
+    };
+
+    struct max_kernel
+    {
+        static const unsigned int arity = 2;
+
+        static double scalar(const double* a)
+        {
+            return a[1] > a[0] ? a[1] : a[0];
+        }
+
+        template <typename Isa>
+        static typename Isa::vec apply(const typename Isa::vec* a)
+        {
+            return a[1] > a[0] ? a[1] : a[0];
+        }
+    };
+
+    // The tail is padded out to a full vector so every element goes through
+    // the same kernel, whatever its position in the batch
+    template <typename Kernel, typename Isa>
+    inline void map_vectors(const double* const* args, double* out, std::size_t n)
+    {
+        typedef typename Isa::vec vec;
+
+        vec a[Kernel::arity];
+        std::size_t i = 0;
+        for(; i + Isa::width <= n; i += Isa::width)
+        {
+            for(unsigned int k = 0; k < Kernel::arity; ++k)
+                a[k] = Isa::load(args[k] + i);
+            Isa::store(out + i, Kernel::template apply<Isa>(a));
+        }
+
+        if(i < n)
+        {
+            double lanes[Kernel::arity][Isa::width], result[Isa::width];
+            for(unsigned int k = 0; k < Kernel::arity; ++k)
+            {
+                for(std::size_t j = 0; j < Isa::width; ++j)
+                    lanes[k][j] = i + j < n ? args[k][i + j] : 1.0;
+                a[k] = Isa::load(lanes[k]);
+            }
+            Isa::store(result, Kernel::template apply<Isa>(a));
+            for(std::size_t j = 0; i + j < n; ++j)
+                out[i + j] = result[j];
+        }
+    }
+
+#ifdef MEP_SIMD_AVX2
+    template <typename Kernel>
+    MEP_TARGET_AVX2 MEP_FLATTEN void map_avx2(const double* const* args, double* out, std::size_t n)
+    {
+        map_vectors<Kernel, simd_avx2>(args, out, n);
+    }
+#endif
+
+    template <typename Kernel>
+    MEP_FLATTEN void map_sse2(const double* const* args, double* out, std::size_t n)
+    {
+        map_vectors<Kernel, simd_sse2>(args, out, n);
+    }
+
+#endif // MEP_SIMD_X86
+
+    template <typename Kernel>
+    void map_scalar(const double* const* args, double* out, std::size_t n)
+    {
+        double a[Kernel::arity];
+        for(std::size_t i = 0; i < n; ++i)
+        {
+            for(unsigned int k = 0; k < Kernel::arity; ++k)
+                a[k] = args[k][i];
+            out[i] = Kernel::scalar(a);
+        }
+    }
+
+    template <typename Kernel>
+    void map_batch(const double* const* args, double* out, std::size_t n)
+    {
+        switch(active_simd_level())
+        {
+#ifdef MEP_SIMD_AVX2
+        case simd_level::AVX2:
+            map_avx2<Kernel>(args, out, n);
+            break;
+#endif
+#ifdef MEP_SIMD_X86
+        case simd_level::SSE2:
+            map_sse2<Kernel>(args, out, n);
+            break;
+#endif
+        default:
+            map_scalar<Kernel>(args, out, n);
+            break;
+        }
+    }
+
+    template <typename Kernel>
+    builtin_function describe(const char* name, double max_ulp, double cost)
+    {
+        builtin_function f = {name, Kernel::arity, &Kernel::scalar, &map_batch<Kernel>, max_ulp, cost};
+        return f;
+    }
+}
+
+inline const builtin_function* find_builtin_function(const std::string& name)
+{
+    using namespace function_detail;
+
+    static const builtin_function table[] =
+    {
+        describe<sqrt_kernel>("sqrt", 0, 8),
+        describe<exp_kernel>("exp", 1, 20),
+        describe<log_kernel>("log", 2, 20),
+        describe<sin_kernel>("sin", 2, 25),
+        describe<cos_kernel>("cos", 2, 25),
+        describe<tanh_kernel>("tanh", 3, 30),
+        describe<abs_kernel>("abs", 0, 1),
+        describe<min_kernel>("min", 0, 1),
+        describe<max_kernel>("max", 0, 1)
+    };
+
+    static const std::unordered_map<std::string, const builtin_function*> index = []
+    {
+        std::unordered_map<std::string, const builtin_function*> m;
+        for(const auto& f : table)
+            m.emplace(f.name, &f);
+        return m;
+    }();
+
+    auto it = index.find(name);
+    return it != index.end() ? it->second : nullptr;
+}
+
+#endif // FUNCTIONS_H_INCLUDED
@@ -0,0 +1,309 @@
+#ifndef INCREMENTAL_PARSER_H_INCLUDED
+#define INCREMENTAL_PARSER_H_INCLUDED
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <utility>
+
+#include "char_scan.h"
+#include "cost.h"
+#include "expected.h"
+#include "lexer.h"
+#include "parser.h"
+#include "tree.h"
+
+// Iterator over the tokens of one statement, lexed ahead of time, carrying
+// the offset of each in its line. scan_token moves the tokens out, so the
+// parser can run over them exactly as it runs over characters.
+class lexed_token_iterator
+{
+    token* tok;
+    const std::size_t* off;
+
+public:
+    typedef std::forward_iterator_tag iterator_category;
+    typedef token value_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef token* pointer;
+    typedef token& reference;
+
+    lexed_token_iterator(token* _tok, const std::size_t* _off): tok(_tok), off(_off) {}
+
+    token& operator*() const
+    {
+        return *tok;
+    }
+
+    lexed_token_iterator& operator++()
+    {
+        ++tok;
+        ++off;
+        return *this;
+    }
+
+    // Valid at the end too, where it is the length of the line
+    std::size_t offset() const
+    {
+        return *off;
+    }
+
+    bool operator==(const lexed_token_iterator& other) const
+    {
+        return tok == other.tok;
+    }
+
+    bool operator!=(const lexed_token_iterator& other) const
+    {
+        return tok != other.tok;
+    }
+};
+
+inline void skip_spaces(lexed_token_iterator&, lexed_token_iterator) {}
+
+inline token scan_token(lexed_token_iterator& first, lexed_token_iterator last)
+{
+    if(first == last)
+        return token(token_tag::EOI);
+    token t(std::move(*first));
+    ++first;
+    return t;
+}
+
+template <>
+class token_position<lexed_token_iterator, true>
+{
+    lexed_token_iterator start;
+
+public:
+    explicit token_position(const lexed_token_iterator& first): start(first) {}
+
+    void mark(const lexed_token_iterator& i)
+    {
+        start = i;
+    }
+
+    std::size_t offset() const
+    {
+        return start.offset();
+    }
+};
+
+// Push-style parser for input that arrives in pieces. Each line is one
+// statement, as at the prompt; blank lines are skipped. feed() accepts
+// chunks split anywhere, even inside a token, and calls the handler with
+// each statement as soon as its line ends; finish() ends the last line.
+// Only the tokens of the unfinished line are held.
+//
+// A line yields the same statement, or the same error at the same offset,
+// as try_parse on that line would. Tokens are lexed as characters arrive
+// and the line is parsed when it ends. Lexing stops at an invalid
+// character, or once the line holds more tokens than max_tokens; the rest
+// of the line is skipped, since parsing cannot get past that token.
+class incremental_parser
+{
+public:
+    typedef std::function<void(std::size_t line, expected<t_statement<double>> statement)> handler;
+
+private:
+    enum class lex_state
+    {
+        Between,
+        Identifier,
+        Number,
+        Discard
+    };
+
+    handler emit;
+    resource_limits limits;
+
+    lex_state state;
+    // The token in progress, and where it started
+    std::string partial;
+    bool decimal;
+    std::size_t partial_offset;
+
+    std::vector<token> tokens;
+    std::vector<std::size_t> offsets;
+    std::size_t line, column;
+
+    void push(token t, std::size_t offset)
+    {
+        bool invalid = t.type == token_tag::Invalid;
+        tokens.push_back(std::move(t));
+        offsets.push_back(offset);
+        state = invalid || tokens.size() > limits.max_tokens ? lex_state::Discard : lex_state::Between;
+    }
+
+    // Same acceptance rule as scan_token
+    void finish_number()
+    {
+        if(decimal && partial.size() == 1)
+            push(token(token_tag::Invalid), partial_offset);
+        else
+            push(token(token_tag::Number, std::strtod(partial.c_str(), nullptr)), partial_offset);
+    }
+
+    void finish_token()
+    {
+        if(state == lex_state::Identifier)
+            push(token(token_tag::Identifier, std::move(partial)), partial_offset);
+        else if(state == lex_state::Number)
+            finish_number();
+        partial.clear();
+    }
+
+    void end_statement()
+    {
+        if(!tokens.empty())
+        {
+            offsets.push_back(column);
+
+            lexed_token_iterator first(tokens.data(), offsets.data());
+            lexed_token_iterator last(tokens.data() + tokens.size(), offsets.data() + tokens.size());
+            parser_state<lexed_token_iterator> s(first, last, limits);
+
+            t_statement<double> t;
+            if(try_parse_root(s, t))
+                emit(line, expected<t_statement<double>>(std::move(t)));
+            else
+                emit(line, expected<t_statement<double>>(std::move(s.error)));
+        }
+
+        tokens.clear();
+        offsets.clear();
+        state = lex_state::Between;
+        ++line;
+        column = 0;
+    }
+
+    // Consumes characters of the token in progress; returns p where it
+    // stopped, which is last if the token may continue in the next chunk
+    const char* continue_token(const char* p, const char* last)
+    {
+        if(state == lex_state::Identifier)
+        {
+            const char* end = find_not_lower(p, last);
+            partial.append(p, end);
+            column += end - p;
+            if(end != last)
+                finish_token();
+            return end;
+        }
+
+        for(; p != last; ++p, ++column)
+        {
+            char c = *p;
+            if(c >= '0' && c <= '9')
+                partial.push_back(c);
+            else if(c == '.' && !decimal)
+            {
+                decimal = true;
+                partial.push_back(c);
+            }
+            else if(c == '.')
+            {
+                partial.clear();
+                push(token(token_tag::Invalid), partial_offset);
+                return p;
+            }
+            else
+            {
+                finish_token();
+                return p;
+            }
+        }
+        return p;
+    }
+
+public:
+    explicit incremental_parser(handler _emit, const resource_limits& _limits = resource_limits()):
+        emit(std::move(_emit)), limits(_limits), state(lex_state::Between), decimal(false), partial_offset(0), line(1), column(0) {}
+
+    void feed(const char* p, std::size_t size)
+    {
+        const char* last = p + size;
+        while(p != last)
+        {
+            switch(state)
+            {
+            case lex_state::Identifier:
+            case lex_state::Number:
+                p = continue_token(p, last);
+                break;
+
+            case lex_state::Discard:
+            {
+                auto newline = static_cast<const char*>(std::memchr(p, '\n', last - p));
+                const char* end = newline ? newline : last;
+                column += end - p;
+                p = end;
+                if(newline)
+                    state = lex_state::Between;
+                break;
+            }
+
+            case lex_state::Between:
+                switch(*p)
+                {
+                case '\n':
+                    end_statement();
+                    ++p;
+                    break;
+
+                case '+': case '-': case '*': case '/': case '^': case '(': case ')': case '=': case ',':
+                    push(token(token_tag::Character, *p), column);
+                    ++p;
+                    ++column;
+                    break;
+
+                default:
+                    if(is_space_char(*p))
+                    {
+                        const char* end = find_not_space(p, last);
+                        auto newline = static_cast<const char*>(std::memchr(p, '\n', end - p));
+                        if(newline)
+                            end = newline;
+                        column += end - p;
+                        p = end;
+                    }
+                    else if(is_lower_char(*p) || *p == '.' || (*p >= '0' && *p <= '9'))
+                    {
+                        state = is_lower_char(*p) ? lex_state::Identifier : lex_state::Number;
+                        decimal = false;
+                        partial_offset = column;
+                    }
+                    else
+                        push(token(token_tag::Invalid), column);
+                    break;
+                }
+                break;
+            }
+        }
+    }
+
+    void feed(const std::string& chunk)
+    {
+        feed(chunk.data(), chunk.size());
+    }
+
+    // Ends the input, completing a last line that has no newline
+    void finish()
+    {
+        finish_token();
+        end_statement();
+    }
+
+    // Tokens held for the unfinished line
+    std::size_t pending_tokens() const
+    {
+        return tokens.size();
+    }
+};
+
+#endif // INCREMENTAL_PARSER_H_INCLUDED
@@ -3,10 +3,14 @@
 
 #include <string>
 
+#include <cctype>
 #include <cstdlib>
 #include <utility>
 #include <exception>
 
+#include "char_scan.h"
+#include "chunked_input.h"
+
 class lex_error : public std::exception
 {
 public:
@@ -137,8 +141,83 @@ void skip_spaces(Iterator& first, Iterator last)
     while(first != last && isspace(*first)) ++first;
 }
 
+inline void skip_spaces(const char*& first, const char* last)
+{
+    first = find_not_space(first, last);
+}
+
+inline void skip_spaces(std::string::const_iterator& first, std::string::const_iterator last)
+{
+    if(first != last)
+        first += find_not_space(&*first, &*first + (last - first)) - &*first;
+}
+
+inline void skip_spaces(std::string::iterator& first, std::string::iterator last)
+{
+    if(first != last)
+        first += find_not_space(&*first, &*first + (last - first)) - &*first;
+}
+
+inline void skip_spaces(chunked_istream_iterator& first, chunked_istream_iterator last)
+{
+    for(chunked_reader* r = first.source(); r && !r->at_end(); r->refill())
+    {
+        r->cursor() = find_not_space(r->cursor(), r->limit());
+        if(r->cursor() != r->limit())
+            break;
+    }
+}
+
+// Appends the identifier starting at first, which must be a lowercase letter
 template <typename Iterator>
-token get_token(Iterator& first, Iterator last)
+void scan_identifier(Iterator& first, Iterator last, std::string& id)
+{
+    do
+    {
+        id.push_back(*first++);
+    } while(first != last && islower(*first));
+}
+
+inline void scan_identifier(const char*& first, const char* last, std::string& id)
+{
+    const char* end = find_not_lower(first + 1, last);
+    id.append(first, end);
+    first = end;
+}
+
+inline void scan_identifier(std::string::const_iterator& first, std::string::const_iterator last, std::string& id)
+{
+    const char* p = &*first;
+    const char* q = p;
+    scan_identifier(q, p + (last - first), id);
+    first += q - p;
+}
+
+inline void scan_identifier(std::string::iterator& first, std::string::iterator last, std::string& id)
+{
+    const char* p = &*first;
+    const char* q = p;
+    scan_identifier(q, p + (last - first), id);
+    first += q - p;
+}
+
+inline void scan_identifier(chunked_istream_iterator& first, chunked_istream_iterator last, std::string& id)
+{
+    chunked_reader* r = first.source();
+    do
+    {
+        const char* end = find_not_lower(r->cursor(), r->limit());
+        id.append(r->cursor(), end);
+        r->cursor() = end;
+        if(end != r->limit())
+            break;
+    } while(r->refill());
+}
+
+// Returns an Invalid token where the input does not form one, rather than
+// throwing as get_token does
+template <typename Iterator>
+token scan_token(Iterator& first, Iterator last)
 {
     using namespace std;
 
@@ -158,6 +237,7 @@ token get_token(Iterator& first, Iterator last)
     case '(':
     case ')':
     case '=':
+    case ',':
         goto accept_operator;
 
     case 'a': case 'b': case 'c': case 'd': case 'e': case 'f': case 'g': case 'h': case 'i': case 'j': case 'k': case 'l': case 'm':
@@ -180,17 +260,14 @@ token get_token(Iterator& first, Iterator last)
         goto number;
 
     default:
-        throw lex_error();
+        return token(token_tag::Invalid);
     }
 
     accept_operator:
         return token(token_tag::Character, *first++);
 
     id:
-        do
-        {
-            temp.push_back(*first++);
-        } while(first != last && islower(*first));
+        scan_identifier(first, last, temp);
         goto accept_id;
 
     accept_id:
@@ -210,7 +287,7 @@ token get_token(Iterator& first, Iterator last)
                     goto number;
                 }
                 else
-                    throw lex_error();
+                    return token(token_tag::Invalid);
             }
         }
         goto accept_number;
@@ -218,10 +295,19 @@ token get_token(Iterator& first, Iterator last)
 
     accept_number:
         if(decimal && temp.size() == 1)
-            throw lex_error();
+            return token(token_tag::Invalid);
         char *dummy;
         double val = strtod(temp.c_str(), &dummy);
         return token(token_tag::Number, val);
 }
 
+template <typename Iterator>
+token get_token(Iterator& first, Iterator last)
+{
+    token t = scan_token(first, last);
+    if(t.type == token_tag::Invalid)
+        throw lex_error();
+    return t;
+}
+
 #endif // LEXER_H_INCLUDED
@@ -1,65 +1,257 @@
+// Kernel templates instantiated for simd_avx2 draw GCC's ABI note for
+// 32-byte vectors (see simd.h). GCC reports it when it compiles them at the
+// end of the translation unit, past the reach of the headers' own
+// push/pop, so it is turned off for this whole file.
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic ignored "-Wpsabi"
+#endif
+
+#include <fstream>
 #include <iostream>
 
 #include <string>
 
+#include <cerrno>
 #include <exception>
 #include <iterator>
+#include <memory>
+#include <thread>
+#include <unordered_map>
 #include <utility>
+#include <vector>
 
 #include <boost/variant.hpp>
 
+#include <unistd.h>
+
 #include "calculator.h"
+#include "cost.h"
+#include "incremental_parser.h"
 #include "lexer.h"
+#include "output.h"
+#include "parallel.h"
 #include "parser.h"
+#include "persistence.h"
+#include "pipeline.h"
+#include "polynomial.h"
+#include "server.h"
 #include "tree.h"
 #include "tree_transform.h"
 
-int main()
+int main(int argc, char** argv)
 {
     using namespace std;
 
-    calculator_state<double> calc;
-
-    while(true)
+    string state_path, socket_path, pipeline_path, output_path;
+    vector<string> expressions;
+    unordered_map<string, double> bindings;
+    bool native = false, trees = true, stream = false, parallel = false;
+    string native_flags;
+    resource_limits limits;
+    unsigned int threads = thread::hardware_concurrency();
+    for(int i = 1; i < argc; ++i)
     {
-        string input;
+        string arg = argv[i];
+        if(arg == "--state" && i + 1 < argc)
+            state_path = argv[++i];
+        else if(arg == "--server" && i + 1 < argc)
+            socket_path = argv[++i];
+        else if(arg == "--threads" && i + 1 < argc)
+            threads = stoul(argv[++i]);
+        else if(arg == "--pipeline" && i + 1 < argc)
+            pipeline_path = argv[++i];
+        else if(arg == "--expr" && i + 1 < argc)
+            expressions.push_back(argv[++i]);
+        else if(arg == "--output" && i + 1 < argc)
+            output_path = argv[++i];
+        else if(arg == "--bind" && i + 1 < argc)
+        {
+            string binding = argv[++i];
+            auto eq = binding.find('=');
+            if(eq != string::npos)
+                bindings[binding.substr(0, eq)] = stod(binding.substr(eq + 1));
+        }
+        else if(arg == "--stream")
+            stream = true;
+        else if(arg == "--parallel")
+            parallel = true;
+        else if(arg == "--no-trees")
+            trees = false;
+        else if(arg == "--native")
+            native = true;
+        else if(arg == "--native-flags" && i + 1 < argc)
+            native_flags = argv[++i];
+        else if(arg == "--max-tokens" && i + 1 < argc)
+            limits.max_tokens = stoull(argv[++i]);
+        else if(arg == "--max-nodes" && i + 1 < argc)
+            limits.max_nodes = stoull(argv[++i]);
+        else if(arg == "--max-depth" && i + 1 < argc)
+            limits.max_depth = stoull(argv[++i]);
+        else if(arg == "--max-operations" && i + 1 < argc)
+            limits.max_operations = stod(argv[++i]);
+    }
 
-        cout << ">> ";
-        getline(cin, input);
+    if(!pipeline_path.empty())
+    {
+        ofstream file;
+        if(!output_path.empty())
+            file.open(output_path, ios::binary);
 
+        pipeline_options options;
+        options.threads = threads;
+        options.bindings = bindings;
+        options.native = native;
+        if(!native_flags.empty())
+            options.codegen.flags = native_flags;
         try
         {
-            auto s = initialize_parser(input.begin(), input.end());
+            run_pipeline(pipeline_path, expressions, output_path.empty() ? cout : file, options);
+        }
+        catch(const exception& e)
+        {
+            cerr << e.what() << endl;
+            return 1;
+        }
+        return 0;
+    }
 
-            t_statement<double> t;
-            parse_root(s, t);
+    if(!socket_path.empty())
+    {
+        evaluation_server server(socket_path, threads, limits);
+        server.run();
+        return 0;
+    }
+
+    unique_ptr<persistent_calculator<double>> persistent;
+    calculator_state<double> calc;
+
+    // Output is flushed only before waiting on a terminal, so piped input
+    // is answered in large writes
+    output_buffer out(cout);
+    bool interactive = isatty(STDIN_FILENO);
 
-            print_statement_tree(t);
-            cout << endl;
+    if(!state_path.empty())
+    {
+        persistent.reset(new persistent_calculator<double>(state_path));
+        auto replayed = persistent->recover();
+        out << "Restored " << persistent->state().variable_set.size() << " variables (" << replayed << " from journal)\n";
+    }
+
+    // With --parallel, large expressions are folded and evaluated on a pool
+    unique_ptr<work_stealing_pool> pool;
+    if(parallel)
+        pool.reset(new work_stealing_pool(threads));
+
+    auto fold = [&](t_expression<double>& t)
+    {
+        if(pool)
+            parallel_fold(t, *pool);
+        else
+            apply_transform<tree_fold<double>>(t);
+    };
+
+    // Runs a parsed statement, printing its result; throws on failure
+    auto execute = [&](t_statement<double>& t)
+    {
+        if(trees)
+        {
+            print_statement_tree(out, t);
+            out << '\n';
+        }
 
-            auto type = identify_statement(t);
-            if(type == statement_type::Expression)
+        auto type = identify_statement(t);
+        if(type == statement_type::Expression)
+        {
+            check_expression_limits(boost::get<t_expression<double>>(t), limits);
+            fold(boost::get<t_expression<double>>(t));
+            apply_transform<tree_polynomial<double>>(boost::get<t_expression<double>>(t));
+            apply_transform<tree_flatten<double>>(boost::get<t_expression<double>>(t));
+            fold(boost::get<t_expression<double>>(t));
+
+            if(trees)
             {
-                apply_transform<tree_fold<double>>(boost::get<t_expression<double>>(t));
+                out << "Optimized tree:\n";
+                print_expression_tree(out, boost::get<t_expression<double>>(t));
+                out << '\n';
+            }
 
-                cout << "Optimized tree:" << endl;
-                print_expression_tree(boost::get<t_expression<double>>(t));
-                cout << endl;
+            const auto& state = persistent ? persistent->state() : calc;
+            const auto& e = boost::get<t_expression<double>>(t);
+            out << (pool ? parallel_eval_expression_tree(state, e, *pool) : eval_expression_tree(state, e)) << "\n\n";
+        }
+        else if(type == statement_type::VarDefinition)
+        {
+            check_expression_limits(boost::get<t_var_definition<double>>(t).val, limits);
+            if(persistent)
+                persistent->define(boost::get<t_var_definition<double>>(t));
+            else
+                process_variable_definition(calc, boost::get<t_var_definition<double>>(t));
+        }
+        else
+            throw logic_error("Unimplemented");
+    };
 
-                cout << eval_expression_tree(calc, boost::get<t_expression<double>>(t)) << endl << endl;
+    if(stream)
+    {
+        // Statements are run as soon as their line is complete, however
+        // the input is split; errors are reported with their line
+        incremental_parser parser([&](size_t line, expected<t_statement<double>> t)
+        {
+            if(!t)
+            {
+                out << "line " << line << ": " << t.error().message() << "\n\n";
+                return;
             }
-            else if(type == statement_type::VarDefinition)
+            try
             {
-                process_variable_definition(calc, boost::get<t_var_definition<double>>(t));
+                execute(t.value());
             }
-            else
-                throw logic_error("Unimplemented");
+            catch(const exception& e)
+            {
+                out << "line " << line << ": " << e.what() << "\n\n";
+            }
+        }, limits);
+
+        vector<char> chunk(chunked_reader::default_chunk_size);
+        while(true)
+        {
+            ssize_t n = read(STDIN_FILENO, chunk.data(), chunk.size());
+            if(n < 0 && errno == EINTR)
+                continue;
+            if(n <= 0)
+                break;
+            parser.feed(chunk.data(), static_cast<size_t>(n));
+            out.flush();
+        }
+        parser.finish();
+    }
+    else while(true)
+    {
+        string input;
+
+        out << ">> ";
+        if(interactive)
+            out.flush();
+        if(!getline(cin, input))
+            break;
+
+        try
+        {
+            auto s = initialize_parser(input.begin(), input.end(), limits);
+
+            t_statement<double> t;
+            parse_root(s, t);
+            execute(t);
         }
         catch(const exception& e)
         {
-            cout << e.what() << endl << endl;
+            out << e.what() << "\n\n";
         }
     }
+    out.flush();
+
+    if(persistent)
+        persistent->checkpoint();
 
 //    while(true)
 //    {
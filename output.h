@@ -0,0 +1,441 @@
+#ifndef OUTPUT_H_INCLUDED
+#define OUTPUT_H_INCLUDED
+
+#include <ostream>
+#include <string>
+
+#include <cfloat>
+#include <cmath>
+#include <cstddef>
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+// Writes the shortest decimal form of d that reads back as exactly d, and
+// returns its length. buf must hold format_buffer_size characters; the
+// result is not terminated. Infinities and NaNs are written as "inf",
+// "-inf" and "nan". The layout is that of printf's %g at the precision the
+// digits need, but no less than 15.
+const std::size_t format_buffer_size = 32;
+
+namespace output_detail
+{
+    // Grisu3 (Loitsch, "Printing Floating-Point Numbers Quickly and
+    // Accurately with Integers"): the shortest digits are generated with
+    // 64-bit integer arithmetic against a cached power of ten, and the
+    // rare doubles whose digits it cannot prove shortest and correctly
+    // rounded (about 0.5%) are reported as failures for the caller to
+    // format some other way.
+
+    struct diy_fp
+    {
+        std::uint64_t f;
+        int e;
+    };
+
+    // The upper 64 bits of the product, rounded
+    inline diy_fp multiply(diy_fp x, diy_fp y)
+    {
+        const std::uint64_t mask = 0xffffffffULL;
+        std::uint64_t a = x.f >> 32, b = x.f & mask, c = y.f >> 32, d = y.f & mask;
+        std::uint64_t ac = a * c, bc = b * c, ad = a * d, bd = b * d;
+        std::uint64_t middle = (bd >> 32) + (ad & mask) + (bc & mask) + (1ULL << 31);
+        return diy_fp{ac + (ad >> 32) + (bc >> 32) + (middle >> 32), x.e + y.e + 64};
+    }
+
+    inline diy_fp normalize(diy_fp x)
+    {
+        while(!(x.f & (1ULL << 63)))
+        {
+            x.f <<= 1;
+            --x.e;
+        }
+        return x;
+    }
+
+    // 10^k, rounded to 64 bits, for k = -348, -340, ..., 340
+    const int first_cached_power = -348;
+    const int cached_power_step = 8;
+
+    const std::uint64_t cached_significands[] =
+    {
+        0xfa8fd5a0081c0288ULL, 0xbaaee17fa23ebf76ULL, 0x8b16fb203055ac76ULL,
+        0xcf42894a5dce35eaULL, 0x9a6bb0aa55653b2dULL, 0xe61acf033d1a45dfULL,
+        0xab70fe17c79ac6caULL, 0xff77b1fcbebcdc4fULL, 0xbe5691ef416bd60cULL,
+        0x8dd01fad907ffc3cULL, 0xd3515c2831559a83ULL, 0x9d71ac8fada6c9b5ULL,
+        0xea9c227723ee8bcbULL, 0xaecc49914078536dULL, 0x823c12795db6ce57ULL,
+        0xc21094364dfb5637ULL, 0x9096ea6f3848984fULL, 0xd77485cb25823ac7ULL,
+        0xa086cfcd97bf97f4ULL, 0xef340a98172aace5ULL, 0xb23867fb2a35b28eULL,
+        0x84c8d4dfd2c63f3bULL, 0xc5dd44271ad3cdbaULL, 0x936b9fcebb25c996ULL,
+        0xdbac6c247d62a584ULL, 0xa3ab66580d5fdaf6ULL, 0xf3e2f893dec3f126ULL,
+        0xb5b5ada8aaff80b8ULL, 0x87625f056c7c4a8bULL, 0xc9bcff6034c13053ULL,
+        0x964e858c91ba2655ULL, 0xdff9772470297ebdULL, 0xa6dfbd9fb8e5b88fULL,
+        0xf8a95fcf88747d94ULL, 0xb94470938fa89bcfULL, 0x8a08f0f8bf0f156bULL,
+        0xcdb02555653131b6ULL, 0x993fe2c6d07b7facULL, 0xe45c10c42a2b3b06ULL,
+        0xaa242499697392d3ULL, 0xfd87b5f28300ca0eULL, 0xbce5086492111aebULL,
+        0x8cbccc096f5088ccULL, 0xd1b71758e219652cULL, 0x9c40000000000000ULL,
+        0xe8d4a51000000000ULL, 0xad78ebc5ac620000ULL, 0x813f3978f8940984ULL,
+        0xc097ce7bc90715b3ULL, 0x8f7e32ce7bea5c70ULL, 0xd5d238a4abe98068ULL,
+        0x9f4f2726179a2245ULL, 0xed63a231d4c4fb27ULL, 0xb0de65388cc8ada8ULL,
+        0x83c7088e1aab65dbULL, 0xc45d1df942711d9aULL, 0x924d692ca61be758ULL,
+        0xda01ee641a708deaULL, 0xa26da3999aef774aULL, 0xf209787bb47d6b85ULL,
+        0xb454e4a179dd1877ULL, 0x865b86925b9bc5c2ULL, 0xc83553c5c8965d3dULL,
+        0x952ab45cfa97a0b3ULL, 0xde469fbd99a05fe3ULL, 0xa59bc234db398c25ULL,
+        0xf6c69a72a3989f5cULL, 0xb7dcbf5354e9beceULL, 0x88fcf317f22241e2ULL,
+        0xcc20ce9bd35c78a5ULL, 0x98165af37b2153dfULL, 0xe2a0b5dc971f303aULL,
+        0xa8d9d1535ce3b396ULL, 0xfb9b7cd9a4a7443cULL, 0xbb764c4ca7a44410ULL,
+        0x8bab8eefb6409c1aULL, 0xd01fef10a657842cULL, 0x9b10a4e5e9913129ULL,
+        0xe7109bfba19c0c9dULL, 0xac2820d9623bf429ULL, 0x80444b5e7aa7cf85ULL,
+        0xbf21e44003acdd2dULL, 0x8e679c2f5e44ff8fULL, 0xd433179d9c8cb841ULL,
+        0x9e19db92b4e31ba9ULL, 0xeb96bf6ebadf77d9ULL, 0xaf87023b9bf0ee6bULL
+    };
+
+    const short cached_binary_exponents[] =
+    {
+        -1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007, -980,
+        -954, -927, -901, -874, -847, -821, -794, -768, -741, -715,
+        -688, -661, -635, -608, -582, -555, -529, -502, -475, -449,
+        -422, -396, -369, -343, -316, -289, -263, -236, -210, -183,
+        -157, -130, -103, -77, -50, -24, 3, 30, 56, 83,
+        109, 136, 162, 189, 216, 242, 269, 295, 322, 348,
+        375, 402, 428, 455, 481, 508, 534, 561, 588, 614,
+        641, 667, 694, 720, 747, 774, 800, 827, 853, 880,
+        907, 933, 960, 986, 1013, 1039, 1066
+    };
+
+    // Moves the last digit down while that brings the digits closer to w,
+    // then checks that the result is unambiguously the closest
+    inline bool round_weed(char* buf, int length, std::uint64_t distance_too_high_w, std::uint64_t unsafe_interval,
+                           std::uint64_t rest, std::uint64_t ten_kappa, std::uint64_t unit)
+    {
+        std::uint64_t small_distance = distance_too_high_w - unit;
+        std::uint64_t big_distance = distance_too_high_w + unit;
+
+        while(rest < small_distance && unsafe_interval - rest >= ten_kappa &&
+              (rest + ten_kappa < small_distance || small_distance - rest >= rest + ten_kappa - small_distance))
+        {
+            --buf[length - 1];
+            rest += ten_kappa;
+        }
+
+        if(rest < big_distance && unsafe_interval - rest >= ten_kappa &&
+           (rest + ten_kappa < big_distance || big_distance - rest > rest + ten_kappa - big_distance))
+            return false;
+
+        return 2 * unit <= rest && rest <= unsafe_interval - 4 * unit;
+    }
+
+    // Generates the digits of a positive, finite d into buf and sets
+    // exponent so that d is digits * 10^exponent. Returns the number of
+    // digits, or 0 if the result could not be guaranteed.
+    inline int grisu3(double d, char* buf, int& exponent)
+    {
+        std::uint64_t bits;
+        std::memcpy(&bits, &d, sizeof(bits));
+        const std::uint64_t hidden_bit = 1ULL << 52;
+        std::uint64_t fraction = bits & (hidden_bit - 1);
+        int biased = static_cast<int>(bits >> 52);
+
+        diy_fp v = biased ? diy_fp{fraction | hidden_bit, biased - 1075} : diy_fp{fraction, -1074};
+
+        // The boundaries halfway to the neighbouring doubles; the lower one
+        // is closer when v is a power of two above the subnormals
+        diy_fp plus = normalize(diy_fp{(v.f << 1) + 1, v.e - 1});
+        diy_fp minus = fraction == 0 && biased > 1 ? diy_fp{(v.f << 2) - 1, v.e - 2} : diy_fp{(v.f << 1) - 1, v.e - 1};
+        minus.f <<= minus.e - plus.e;
+        minus.e = plus.e;
+        diy_fp w = normalize(v);
+
+        // A power of ten that brings w's exponent into [-60, -32]
+        const double log10_2 = 0.30102999566398114;
+        int k = static_cast<int>(std::ceil((-60 - (w.e + 64) + 63) * log10_2));
+        int index = (k - first_cached_power - 1) / cached_power_step + 1;
+        diy_fp ten_mk = {cached_significands[index], cached_binary_exponents[index]};
+        int mk = -(first_cached_power + index * cached_power_step);
+
+        w = multiply(w, ten_mk);
+        diy_fp low = multiply(minus, ten_mk);
+        diy_fp high = multiply(plus, ten_mk);
+
+        // The products may be off by one unit each way, so digits are only
+        // generated inside the interval that is certainly within bounds
+        std::uint64_t unit = 1;
+        std::uint64_t too_low = low.f - unit;
+        std::uint64_t too_high = high.f + unit;
+        std::uint64_t unsafe_interval = too_high - too_low;
+
+        int shift = -w.e;
+        std::uint64_t one = 1ULL << shift;
+        std::uint32_t integrals = static_cast<std::uint32_t>(too_high >> shift);
+        std::uint64_t fractionals = too_high & (one - 1);
+
+        std::uint32_t divisor = 1;
+        int kappa = 0;
+        if(integrals)
+        {
+            kappa = 1;
+            while(divisor <= integrals / 10)
+            {
+                divisor *= 10;
+                ++kappa;
+            }
+        }
+
+        int length = 0;
+        while(kappa > 0)
+        {
+            buf[length++] = static_cast<char>('0' + integrals / divisor);
+            integrals %= divisor;
+            --kappa;
+            std::uint64_t rest = (static_cast<std::uint64_t>(integrals) << shift) + fractionals;
+            if(rest < unsafe_interval)
+            {
+                exponent = mk + kappa;
+                return round_weed(buf, length, too_high - w.f, unsafe_interval, rest,
+                                  static_cast<std::uint64_t>(divisor) << shift, unit) ? length : 0;
+            }
+            divisor /= 10;
+        }
+
+        for(;;)
+        {
+            fractionals *= 10;
+            unit *= 10;
+            unsafe_interval *= 10;
+            buf[length++] = static_cast<char>('0' + (fractionals >> shift));
+            fractionals &= one - 1;
+            --kappa;
+            if(fractionals < unsafe_interval)
+            {
+                exponent = mk + kappa;
+                return round_weed(buf, length, (too_high - w.f) * unit, unsafe_interval, fractionals, one, unit) ? length : 0;
+            }
+        }
+    }
+
+    // Lays out digits * 10^exponent as %g would at the given precision,
+    // with the trailing zeros the digits already lack
+    inline std::size_t layout(char* buf, bool negative, const char* digits, int length, int exponent, int precision)
+    {
+        std::size_t n = 0;
+        if(negative)
+            buf[n++] = '-';
+
+        int x = length + exponent - 1;
+        if(x < -4 || x >= precision)
+        {
+            buf[n++] = digits[0];
+            if(length > 1)
+            {
+                buf[n++] = '.';
+                std::memcpy(buf + n, digits + 1, length - 1);
+                n += length - 1;
+            }
+            buf[n++] = 'e';
+            buf[n++] = x < 0 ? '-' : '+';
+            unsigned int e = static_cast<unsigned int>(x < 0 ? -x : x);
+            if(e >= 100)
+                buf[n++] = static_cast<char>('0' + e / 100);
+            buf[n++] = static_cast<char>('0' + e / 10 % 10);
+            buf[n++] = static_cast<char>('0' + e % 10);
+        }
+        else if(x < 0)
+        {
+            buf[n++] = '0';
+            buf[n++] = '.';
+            for(int i = -1; i > x; --i)
+                buf[n++] = '0';
+            std::memcpy(buf + n, digits, length);
+            n += length;
+        }
+        else
+        {
+            for(int i = 0; i <= x; ++i)
+                buf[n++] = i < length ? digits[i] : '0';
+            if(length > x + 1)
+            {
+                buf[n++] = '.';
+                std::memcpy(buf + n, digits + x + 1, length - x - 1);
+                n += length - x - 1;
+            }
+        }
+        return n;
+    }
+}
+
+inline std::size_t format_shortest(char* buf, double d)
+{
+    if(std::isnan(d))
+    {
+        std::memcpy(buf, "nan", 3);
+        return 3;
+    }
+    if(std::isinf(d))
+    {
+        if(d < 0)
+        {
+            std::memcpy(buf, "-inf", 4);
+            return 4;
+        }
+        std::memcpy(buf, "inf", 3);
+        return 3;
+    }
+
+    // Integers are common and need no search
+    if(d == std::floor(d) && std::fabs(d) < 1e15 && !(d == 0 && std::signbit(d)))
+    {
+        long long v = static_cast<long long>(d);
+        char digits[20];
+        std::size_t n = 0;
+        unsigned long long u = v < 0 ? 0ULL - static_cast<unsigned long long>(v) : static_cast<unsigned long long>(v);
+        do
+        {
+            digits[n++] = static_cast<char>('0' + u % 10);
+            u /= 10;
+        } while(u);
+
+        std::size_t length = 0;
+        if(v < 0)
+            buf[length++] = '-';
+        while(n)
+            buf[length++] = digits[--n];
+        return length;
+    }
+
+    if(d == 0)
+    {
+        std::memcpy(buf, "-0", 2);
+        return 2;
+    }
+
+    char digits[18];
+    int exponent;
+    int length = output_detail::grisu3(std::fabs(d), digits, exponent);
+    if(length > 0)
+        return output_detail::layout(buf, d < 0, digits, length, exponent, length > 15 ? length : 15);
+
+    // Grisu3 gave up. Every decimal of at most 15 significant digits
+    // survives a round trip through a normal double, so if one reads back
+    // as d, rounding d to 15 digits finds it. Past that, the nearest
+    // 16-digit decimal reads back as d if any does (except next to a power
+    // of two, where this may settle for 17), and 17 digits always do.
+    // Subnormals have fewer significant bits and are searched from one
+    // digit up.
+    int written = 0;
+    for(int precision = std::fabs(d) < DBL_MIN ? 1 : 15; precision <= 17; ++precision)
+    {
+        written = std::snprintf(buf, format_buffer_size, "%.*g", precision, d);
+        if(precision == 17 || std::strtod(buf, nullptr) == d)
+            break;
+    }
+    return static_cast<std::size_t>(written);
+}
+
+inline std::string format_shortest(double d)
+{
+    char buf[format_buffer_size];
+    return std::string(buf, format_shortest(buf, d));
+}
+
+// Collects output in a large buffer and hands it to the stream in one
+// write when the buffer fills or at an explicit flush(), instead of going
+// through the stream's formatting for every item. Nothing reaches the
+// stream between flushes, so interactive callers flush before they wait
+// for input.
+class output_buffer
+{
+    std::ostream& os;
+    std::string buf;
+    std::size_t capacity;
+
+    void reserve(std::size_t n)
+    {
+        if(buf.size() + n > capacity)
+            write_out();
+    }
+
+    void write_out()
+    {
+        os.write(buf.data(), buf.size());
+        buf.clear();
+    }
+
+public:
+    explicit output_buffer(std::ostream& _os, std::size_t _capacity = 1 << 16): os(_os), capacity(_capacity)
+    {
+        buf.reserve(capacity);
+    }
+
+    ~output_buffer()
+    {
+        flush();
+    }
+
+    output_buffer(const output_buffer&) = delete;
+    output_buffer& operator=(const output_buffer&) = delete;
+
+    void flush()
+    {
+        write_out();
+        os.flush();
+    }
+
+    output_buffer& write(const char* s, std::size_t n)
+    {
+        reserve(n);
+        buf.append(s, n);
+        return *this;
+    }
+
+    output_buffer& indent(std::size_t n)
+    {
+        reserve(n);
+        buf.append(n, ' ');
+        return *this;
+    }
+
+    output_buffer& operator<<(char c)
+    {
+        reserve(1);
+        buf += c;
+        return *this;
+    }
+
+    output_buffer& operator<<(const char* s)
+    {
+        return write(s, std::strlen(s));
+    }
+
+    output_buffer& operator<<(const std::string& s)
+    {
+        return write(s.data(), s.size());
+    }
+
+    output_buffer& operator<<(double d)
+    {
+        reserve(format_buffer_size);
+        char tmp[format_buffer_size];
+        buf.append(tmp, format_shortest(tmp, d));
+        return *this;
+    }
+
+    output_buffer& operator<<(unsigned long long n)
+    {
+        char tmp[24];
+        int length = std::snprintf(tmp, sizeof(tmp), "%llu", n);
+        return write(tmp, length);
+    }
+
+    output_buffer& operator<<(unsigned int n)
+    {
+        return *this << static_cast<unsigned long long>(n);
+    }
+
+    output_buffer& operator<<(unsigned long n)
+    {
+        return *this << static_cast<unsigned long long>(n);
+    }
+};
+
+#endif // OUTPUT_H_INCLUDED
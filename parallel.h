@@ -0,0 +1,567 @@
+#ifndef PARALLEL_H_INCLUDED
+#define PARALLEL_H_INCLUDED
+
+#include <string>
+#include <vector>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+
+#include <boost/optional.hpp>
+#include <boost/variant.hpp>
+
+#include "calculator.h"
+#include "expected.h"
+#include "functions.h"
+#include "polynomial.h"
+#include "thread_pool.h"
+#include "tree.h"
+#include "tree_transform.h"
+
+// Fork-join folding and evaluation of single expressions too large for one
+// core. A node of at least grain nodes has its operands split into runs of
+// consecutive operands, each run at least grain nodes where possible, and
+// the runs are handed to a work_stealing_pool as tasks; smaller subtrees go
+// to the sequential tree_fold and evaluator. Every node combines its
+// operands exactly as the sequential code does, so results are identical
+// to it bit for bit. Of several failing operands, the first one's error is
+// reported.
+
+// Below this many nodes a subtree is not worth a task
+const std::size_t parallel_grain = 1 << 13;
+
+namespace parallel_detail
+{
+    template <typename NumType>
+    struct operand_span
+    {
+        const t_expression<NumType>* first;
+        std::size_t count;
+    };
+
+    // The operands of a node, in the order the evaluator visits them
+    template <typename NumType>
+    struct operand_finder : public boost::static_visitor<operand_span<NumType>>
+    {
+        typedef operand_span<NumType> span;
+
+        span operator()(const t_negate<NumType>& t) const { return span{&t.op, 1}; }
+        span operator()(const t_add<NumType>& t) const { return span{t.ops, 2}; }
+        span operator()(const t_subtract<NumType>& t) const { return span{t.ops, 2}; }
+        span operator()(const t_multiply<NumType>& t) const { return span{t.ops, 2}; }
+        span operator()(const t_divide<NumType>& t) const { return span{t.ops, 2}; }
+        span operator()(const t_exponentiate<NumType>& t) const { return span{t.ops, 2}; }
+        span operator()(const t_func_invocation<NumType>& t) const { return span{t.args.data(), t.args.size()}; }
+        span operator()(const t_polynomial<NumType>& t) const { return span{t.coeffs.data(), t.coeffs.size()}; }
+        span operator()(const t_sum<NumType>& t) const { return span{t.ops.data(), t.ops.size()}; }
+        span operator()(const t_product<NumType>& t) const { return span{t.ops.data(), t.ops.size()}; }
+        template <typename Leaf>
+        span operator()(const Leaf&) const { return span{nullptr, 0}; }
+    };
+
+    template <typename NumType>
+    operand_span<NumType> operands(const t_expression<NumType>& t)
+    {
+        return boost::apply_visitor(operand_finder<NumType>(), t);
+    }
+}
+
+// Where an expression is split into tasks, found by measuring every
+// subtree once. A node of at least grain nodes has its operands divided
+// into runs, each closed once it holds grain nodes, and the runs are kept
+// against the node; smaller nodes are not recorded at all, so the cache is
+// small. The measuring is itself spread over the pool, dividing operands
+// by count down to a few tasks per worker, since sizes are not yet known.
+// Keep one alongside a tree that is evaluated repeatedly; it is valid
+// until the tree is changed.
+template <typename NumType>
+class subtree_sizes
+{
+public:
+    // Operand runs of a large node, ending at ends. The largest is taken
+    // by the thread that reaches the node, so that descending a lopsided
+    // tree costs no more stack than the sequential recursion.
+    struct split
+    {
+        std::vector<std::size_t> ends;
+        std::size_t largest;
+        // Nodes in the whole subtree
+        std::size_t nodes;
+    };
+
+private:
+    std::unordered_map<const t_expression<NumType>*, split> splits;
+    std::mutex splits_lock;
+    std::size_t grain_nodes, total;
+
+    // Divides operands of the given sizes into runs, keeping them if t is
+    // large. Returns the nodes in t.
+    std::size_t close(const t_expression<NumType>& t, const std::size_t* sizes, std::size_t count)
+    {
+        split runs;
+        runs.largest = 0;
+        std::size_t n = 1, nodes = 0, largest_nodes = 0;
+        for(std::size_t i = 0; i < count; ++i)
+        {
+            n += sizes[i];
+            nodes += sizes[i];
+            if(nodes >= grain_nodes || i + 1 == count)
+            {
+                if(nodes > largest_nodes)
+                {
+                    runs.largest = runs.ends.size();
+                    largest_nodes = nodes;
+                }
+                runs.ends.push_back(i + 1);
+                nodes = 0;
+            }
+        }
+
+        if(n >= grain_nodes)
+        {
+            runs.nodes = n;
+            std::lock_guard<std::mutex> guard(splits_lock);
+            splits[&t] = std::move(runs);
+        }
+        return n;
+    }
+
+    // Measures t on this thread with an explicit stack, so that a chain of
+    // any length costs no stack; the sizes of the operands of the nodes on
+    // the stack are kept together in sizes, each node's from its base up
+    std::size_t measure(const t_expression<NumType>& t)
+    {
+        struct frame
+        {
+            const t_expression<NumType>* t;
+            parallel_detail::operand_span<NumType> ops;
+            std::size_t next, base;
+        };
+
+        std::vector<frame> stack;
+        std::vector<std::size_t> sizes;
+        auto enter = [&](const t_expression<NumType>& u)
+        {
+            auto ops = parallel_detail::operands(u);
+            if(ops.count == 0)
+                sizes.push_back(1);
+            else
+                stack.push_back(frame{&u, ops, 0, sizes.size()});
+        };
+
+        enter(t);
+        while(!stack.empty())
+        {
+            frame& f = stack.back();
+            if(f.next < f.ops.count)
+            {
+                enter(f.ops.first[f.next++]);
+                continue;
+            }
+
+            std::size_t n = close(*f.t, sizes.data() + f.base, f.ops.count);
+            sizes.resize(f.base);
+            stack.pop_back();
+            sizes.push_back(n);
+        }
+        return sizes.back();
+    }
+
+    // budget is how many tasks the measuring of t may be divided into. Only
+    // nodes with several operands divide it, so this recurses no deeper than
+    // the budget's logarithm before measuring on one thread.
+    std::size_t measure(work_stealing_pool& pool, const t_expression<NumType>& t, std::size_t budget)
+    {
+        auto ops = parallel_detail::operands(t);
+        if(budget <= 1 || ops.count <= 1)
+            return measure(t);
+
+        std::size_t small[2];
+        std::vector<std::size_t> large;
+        std::size_t* sizes = small;
+        if(ops.count > 2)
+        {
+            large.resize(ops.count);
+            sizes = large.data();
+        }
+
+        std::size_t chunks = std::min(ops.count, budget);
+        std::size_t share = std::max<std::size_t>(budget / ops.count, 1);
+        auto chunk = [&, chunks, share](std::size_t c)
+        {
+            for(std::size_t i = c * ops.count / chunks; i < (c + 1) * ops.count / chunks; ++i)
+                sizes[i] = measure(pool, ops.first[i], share);
+        };
+
+        task_group group(pool);
+        for(std::size_t c = 1; c < chunks; ++c)
+            group.run([&chunk, c] { chunk(c); });
+        chunk(0);
+        group.wait();
+
+        return close(t, sizes, ops.count);
+    }
+
+public:
+    subtree_sizes(const t_expression<NumType>& t, work_stealing_pool& pool, std::size_t grain = parallel_grain):
+        grain_nodes(std::max<std::size_t>(grain, 2)), total(0)
+    {
+        total = measure(pool, t, std::size_t(pool.size()) * 8);
+    }
+
+    subtree_sizes(const subtree_sizes&) = delete;
+    subtree_sizes& operator=(const subtree_sizes&) = delete;
+
+    // How t's operands are divided, or null if t is too small to divide
+    const split* runs(const t_expression<NumType>& t) const
+    {
+        auto i = splits.find(&t);
+        return i != splits.end() ? &i->second : nullptr;
+    }
+
+    std::size_t grain() const
+    {
+        return grain_nodes;
+    }
+
+    std::size_t nodes() const
+    {
+        return total;
+    }
+};
+
+namespace parallel_detail
+{
+    // How many waits on one thread may run other tasks meanwhile. Each task
+    // run inside a wait sits on top of that thread's stack, so past this a
+    // wait only yields.
+    const unsigned int max_helping_waits = 4;
+
+    inline unsigned int& helping_waits()
+    {
+        static thread_local unsigned int n = 0;
+        return n;
+    }
+
+    // Calls f(i) for every operand i of a split node. The largest run takes
+    // place on the calling thread and the others are offered to the pool;
+    // any still queued once the caller is done with its own are taken back
+    // and run in place, so that only runs already started elsewhere are
+    // waited for. An operand that throws ends its run; once every run is
+    // done, the exception of the earliest such operand is rethrown.
+    template <typename NumType, typename Function>
+    void for_each_operand(work_stealing_pool& pool, const typename subtree_sizes<NumType>::split& runs, Function f)
+    {
+        enum { Queued, Running, Done };
+
+        const auto& ends = runs.ends;
+        std::vector<std::exception_ptr> errors(ends.size());
+        auto execute = [&](std::size_t r)
+        {
+            try
+            {
+                for(std::size_t i = r ? ends[r - 1] : 0; i < ends[r]; ++i)
+                    f(i);
+            }
+            catch(...)
+            {
+                errors[r] = std::current_exception();
+            }
+        };
+
+        // A task may still be queued after this returns, so the run states
+        // are shared with it, and it only touches execute once it has
+        // claimed its run, which the caller then waits for
+        auto states = std::make_shared<std::vector<std::atomic<int>>>(ends.size());
+        auto claim = [](std::atomic<int>& state)
+        {
+            int queued = Queued;
+            return state.compare_exchange_strong(queued, Running);
+        };
+        auto run = &execute;
+
+        for(std::size_t r = 0; r < ends.size(); ++r)
+            if(r != runs.largest)
+                pool.submit([states, claim, run, r]
+                {
+                    if(claim((*states)[r]))
+                    {
+                        (*run)(r);
+                        (*states)[r] = Done;
+                    }
+                });
+
+        execute(runs.largest);
+        for(std::size_t r = 0; r < ends.size(); ++r)
+            if(r != runs.largest && claim((*states)[r]))
+            {
+                execute(r);
+                (*states)[r] = Done;
+            }
+
+        auto& helping = helping_waits();
+        for(std::size_t r = 0; r < ends.size(); ++r)
+        {
+            while(r != runs.largest && (*states)[r] != Done)
+            {
+                bool ran = false;
+                if(helping < max_helping_waits)
+                {
+                    ++helping;
+                    ran = pool.run_one();
+                    --helping;
+                }
+                if(!ran)
+                    std::this_thread::yield();
+            }
+        }
+
+        for(const auto& e : errors)
+            if(e)
+                std::rethrow_exception(e);
+    }
+
+    template <typename NumType>
+    struct folder
+    {
+        work_stealing_pool& pool;
+        const subtree_sizes<NumType>& sizes;
+
+        // The largest operand of t if it is large enough to be split itself
+        t_expression<NumType>* largest_split_operand(const t_expression<NumType>& t) const
+        {
+            auto ops = operands(t);
+            const t_expression<NumType>* largest = nullptr;
+            std::size_t largest_nodes = 0;
+            for(std::size_t i = 0; i < ops.count; ++i)
+            {
+                auto runs = sizes.runs(ops.first[i]);
+                if(runs && runs->nodes > largest_nodes)
+                {
+                    largest = &ops.first[i];
+                    largest_nodes = runs->nodes;
+                }
+            }
+            return const_cast<t_expression<NumType>*>(largest);
+        }
+
+        // A parsed chain is a nest of binary nodes, each with one large
+        // operand and one small one, so dividing node by node would leave
+        // nothing to run side by side and recurse once per link. Instead
+        // the spine of large operands is followed down iteratively, what
+        // hangs off it is folded in parallel in runs of about grain nodes,
+        // and then the spine is folded from the bottom up. Every node is
+        // still folded after its own operands, exactly as tree_fold does.
+        boost::optional<NumType> fold(t_expression<NumType>& t) const
+        {
+            auto runs = sizes.runs(t);
+            if(!runs)
+                return apply_transform<tree_fold<NumType>>(t);
+
+            std::vector<t_expression<NumType>*> spine(1, &t);
+            while(auto next = largest_split_operand(*spine.back()))
+                spine.push_back(next);
+
+            // Nodes are looked up by address, so operands are folded in
+            // place; each task changes nothing but its own operands
+            if(spine.size() == 1)
+            {
+                auto first = const_cast<t_expression<NumType>*>(operands(t).first);
+                for_each_operand<NumType>(pool, *runs, [&](std::size_t i)
+                {
+                    fold(first[i]);
+                });
+                return apply_transform<tree_fold_step<NumType>>(t);
+            }
+
+            // Run r folds the operands off spine nodes up to ends[r]
+            typename subtree_sizes<NumType>::split sides;
+            sides.largest = 0;
+            sides.nodes = runs->nodes;
+            std::size_t nodes = 0, largest_nodes = 0;
+            for(std::size_t i = 0; i < spine.size(); ++i)
+            {
+                std::size_t below = i + 1 < spine.size() ? sizes.runs(*spine[i + 1])->nodes : 0;
+                nodes += sizes.runs(*spine[i])->nodes - below;
+                if(nodes >= sizes.grain() || i + 1 == spine.size())
+                {
+                    if(nodes > largest_nodes)
+                    {
+                        sides.largest = sides.ends.size();
+                        largest_nodes = nodes;
+                    }
+                    sides.ends.push_back(i + 1);
+                    nodes = 0;
+                }
+            }
+
+            for_each_operand<NumType>(pool, sides, [&](std::size_t i)
+            {
+                auto ops = operands(*spine[i]);
+                auto first = const_cast<t_expression<NumType>*>(ops.first);
+                for(std::size_t k = 0; k < ops.count; ++k)
+                    if(i + 1 == spine.size() || &first[k] != spine[i + 1])
+                        fold(first[k]);
+            });
+
+            boost::optional<NumType> result;
+            for(std::size_t i = spine.size(); i-- > 0;)
+                result = apply_transform<tree_fold_step<NumType>>(*spine[i]);
+            return result;
+        }
+    };
+
+    template <typename NumType, typename State>
+    struct evaluator : public boost::static_visitor<NumType>
+    {
+        const State& c;
+        work_stealing_pool& pool;
+        const subtree_sizes<NumType>& sizes;
+        const typename subtree_sizes<NumType>::split& runs;
+
+        evaluator(const State& _c, work_stealing_pool& _pool, const subtree_sizes<NumType>& _sizes,
+                  const typename subtree_sizes<NumType>::split& _runs):
+            c(_c), pool(_pool), sizes(_sizes), runs(_runs) {}
+
+        static NumType eval(const State& c, work_stealing_pool& pool, const subtree_sizes<NumType>& sizes, const t_expression<NumType>& t)
+        {
+            auto runs = sizes.runs(t);
+            if(!runs)
+                return eval_expression_tree(c, t);
+            evaluator e(c, pool, sizes, *runs);
+            return boost::apply_visitor(e, t);
+        }
+
+        // Evaluates the operands of this node into values
+        void operands(const t_expression<NumType>* ops, NumType* values) const
+        {
+            for_each_operand<NumType>(pool, runs, [&](std::size_t i)
+            {
+                values[i] = eval(c, pool, sizes, ops[i]);
+            });
+        }
+
+        NumType fail(error_code code, const std::string& name) const
+        {
+            error_info e;
+            e.code = code;
+            e.name = name;
+            throw eval_error(e.message());
+        }
+
+        NumType operator()(const t_negate<NumType>& t) const
+        {
+            NumType value;
+            operands(&t.op, &value);
+            return -value;
+        }
+        template <typename Combine>
+        NumType binary(const t_binary_op<NumType>& t, Combine combine) const
+        {
+            NumType values[2];
+            operands(t.ops, values);
+            return combine(values[0], values[1]);
+        }
+        NumType operator()(const t_add<NumType>& t) const
+        {
+            return binary(t, [](NumType lhs, NumType rhs) { return lhs + rhs; });
+        }
+        NumType operator()(const t_subtract<NumType>& t) const
+        {
+            return binary(t, [](NumType lhs, NumType rhs) { return lhs - rhs; });
+        }
+        NumType operator()(const t_multiply<NumType>& t) const
+        {
+            return binary(t, [](NumType lhs, NumType rhs) { return lhs * rhs; });
+        }
+        NumType operator()(const t_divide<NumType>& t) const
+        {
+            return binary(t, [](NumType lhs, NumType rhs) { return lhs / rhs; });
+        }
+        NumType operator()(const t_exponentiate<NumType>& t) const
+        {
+            return binary(t, [](NumType lhs, NumType rhs) { return std::pow(lhs, rhs); });
+        }
+        NumType operator()(const t_func_invocation<NumType>& t) const
+        {
+            const builtin_function* f = find_builtin_function(t.name);
+            if(!f)
+                return fail(error_code::UndefinedFunction, t.name);
+            if(t.args.size() != f->arity)
+                return fail(error_code::WrongArgumentCount, t.name);
+
+            double args[builtin_max_arity];
+            operands(t.args.data(), args);
+            return f->scalar(args);
+        }
+        NumType operator()(const t_polynomial<NumType>& t) const
+        {
+            const auto* x = lookup_variable(c, t.var);
+            if(!x)
+                return fail(error_code::UndefinedVariable, t.var);
+
+            std::vector<NumType> coeffs(t.coeffs.size());
+            operands(t.coeffs.data(), coeffs.data());
+            return evaluate_polynomial(coeffs.data(), coeffs.size(), *x);
+        }
+        template <typename Combine>
+        NumType nary(const t_nary_op<NumType>& t, Combine combine) const
+        {
+            std::vector<NumType> values(t.ops.size());
+            operands(t.ops.data(), values.data());
+            return reduce_operands<NumType>(values.size(), [&](std::size_t i) { return values[i]; }, combine);
+        }
+        NumType operator()(const t_sum<NumType>& t) const
+        {
+            return nary(t, std::plus<NumType>());
+        }
+        NumType operator()(const t_product<NumType>& t) const
+        {
+            return nary(t, std::multiplies<NumType>());
+        }
+        template <typename Leaf>
+        NumType operator()(const Leaf& t) const
+        {
+            calculator_detail::evaluator<NumType, State> leaf(c, nullptr);
+            return leaf(t);
+        }
+    };
+}
+
+// tree_fold, with the operands of large nodes folded in parallel. The tree
+// is measured once, up front, before anything is folded.
+template <typename NumType>
+boost::optional<NumType> parallel_fold(t_expression<NumType>& t, work_stealing_pool& pool, std::size_t grain = parallel_grain)
+{
+    subtree_sizes<NumType> sizes(t, pool, grain);
+    parallel_detail::folder<NumType> f{pool, sizes};
+    return f.fold(t);
+}
+
+// eval_expression_tree, with the operands of large nodes evaluated in
+// parallel. sizes must have been measured from t as it is now.
+template <typename NumType, typename State>
+NumType parallel_eval_expression_tree(const State& c, const t_expression<NumType>& t, const subtree_sizes<NumType>& sizes,
+                                      work_stealing_pool& pool)
+{
+    return parallel_detail::evaluator<NumType, State>::eval(c, pool, sizes, t);
+}
+
+template <typename NumType, typename State>
+NumType parallel_eval_expression_tree(const State& c, const t_expression<NumType>& t, work_stealing_pool& pool,
+                                      std::size_t grain = parallel_grain)
+{
+    subtree_sizes<NumType> sizes(t, pool, grain);
+    return parallel_eval_expression_tree(c, t, sizes, pool);
+}
+
+#endif // PARALLEL_H_INCLUDED
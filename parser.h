@@ -1,18 +1,22 @@
 #ifndef PARSER_H_INCLUDED
 #define PARSER_H_INCLUDED
 
-#include <sstream>
-
 #include <array>
 #include <string>
 #include <vector>
 
+#include <algorithm>
 #include <cmath>
+#include <cstddef>
 #include <exception>
 #include <iterator>
+#include <type_traits>
+#include <utility>
 
 #include <boost/variant.hpp>
 
+#include "cost.h"
+#include "expected.h"
 #include "lexer.h"
 #include "tree.h"
 
@@ -29,76 +33,240 @@ public:
     }
 };
 
+// Remembers where the lookahead token starts, so errors can report an
+// offset. Input iterators cannot be measured and remember nothing.
+template <typename Iterator, bool Forward = std::is_base_of<std::forward_iterator_tag,
+                                                            typename std::iterator_traits<Iterator>::iterator_category>::value>
+class token_position
+{
+    Iterator origin, start;
+
+public:
+    explicit token_position(const Iterator& first): origin(first), start(first) {}
+
+    void mark(const Iterator& i)
+    {
+        start = i;
+    }
+
+    std::size_t offset() const
+    {
+        return static_cast<std::size_t>(std::distance(origin, start));
+    }
+};
+
+template <typename Iterator>
+class token_position<Iterator, false>
+{
+public:
+    explicit token_position(const Iterator&) {}
+
+    void mark(const Iterator&) {}
+
+    std::size_t offset() const
+    {
+        return no_position;
+    }
+};
+
+// The parse functions return false on failure, leaving the reason in error
+// and the offending token as the lookahead. They never throw on bad input;
+// parse_root does, for callers that want exceptions.
+//
+// Each parse function also leaves the depth of the tree it built in depth,
+// which together with the token, node and recursion counts is checked
+// against limits as parsing goes. Depth is that of the tree as built, in
+// which a chain such as a + b + c is a nest of binary operations: every
+// link of a chain adds a level, as it does for the passes that recurse
+// over the tree afterwards.
 template <typename Iterator>
 struct parser_state
 {
     Iterator head, last;
     token lookahead;
+    token_position<Iterator> position;
+    error_info error;
 
+    resource_limits limits;
+    std::size_t tokens, nodes, nesting, depth;
+    // The limit that stopped the scan, if any
+    const char* exceeded;
+
+    // Past max_tokens the lookahead becomes an invalid token, which every
+    // rule rejects. The end of input is not a token of the statement and
+    // is not counted.
     void scan()
     {
-        lookahead = get_token(head, last);
+        skip_spaces(head, last);
+        position.mark(head);
+        lookahead = scan_token(head, last);
+        if(lookahead.type != token_tag::EOI && ++tokens > limits.max_tokens)
+        {
+            exceeded = "max_tokens";
+            lookahead = token(token_tag::Invalid);
+        }
     }
 
-    parser_state(Iterator _first, Iterator _last): head(_first), last(_last), lookahead(token_tag::Invalid)
+    parser_state(Iterator _first, Iterator _last, const resource_limits& _limits = resource_limits()):
+        head(_first), last(_last), lookahead(token_tag::Invalid), position(_first), limits(_limits), tokens(0), nodes(0), nesting(0), depth(0),
+        exceeded(nullptr)
     {
         scan();
     }
 };
 
 template <typename Iterator>
-parser_state<Iterator> initialize_parser(Iterator first, Iterator last)
+parser_state<Iterator> initialize_parser(Iterator first, Iterator last, const resource_limits& limits = resource_limits())
 {
-    return parser_state<Iterator>(first, last);
+    return parser_state<Iterator>(first, last, limits);
 }
 
-parser_state<std::istreambuf_iterator<char>> initialize_parser(std::istream& is)
+inline parser_state<chunked_istream_iterator> initialize_parser(std::istream& is, const resource_limits& limits = resource_limits())
 {
-    return parser_state<std::istreambuf_iterator<char>>(std::istreambuf_iterator<char>(is), std::istreambuf_iterator<char>());
+    return parser_state<chunked_istream_iterator>(chunked_istream_iterator(is), chunked_istream_iterator(), limits);
 }
 
+// Records that the named limit was exceeded at the lookahead. Always
+// returns false.
 template <typename Iterator>
-void throw_parse_error(parser_state<Iterator>& s, std::string rule, std::string expected)
+bool parse_limit(parser_state<Iterator>& s, const char* limit)
 {
-    using namespace std;
+    s.error = error_info();
+    s.error.code = error_code::LimitExceeded;
+    s.error.position = s.position.offset();
+    s.error.name = limit;
+    return false;
+}
 
-    ostringstream o;
-    o << "In rule " << rule << ": expected " << expected << ", got ";
+// Accounts for a node of the given depth just built
+template <typename Iterator>
+bool add_node(parser_state<Iterator>& s, std::size_t depth)
+{
+    s.depth = depth;
+    if(++s.nodes > s.limits.max_nodes)
+        return parse_limit(s, "max_nodes");
+    if(depth > s.limits.max_depth)
+        return parse_limit(s, "max_depth");
+    return true;
+}
 
-    if(s.lookahead.type == token_tag::EOI)
-        o << "end-of-input.";
-    else if(s.lookahead.type == token_tag::Character)
-        o << '\'' << s.lookahead.val.c << "'.";
+// Records that rule expected something other than the lookahead. Always
+// returns false, for the caller to pass on.
+template <typename Iterator>
+bool parse_failure(parser_state<Iterator>& s, const char* rule, const char* expected)
+{
+    if(s.exceeded)
+        return parse_limit(s, s.exceeded);
+
+    error_info& e = s.error;
+    e.code = s.lookahead.type == token_tag::Invalid ? error_code::InvalidToken : error_code::UnexpectedToken;
+    e.position = s.position.offset();
+    e.rule = rule;
+    e.expected = expected;
+    e.found = s.lookahead.type;
+    if(s.lookahead.type == token_tag::Character)
+        e.found_char = s.lookahead.val.c;
     else if(s.lookahead.type == token_tag::Number)
-        o << "number " << s.lookahead.val.d << '.';
-    else
-        o << "invalid token.";
+        e.found_number = s.lookahead.val.d;
+    return false;
+}
+
+// Makes t the left-nested chain t op1 c1 op2 c2 ..., for the (op, c) in
+// links. Moving a tree into a new parent moves every node in it, so the
+// chain is built from its root down, each operand being moved once;
+// wrapping t in one link at a time would take time quadratic in the
+// length of the chain.
+inline void build_chain(t_expression<double>& t, std::vector<std::pair<char, t_expression<double>>>& links)
+{
+    if(links.empty())
+        return;
 
-    throw parse_error(o.str());
+    t_expression<double> first = std::move(t);
+    t_expression<double>* slot = &t;
+    for(std::size_t i = links.size(); i-- > 0;)
+    {
+        t_binary_op<double>* link;
+        switch(links[i].first)
+        {
+        case '+':
+            *slot = t_add<double>(0.0, std::move(links[i].second));
+            link = &boost::get<t_add<double>>(*slot);
+            break;
+        case '-':
+            *slot = t_subtract<double>(0.0, std::move(links[i].second));
+            link = &boost::get<t_subtract<double>>(*slot);
+            break;
+        case '*':
+            *slot = t_multiply<double>(0.0, std::move(links[i].second));
+            link = &boost::get<t_multiply<double>>(*slot);
+            break;
+        default:
+            *slot = t_divide<double>(0.0, std::move(links[i].second));
+            link = &boost::get<t_divide<double>>(*slot);
+            break;
+        }
+        slot = &link->ops[0];
+    }
+    *slot = std::move(first);
 }
 
 template <typename Iterator>
-void parse_expression(parser_state<Iterator>&, t_expression<double>&);
+bool parse_expression(parser_state<Iterator>&, t_expression<double>&);
 
 template <typename Iterator>
-void parse_factor(parser_state<Iterator>&, t_expression<double>&);
+bool parse_factor(parser_state<Iterator>&, t_expression<double>&);
 
 template <typename Iterator>
-void parse_parenthesized_expression(parser_state<Iterator>& s, t_expression<double>& t)
+bool parse_parenthesized_expression(parser_state<Iterator>& s, t_expression<double>& t)
 {
     if(s.lookahead.type != token_tag::Character || s.lookahead.val.c != '(')
-        throw_parse_error(s, "parenthesized-expression", "'('");
+        return parse_failure(s, "parenthesized-expression", "'('");
 
     s.scan();
 
-    parse_expression(s, t);
+    if(!parse_expression(s, t))
+        return false;
 
     if(s.lookahead.type != token_tag::Character || s.lookahead.val.c != ')')
-        throw_parse_error(s, "parenthesized-expression", "')'");
+        return parse_failure(s, "parenthesized-expression", "')'");
+    return true;
 }
 
+// Parses "(expression, ...)", leaving the closing ')' as the lookahead and
+// the depth of the deepest argument in depth
 template <typename Iterator>
-void parse_atom(parser_state<Iterator>& s, t_expression<double>& t)
+bool parse_argument_list(parser_state<Iterator>& s, std::vector<t_expression<double>>& args)
+{
+    s.scan();
+
+    std::size_t depth = 0;
+    if(s.lookahead.type == token_tag::Character && s.lookahead.val.c == ')')
+    {
+        s.depth = depth;
+        return true;
+    }
+
+    while(true)
+    {
+        args.emplace_back();
+        if(!parse_expression(s, args.back()))
+            return false;
+        depth = std::max(depth, s.depth);
+
+        if(s.lookahead.type != token_tag::Character || (s.lookahead.val.c != ',' && s.lookahead.val.c != ')'))
+            return parse_failure(s, "argument-list", "',' or ')'");
+        if(s.lookahead.val.c == ')')
+        {
+            s.depth = depth;
+            return true;
+        }
+
+        s.scan();
+    }
+}
+
+template <typename Iterator>
+bool parse_atom(parser_state<Iterator>& s, t_expression<double>& t)
 {
     using namespace std;
 
@@ -108,19 +276,38 @@ void parse_atom(parser_state<Iterator>& s, t_expression<double>& t)
     if(type == token_tag::Number)
     {
         t = s.lookahead.val.d;
+        if(!add_node(s, 1))
+            return false;
+        s.scan();
     }
     else if(type == token_tag::Identifier)
     {
-        t = t_var_occurrance<double>(move(s.lookahead.val.str));
+        string name = move(s.lookahead.val.str);
+        s.scan();
+
+        if(s.lookahead.type == token_tag::Character && s.lookahead.val.c == '(')
+        {
+            vector<t_expression<double>> args;
+            if(!parse_argument_list(s, args) || !add_node(s, s.depth + 1))
+                return false;
+            t = t_func_invocation<double>(move(name), std::move(args));
+            s.scan();
+        }
+        else
+        {
+            if(!add_node(s, 1))
+                return false;
+            t = t_var_occurrance<double>(move(name));
+        }
     }
     else if(type == token_tag::Character)
     {
-        parse_parenthesized_expression(s, t);
+        if(!parse_parenthesized_expression(s, t))
+            return false;
+        s.scan();
     }
     else
-        throw_parse_error(s, "atom", "number, identifier, or '('");
-
-    s.scan();
+        return parse_failure(s, "atom", "number, identifier, or '('");
 
     if(s.lookahead.type == token_tag::Character)
     {
@@ -130,44 +317,54 @@ void parse_atom(parser_state<Iterator>& s, t_expression<double>& t)
         {
             s.scan();
 
+            std::size_t depth = s.depth;
             t_expression<double> c;
-            parse_factor(s, c);
+            if(!parse_factor(s, c) || !add_node(s, std::max(depth, s.depth) + 1))
+                return false;
             t = t_exponentiate<double>(t, c);
         }
     }
+    return true;
 }
 
+// Every recursive cycle of the grammar passes through here, so counting
+// nesting here bounds the parser's recursion
 template <typename Iterator>
-void parse_factor(parser_state<Iterator>& s, t_expression<double>& t)
+bool parse_factor(parser_state<Iterator>& s, t_expression<double>& t)
 {
-    if(s.lookahead.type == token_tag::Character)
-    {
-        char op = s.lookahead.val.c;
+    if(++s.nesting > s.limits.max_depth)
+        return parse_limit(s, "max_depth");
 
-        if(op == '+')
-        {
-            s.scan();
-            parse_factor(s, t);
-        }
-        else if(op == '-')
-        {
-            s.scan();
+    bool ok;
+    char op = s.lookahead.type == token_tag::Character ? s.lookahead.val.c : 0;
+    if(op == '+')
+    {
+        s.scan();
+        ok = parse_factor(s, t);
+    }
+    else if(op == '-')
+    {
+        s.scan();
 
-            t_expression<double> c;
-            parse_factor(s, c);
+        t_expression<double> c;
+        ok = parse_factor(s, c) && add_node(s, s.depth + 1);
+        if(ok)
             t = t_negate<double>(c);
-        }
-        else
-            parse_atom(s, t);
     }
     else
-        parse_atom(s, t);
+        ok = parse_atom(s, t);
+
+    --s.nesting;
+    return ok;
 }
 
 template <typename Iterator>
-void parse_term(parser_state<Iterator>& s, t_expression<double>& t)
+bool parse_term(parser_state<Iterator>& s, t_expression<double>& t)
 {
-    parse_factor(s, t);
+    if(!parse_factor(s, t))
+        return false;
+
+    std::vector<std::pair<char, t_expression<double>>> links;
     while(s.lookahead.type == token_tag::Character)
     {
         char op = s.lookahead.val.c;
@@ -176,23 +373,26 @@ void parse_term(parser_state<Iterator>& s, t_expression<double>& t)
 
         s.scan();
 
+        std::size_t depth = s.depth;
         t_expression<double> c;
-        parse_factor(s, c);
-        if(op == '*')
-            t = t_multiply<double>(t, c);
-        else
-            t = t_divide<double>(t, c);
+        if(!parse_factor(s, c) || !add_node(s, std::max(depth, s.depth) + 1))
+            return false;
+        links.emplace_back(op, std::move(c));
     }
+    build_chain(t, links);
+    return true;
 }
 
 template <typename Iterator>
-void parse_expression(parser_state<Iterator>& s, t_expression<double>& t)
+bool parse_expression(parser_state<Iterator>& s, t_expression<double>& t)
 {
     if(s.lookahead.type == token_tag::Character && s.lookahead.val.c == ')')
-        throw_parse_error(s, "expression", "number, identifier, '+', '-' or '('");
+        return parse_failure(s, "expression", "number, identifier, '+', '-' or '('");
 
-    parse_term(s, t);
+    if(!parse_term(s, t))
+        return false;
 
+    std::vector<std::pair<char, t_expression<double>>> links;
     while(s.lookahead.type == token_tag::Character)
     {
         char op = s.lookahead.val.c;
@@ -201,15 +401,16 @@ void parse_expression(parser_state<Iterator>& s, t_expression<double>& t)
         {
             s.scan();
 
+            std::size_t depth = s.depth;
             t_expression<double> c;
-            parse_term(s, c);
-            if(op == '+')
-                t = t_add<double>(t, c);
-            else
-                t = t_subtract<double>(t, c);
+            if(!parse_term(s, c) || !add_node(s, std::max(depth, s.depth) + 1))
+                return false;
+            links.emplace_back(op, std::move(c));
         }
         else break;
     }
+    build_chain(t, links);
+    return true;
 }
 
 struct operator_properties
@@ -219,41 +420,70 @@ struct operator_properties
 };
 
 template <typename Iterator>
-void parse_definition(parser_state<Iterator>& s, t_statement<double>& t)
+bool parse_definition(parser_state<Iterator>& s, t_statement<double>& t)
 {
     using namespace std;
 
+    if(s.lookahead.type != token_tag::Identifier)
+        return parse_failure(s, "definition", "identifier");
+
     string name = move(s.lookahead.val.str);
 
     s.scan();
 
-    if(s.lookahead.type == token_tag::Character && s.lookahead.val.c == '=')
-    {
-        s.scan();
+    if(s.lookahead.type != token_tag::Character || s.lookahead.val.c != '=')
+        return parse_failure(s, "definition", "'='");
 
-        t_expression<double> e;
-        parse_expression(s, e);
-        t = t_var_definition<double>(move(name), std::move(e));
-    }
+    s.scan();
+
+    t_expression<double> e;
+    if(!parse_expression(s, e))
+        return false;
+    t = t_var_definition<double>(move(name), std::move(e));
+    return true;
 }
 
 template <typename Iterator>
-void parse_root(parser_state<Iterator>& s, t_statement<double>& t)
+bool try_parse_root(parser_state<Iterator>& s, t_statement<double>& t)
 {
     if(s.lookahead.type == token_tag::Identifier && s.lookahead.val.str == "define")
     {
         s.scan();
-        parse_definition(s, t);
+        if(!parse_definition(s, t))
+            return false;
     }
     else
     {
         t_expression<double> e;
-        parse_expression(s, e);
+        if(!parse_expression(s, e))
+            return false;
         t = std::move(e);
     }
 
     if(s.lookahead.type != token_tag::EOI)
-        throw_parse_error(s, "root", "end-of-input");
+        return parse_failure(s, "root", "end-of-input");
+    return true;
+}
+
+// Throws lex_error or parse_error on bad input
+template <typename Iterator>
+void parse_root(parser_state<Iterator>& s, t_statement<double>& t)
+{
+    if(try_parse_root(s, t))
+        return;
+    if(s.error.code == error_code::InvalidToken)
+        throw lex_error();
+    throw parse_error(s.error.message());
+}
+
+template <typename Iterator>
+expected<t_statement<double>> try_parse(Iterator first, Iterator last, const resource_limits& limits = resource_limits())
+{
+    auto s = initialize_parser(first, last, limits);
+    t_statement<double> t;
+    if(!try_parse_root(s, t))
+        return expected<t_statement<double>>(std::move(s.error));
+    return expected<t_statement<double>>(std::move(t));
 }
 
 #endif // PARSER_H_INCLUDED
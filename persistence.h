@@ -0,0 +1,360 @@
+#ifndef PERSISTENCE_H_INCLUDED
+#define PERSISTENCE_H_INCLUDED
+
+#include <fstream>
+#include <sstream>
+
+#include <string>
+#include <unordered_map>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <iterator>
+#include <type_traits>
+#include <utility>
+
+#include <boost/crc.hpp>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "calculator.h"
+#include "tree.h"
+
+// On-disk layout, all integers in host byte order:
+//
+// Snapshot:  "MEPSNAP1" | u32 sizeof(NumType) | u64 record count | records... | u32 crc32 of all preceding bytes
+// Journal:   { u32 record length | u32 crc32 of record | record }...
+// Record:    u32 name length | name | NumType value | u32 definition length | definition text
+//
+// The value is authoritative, so restoring never re-parses or re-evaluates
+// anything; the definition text is kept so the state can be inspected or
+// rebuilt by hand. A journal whose tail fails its length or checksum test
+// (a torn write) is replayed up to the last intact record.
+//
+// Journal appends and snapshots are fsynced before they are relied on, and
+// the snapshot's directory after it is renamed into place, so a definition
+// that has returned survives a power loss, and the journal is only emptied
+// once the snapshot replacing it is on disk.
+
+class persistence_error : public std::exception
+{
+    std::string msg;
+
+public:
+
+    persistence_error(std::string _msg): msg(std::move(_msg)) {}
+
+    const char* what() const noexcept
+    {
+        return msg.c_str();
+    }
+};
+
+namespace persistence_detail
+{
+    const char snapshot_magic[8] = {'M', 'E', 'P', 'S', 'N', 'A', 'P', '1'};
+
+    template <typename T>
+    void put(std::string& buf, const T& v)
+    {
+        buf.append(reinterpret_cast<const char*>(&v), sizeof(v));
+    }
+
+    template <typename T>
+    bool get(const char*& p, const char* last, T& v)
+    {
+        if(static_cast<std::size_t>(last - p) < sizeof(v))
+            return false;
+        std::memcpy(&v, p, sizeof(v));
+        p += sizeof(v);
+        return true;
+    }
+
+    inline void put_string(std::string& buf, const std::string& s)
+    {
+        put(buf, static_cast<std::uint32_t>(s.size()));
+        buf.append(s);
+    }
+
+    inline bool get_string(const char*& p, const char* last, std::string& s)
+    {
+        std::uint32_t size;
+        if(!get(p, last, size) || static_cast<std::size_t>(last - p) < size)
+            return false;
+        s.assign(p, size);
+        p += size;
+        return true;
+    }
+
+    inline std::uint32_t checksum(const char* first, const char* last)
+    {
+        boost::crc_32_type crc;
+        crc.process_block(first, last);
+        return crc.checksum();
+    }
+
+    template <typename NumType>
+    void put_record(std::string& buf, const std::string& name, NumType value, const std::string& definition)
+    {
+        put_string(buf, name);
+        put(buf, value);
+        put_string(buf, definition);
+    }
+
+    template <typename NumType>
+    bool get_record(const char*& p, const char* last, std::string& name, NumType& value, std::string& definition)
+    {
+        return get_string(p, last, name) && get(p, last, value) && get_string(p, last, definition);
+    }
+
+    inline bool write_all(int fd, const char* p, std::size_t size)
+    {
+        while(size > 0)
+        {
+            ssize_t n = ::write(fd, p, size);
+            if(n < 0 && errno == EINTR)
+                continue;
+            if(n <= 0)
+                return false;
+            p += n;
+            size -= static_cast<std::size_t>(n);
+        }
+        return true;
+    }
+
+    inline bool sync(int fd)
+    {
+        while(::fsync(fd) != 0)
+            if(errno != EINTR)
+                return false;
+        return true;
+    }
+
+    // Makes a rename or creation in path's directory durable
+    inline bool sync_directory(const std::string& path)
+    {
+        auto slash = path.rfind('/');
+        std::string dir = slash == std::string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+
+        int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if(fd < 0)
+            return false;
+        bool synced = sync(fd);
+        ::close(fd);
+        return synced;
+    }
+
+    inline bool read_file(const std::string& path, std::string& contents)
+    {
+        std::ifstream is(path, std::ios::binary);
+        if(!is)
+            return false;
+        contents.assign(std::istreambuf_iterator<char>(is), std::istreambuf_iterator<char>());
+        return true;
+    }
+}
+
+template <typename NumType>
+class persistent_calculator
+{
+    static_assert(std::is_trivially_copyable<NumType>::value, "persistent_calculator stores NumType as raw bytes");
+
+    calculator_state<NumType> calc;
+    std::unordered_map<std::string, std::string> definitions;
+
+    std::string snapshot_path, journal_path;
+    int journal;
+
+    void open_journal(int flags = O_APPEND)
+    {
+        close_journal();
+        journal = ::open(journal_path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC | flags, 0666);
+        if(journal < 0)
+            throw persistence_error("Cannot open journal " + journal_path);
+    }
+
+    void close_journal()
+    {
+        if(journal >= 0)
+            ::close(journal);
+        journal = -1;
+    }
+
+    void load_snapshot()
+    {
+        using namespace persistence_detail;
+
+        std::string contents;
+        if(!read_file(snapshot_path, contents))
+            return;
+
+        const char* p = contents.data();
+        const char* last = p + contents.size();
+
+        std::uint32_t stored_crc;
+        if(contents.size() < sizeof(snapshot_magic) + sizeof(stored_crc) || std::memcmp(p, snapshot_magic, sizeof(snapshot_magic)) != 0)
+            throw persistence_error("Not a calculator snapshot: " + snapshot_path);
+
+        last -= sizeof(stored_crc);
+        std::memcpy(&stored_crc, last, sizeof(stored_crc));
+        if(checksum(p, last) != stored_crc)
+            throw persistence_error("Checksum mismatch in snapshot " + snapshot_path);
+
+        p += sizeof(snapshot_magic);
+
+        std::uint32_t value_size;
+        std::uint64_t count;
+        if(!get(p, last, value_size) || value_size != sizeof(NumType) || !get(p, last, count))
+            throw persistence_error("Incompatible snapshot " + snapshot_path);
+
+        calc.variable_set.reserve(count);
+        definitions.reserve(count);
+
+        std::string name, definition;
+        NumType value;
+        for(; count > 0; --count)
+        {
+            if(!get_record(p, last, name, value, definition))
+                throw persistence_error("Truncated snapshot " + snapshot_path);
+
+            calc.variable_set[name] = value;
+            definitions[name] = definition;
+        }
+    }
+
+    // Returns false if the journal ends in a damaged record
+    bool replay_journal(std::size_t& replayed)
+    {
+        using namespace persistence_detail;
+
+        std::string contents;
+        if(!read_file(journal_path, contents))
+            return true;
+
+        const char* p = contents.data();
+        const char* last = p + contents.size();
+
+        std::string name, definition;
+        NumType value;
+        while(p != last)
+        {
+            std::uint32_t size, crc;
+            if(!get(p, last, size) || !get(p, last, crc) || static_cast<std::size_t>(last - p) < size || checksum(p, p + size) != crc)
+                return false;
+
+            const char* record = p;
+            p += size;
+            if(!get_record(record, p, name, value, definition))
+                return false;
+
+            calc.variable_set[name] = value;
+            definitions[name] = std::move(definition);
+            ++replayed;
+        }
+
+        return true;
+    }
+
+public:
+
+    persistent_calculator(const std::string& path): snapshot_path(path + ".snapshot"), journal_path(path + ".journal"), journal(-1) {}
+
+    ~persistent_calculator()
+    {
+        close_journal();
+    }
+
+    persistent_calculator(const persistent_calculator&) = delete;
+    persistent_calculator& operator=(const persistent_calculator&) = delete;
+
+    const calculator_state<NumType>& state() const
+    {
+        return calc;
+    }
+
+    // Loads the snapshot and replays the journal written since it was taken.
+    // Returns the number of journal records replayed.
+    std::size_t recover()
+    {
+        calc.variable_set.clear();
+        definitions.clear();
+
+        load_snapshot();
+
+        std::size_t replayed = 0;
+        if(replay_journal(replayed))
+            open_journal();
+        else
+            checkpoint();
+
+        return replayed;
+    }
+
+    void define(const t_var_definition<NumType>& t)
+    {
+        NumType n = eval_expression_tree(calc, t.val);
+
+        std::ostringstream definition;
+        write_expression(definition, t.val);
+
+        std::string record;
+        persistence_detail::put_record(record, t.name, n, definition.str());
+
+        std::string frame;
+        persistence_detail::put(frame, static_cast<std::uint32_t>(record.size()));
+        persistence_detail::put(frame, persistence_detail::checksum(record.data(), record.data() + record.size()));
+        frame += record;
+
+        if(journal < 0)
+            open_journal();
+        if(!persistence_detail::write_all(journal, frame.data(), frame.size()) || !persistence_detail::sync(journal))
+            throw persistence_error("Cannot append to journal " + journal_path);
+
+        calc.variable_set[t.name] = n;
+        definitions[t.name] = definition.str();
+    }
+
+    // Writes a fresh snapshot and empties the journal. The snapshot is
+    // written beside the old one, synced, and renamed over it, so a crash
+    // or power loss part way through leaves the previous snapshot and
+    // journal intact.
+    void checkpoint()
+    {
+        using namespace persistence_detail;
+
+        std::string contents(snapshot_magic, sizeof(snapshot_magic));
+        put(contents, static_cast<std::uint32_t>(sizeof(NumType)));
+        put(contents, static_cast<std::uint64_t>(calc.variable_set.size()));
+
+        static const std::string no_definition;
+        calc.variable_set.for_each([&](const std::string& name, NumType value)
+        {
+            auto it = definitions.find(name);
+            put_record(contents, name, value, it != definitions.end() ? it->second : no_definition);
+        });
+
+        put(contents, checksum(contents.data(), contents.data() + contents.size()));
+
+        std::string temp_path = snapshot_path + ".tmp";
+        int fd = ::open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+        if(fd < 0)
+            throw persistence_error("Cannot write snapshot " + temp_path);
+        bool written = write_all(fd, contents.data(), contents.size()) && sync(fd);
+        ::close(fd);
+        if(!written)
+            throw persistence_error("Cannot write snapshot " + temp_path);
+
+        if(std::rename(temp_path.c_str(), snapshot_path.c_str()) != 0 || !sync_directory(snapshot_path))
+            throw persistence_error("Cannot replace snapshot " + snapshot_path);
+
+        open_journal(O_TRUNC);
+        if(!sync(journal))
+            throw persistence_error("Cannot truncate journal " + journal_path);
+    }
+};
+
+#endif // PERSISTENCE_H_INCLUDED
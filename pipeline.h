@@ -0,0 +1,653 @@
+#ifndef PIPELINE_H_INCLUDED
+#define PIPELINE_H_INCLUDED
+
+#include <ostream>
+
+#include <future>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <limits>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <boost/variant.hpp>
+
+#include "batch.h"
+#include "codegen.h"
+#include "output.h"
+#include "parser.h"
+#include "polynomial.h"
+#include "specialize.h"
+#include "thread_pool.h"
+#include "tree.h"
+#include "tree_transform.h"
+
+// Evaluates expressions over every row of a data file and streams one CSV
+// row of results per input row. The input is memory-mapped and is either
+//
+// CSV:     a header line of variable names, then one line of numbers per
+//          row, fields separated by ','. Empty fields read as NaN.
+//
+// Columns: "MEPCOLS1" | u64 rows | u64 columns | { u64 name length | name }...
+//          | zero padding to a multiple of 8 bytes | column after column of
+//          rows little-endian doubles. On little-endian hosts the columns
+//          are evaluated in place, without copying.
+//
+// Rows are processed a block at a time. While one block is evaluated, the
+// next is parsed and the previous one formatted and written on other
+// threads.
+
+class pipeline_error : public std::exception
+{
+    std::string msg;
+
+public:
+
+    pipeline_error(std::string _msg): msg(std::move(_msg)) {}
+
+    const char* what() const noexcept
+    {
+        return msg.c_str();
+    }
+};
+
+// Parses a decimal floating point number at the start of [first, last).
+// Numbers of up to 19 significant digits with a power of ten that is exact
+// in a double are converted with a single rounding; anything else goes
+// through strtod. Both are correctly rounded. Returns the end of the
+// number, or first if there is none.
+inline const char* parse_double(const char* first, const char* last, double& out)
+{
+    static const double powers[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+                                    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+
+    const char* p = first;
+    bool negative = false;
+    if(p != last && (*p == '-' || *p == '+'))
+        negative = *p++ == '-';
+
+    std::uint64_t mantissa = 0;
+    int digits = 0, exponent = 0;
+    bool any = false;
+
+    for(; p != last && *p >= '0' && *p <= '9'; ++p, any = true)
+    {
+        if(digits < 19)
+        {
+            mantissa = mantissa * 10 + (*p - '0');
+            digits += mantissa != 0;
+        }
+        else
+            ++exponent, ++digits;
+    }
+    if(p != last && *p == '.')
+    {
+        for(++p; p != last && *p >= '0' && *p <= '9'; ++p, any = true)
+        {
+            if(digits < 19)
+            {
+                mantissa = mantissa * 10 + (*p - '0');
+                digits += mantissa != 0;
+                --exponent;
+            }
+            else
+                ++digits;
+        }
+    }
+
+    if(any && p != last && (*p == 'e' || *p == 'E'))
+    {
+        const char* q = p + 1;
+        bool negative_exponent = false;
+        if(q != last && (*q == '-' || *q == '+'))
+            negative_exponent = *q++ == '-';
+
+        if(q != last && *q >= '0' && *q <= '9')
+        {
+            int e = 0;
+            for(; q != last && *q >= '0' && *q <= '9'; ++q)
+            {
+                if(e < 100000)
+                    e = e * 10 + (*q - '0');
+            }
+            exponent += negative_exponent ? -e : e;
+            p = q;
+        }
+    }
+
+    if(any && digits <= 19 && mantissa <= (std::uint64_t(1) << 53) && exponent >= -22 && exponent <= 22)
+    {
+        double d = static_cast<double>(mantissa);
+        d = exponent < 0 ? d / powers[-exponent] : d * powers[exponent];
+        out = negative ? -d : d;
+        return p;
+    }
+
+    // Long mantissas, large exponents, inf and nan. The mapped file is not
+    // NUL-terminated, so strtod works on a copy.
+    char small[64];
+    std::string large;
+    std::size_t size = last - first;
+    const char* text;
+    if(size < sizeof(small))
+    {
+        std::memcpy(small, first, size);
+        small[size] = '\0';
+        text = small;
+    }
+    else
+    {
+        large.assign(first, last);
+        text = large.c_str();
+    }
+
+    char* end;
+    out = std::strtod(text, &end);
+    return first + (end - text);
+}
+
+namespace pipeline_detail
+{
+    class mapped_file
+    {
+        const char* data;
+        std::size_t length;
+
+    public:
+        explicit mapped_file(const std::string& path): data(nullptr), length(0)
+        {
+            int fd = open(path.c_str(), O_RDONLY);
+            if(fd < 0)
+                throw pipeline_error("Cannot open " + path);
+
+            struct stat st;
+            if(fstat(fd, &st) != 0)
+            {
+                close(fd);
+                throw pipeline_error("Cannot stat " + path);
+            }
+
+            length = static_cast<std::size_t>(st.st_size);
+            if(length > 0)
+            {
+                void* p = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+                if(p == MAP_FAILED)
+                {
+                    close(fd);
+                    throw pipeline_error("Cannot map " + path);
+                }
+                madvise(p, length, MADV_SEQUENTIAL);
+                data = static_cast<const char*>(p);
+            }
+            close(fd);
+        }
+
+        ~mapped_file()
+        {
+            if(data)
+                munmap(const_cast<char*>(data), length);
+        }
+
+        mapped_file(const mapped_file&) = delete;
+        mapped_file& operator=(const mapped_file&) = delete;
+
+        const char* begin() const { return data; }
+        const char* end() const { return data + length; }
+        std::size_t size() const { return length; }
+    };
+
+    const char column_magic[8] = {'M', 'E', 'P', 'C', 'O', 'L', 'S', '1'};
+
+    // Values for one block of rows. columns[i] points either into storage[i]
+    // or straight into the mapped file.
+    struct input_block
+    {
+        std::size_t rows;
+        std::vector<std::vector<double>> storage;
+        std::vector<const double*> columns;
+    };
+
+    class row_source
+    {
+    public:
+        virtual ~row_source() {}
+
+        virtual const std::vector<std::string>& names() const = 0;
+
+        // Fills the next block of at most max_rows rows, reading only the
+        // columns flagged in needed. Returns false at the end of the input.
+        virtual bool next(input_block& block, std::size_t max_rows, const std::vector<bool>& needed) = 0;
+    };
+
+    inline bool is_blank(char c)
+    {
+        return c == ' ' || c == '\t' || c == '\r';
+    }
+
+    class csv_source : public row_source
+    {
+        const mapped_file& file;
+        const char* cursor;
+        std::size_t line;
+        std::vector<std::string> header;
+
+        const char* line_end(const char* p) const
+        {
+            const void* nl = std::memchr(p, '\n', file.end() - p);
+            return nl ? static_cast<const char*>(nl) : file.end();
+        }
+
+        [[noreturn]] void fail(const std::string& what) const
+        {
+            throw pipeline_error("Line " + std::to_string(line) + ": " + what);
+        }
+
+    public:
+        explicit csv_source(const mapped_file& _file): file(_file), cursor(_file.begin()), line(1)
+        {
+            if(file.size() == 0)
+                throw pipeline_error("Empty input");
+
+            const char* end = line_end(cursor);
+            const char* field = cursor;
+            for(const char* p = cursor; ; ++p)
+            {
+                if(p == end || *p == ',')
+                {
+                    const char* a = field;
+                    const char* b = p;
+                    while(a != b && is_blank(*a)) ++a;
+                    while(b != a && is_blank(b[-1])) --b;
+                    header.emplace_back(a, b);
+                    field = p + 1;
+                }
+                if(p == end)
+                    break;
+            }
+
+            cursor = end == file.end() ? end : end + 1;
+        }
+
+        const std::vector<std::string>& names() const
+        {
+            return header;
+        }
+
+        bool next(input_block& block, std::size_t max_rows, const std::vector<bool>& needed)
+        {
+            std::size_t n = header.size();
+            block.rows = 0;
+            block.storage.resize(n);
+            block.columns.assign(n, nullptr);
+            for(std::size_t c = 0; c < n; ++c)
+            {
+                if(needed[c])
+                    block.storage[c].resize(max_rows);
+            }
+
+            while(block.rows < max_rows && cursor != file.end())
+            {
+                ++line;
+                const char* end = line_end(cursor);
+                const char* p = cursor;
+                cursor = end == file.end() ? end : end + 1;
+
+                while(p != end && is_blank(*p)) ++p;
+                if(p == end)
+                    continue;
+
+                for(std::size_t c = 0; c < n; ++c)
+                {
+                    while(p != end && is_blank(*p)) ++p;
+
+                    double value = std::numeric_limits<double>::quiet_NaN();
+                    if(p != end && *p != ',')
+                    {
+                        const char* q = parse_double(p, end, value);
+                        if(q == p)
+                            fail("bad number in column " + header[c]);
+                        p = q;
+                        while(p != end && is_blank(*p)) ++p;
+                    }
+
+                    if(c + 1 < n)
+                    {
+                        if(p == end || *p != ',')
+                            fail("expected " + std::to_string(n) + " fields");
+                        ++p;
+                    }
+                    else if(p != end)
+                        fail("expected " + std::to_string(n) + " fields");
+
+                    if(needed[c])
+                        block.storage[c][block.rows] = value;
+                }
+                ++block.rows;
+            }
+
+            for(std::size_t c = 0; c < n; ++c)
+            {
+                if(needed[c])
+                    block.columns[c] = block.storage[c].data();
+            }
+            return block.rows > 0;
+        }
+    };
+
+    class column_source : public row_source
+    {
+        const mapped_file& file;
+        std::vector<std::string> header;
+        std::uint64_t row_count;
+        const char* data;
+        std::size_t position;
+
+        template <typename T>
+        static T read_le(const char* p)
+        {
+            T v = 0;
+            for(std::size_t i = 0; i < sizeof(T); ++i)
+                v |= static_cast<T>(static_cast<unsigned char>(p[i])) << (8 * i);
+            return v;
+        }
+
+        static double read_double(const char* p)
+        {
+            std::uint64_t bits = read_le<std::uint64_t>(p);
+            double d;
+            std::memcpy(&d, &bits, sizeof(d));
+            return d;
+        }
+
+    public:
+        explicit column_source(const mapped_file& _file): file(_file), position(0)
+        {
+            const char* p = file.begin();
+            std::size_t size = file.size();
+            if(size < 24)
+                throw pipeline_error("Truncated column file header");
+
+            row_count = read_le<std::uint64_t>(p + 8);
+            std::uint64_t count = read_le<std::uint64_t>(p + 16);
+            std::size_t offset = 24;
+
+            for(std::uint64_t c = 0; c < count; ++c)
+            {
+                if(size - offset < 8)
+                    throw pipeline_error("Truncated column file header");
+                std::uint64_t length = read_le<std::uint64_t>(p + offset);
+                offset += 8;
+                if(size - offset < length)
+                    throw pipeline_error("Truncated column file header");
+                header.emplace_back(p + offset, length);
+                offset += length;
+            }
+
+            offset = (offset + 7) / 8 * 8;
+            if(offset > size || (size - offset) / 8 / (count ? count : 1) < row_count)
+                throw pipeline_error("Column file is shorter than its header says");
+            data = p + offset;
+        }
+
+        const std::vector<std::string>& names() const
+        {
+            return header;
+        }
+
+        bool next(input_block& block, std::size_t max_rows, const std::vector<bool>& needed)
+        {
+            std::size_t n = header.size();
+            block.rows = std::min<std::size_t>(max_rows, row_count - position);
+            block.storage.resize(n);
+            block.columns.assign(n, nullptr);
+
+            for(std::size_t c = 0; c < n && block.rows > 0; ++c)
+            {
+                if(!needed[c])
+                    continue;
+
+                const char* first = data + (c * row_count + position) * sizeof(double);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+                block.columns[c] = reinterpret_cast<const double*>(first);
+#else
+                block.storage[c].resize(block.rows);
+                for(std::size_t r = 0; r < block.rows; ++r)
+                    block.storage[c][r] = read_double(first + r * sizeof(double));
+                block.columns[c] = block.storage[c].data();
+#endif
+            }
+
+            position += block.rows;
+            return block.rows > 0;
+        }
+    };
+
+    inline void append_csv_field(std::string& out, const std::string& s)
+    {
+        if(s.find_first_of(",\"\n") == std::string::npos)
+        {
+            out += s;
+            return;
+        }
+
+        out += '"';
+        for(char c : s)
+        {
+            if(c == '"')
+                out += '"';
+            out += c;
+        }
+        out += '"';
+    }
+
+    inline void append_number(std::string& out, double d)
+    {
+        char buf[format_buffer_size];
+        out.append(buf, format_shortest(buf, d));
+    }
+}
+
+// Variables in bindings are fixed for the whole run and specialized away
+// before compiling, taking precedence over columns of the same name. With
+// native, the expressions are compiled to machine code by codegen.h
+// instead of run as a batch_program.
+struct pipeline_options
+{
+    std::size_t block_rows;
+    unsigned int threads;
+    std::unordered_map<std::string, double> bindings;
+    bool native;
+    codegen_options codegen;
+
+    pipeline_options(): block_rows(65536), threads(1), native(false) {}
+};
+
+// Writes a header of the expressions' text, then one line of results per
+// input row. Returns the number of rows processed.
+inline std::size_t run_pipeline(const std::string& input_path, const std::vector<std::string>& expressions, std::ostream& out,
+                                const pipeline_options& options = pipeline_options())
+{
+    using namespace pipeline_detail;
+
+    if(expressions.empty())
+        throw pipeline_error("No expressions to evaluate");
+
+    mapped_file file(input_path);
+    std::unique_ptr<row_source> source;
+    if(file.size() >= sizeof(column_magic) && std::memcmp(file.begin(), column_magic, sizeof(column_magic)) == 0)
+        source.reset(new column_source(file));
+    else
+        source.reset(new csv_source(file));
+
+    const auto& names = source->names();
+    std::unordered_map<std::string, std::size_t> index;
+    for(std::size_t i = 0; i < names.size(); ++i)
+        index.emplace(names[i], i);
+
+    std::vector<t_expression<double>> trees;
+    for(const auto& e : expressions)
+    {
+        auto s = initialize_parser(e.begin(), e.end());
+        t_statement<double> t;
+        parse_root(s, t);
+        if(identify_statement(t) != statement_type::Expression)
+            throw pipeline_error("Not an expression: " + e);
+
+        trees.push_back(specialize_expression(std::move(boost::get<t_expression<double>>(t)), options.bindings));
+        apply_transform<tree_polynomial<double>>(trees.back());
+        apply_transform<tree_flatten<double>>(trees.back());
+        apply_transform<tree_fold<double>>(trees.back());
+    }
+
+    // One program for all the expressions, so what they share is computed
+    // once per block
+    batch_program program(trees);
+
+    std::unique_ptr<native_expressions> native;
+    if(options.native)
+        native.reset(new native_expressions(trees, options.codegen));
+
+    std::vector<bool> needed(names.size(), false);
+    for(const auto& v : program.variables())
+    {
+        auto it = index.find(v);
+        if(it == index.end())
+        {
+            for(std::size_t i = 0; i < trees.size(); ++i)
+            {
+                batch_program single(trees[i]);
+                const auto& used = single.variables();
+                if(std::find(used.begin(), used.end(), v) != used.end())
+                    throw pipeline_error("No column named " + v + " for " + expressions[i]);
+            }
+            throw pipeline_error("No column named " + v);
+        }
+        needed[it->second] = true;
+    }
+
+    std::unique_ptr<work_stealing_pool> pool;
+    if(options.threads > 1)
+        pool.reset(new work_stealing_pool(options.threads));
+
+    std::string header;
+    for(std::size_t i = 0; i < expressions.size(); ++i)
+    {
+        if(i)
+            header += ',';
+        append_csv_field(header, expressions[i]);
+    }
+    header += '\n';
+    out.write(header.data(), header.size());
+
+    std::size_t block_rows = options.block_rows ? options.block_rows : 1;
+    // Results are double-buffered too: a block is formatted and written on
+    // another thread while the next one is evaluated
+    input_block blocks[2];
+    std::string text[2];
+    std::vector<std::vector<double>> results[2];
+    std::vector<double*> outputs[2];
+    for(std::size_t k = 0; k < 2; ++k)
+    {
+        results[k].assign(trees.size(), std::vector<double>(block_rows));
+        for(auto& r : results[k])
+            outputs[k].push_back(r.data());
+    }
+    std::size_t total = 0;
+
+    auto format = [&](std::size_t k, std::size_t rows)
+    {
+        const auto& result = results[k % 2];
+        std::string& t = text[k % 2];
+        t.clear();
+        for(std::size_t r = 0; r < rows; ++r)
+        {
+            for(std::size_t i = 0; i < result.size(); ++i)
+            {
+                if(i)
+                    t += ',';
+                append_number(t, result[i][r]);
+            }
+            t += '\n';
+        }
+        out.write(t.data(), t.size());
+    };
+
+    auto load = [&](std::size_t k)
+    {
+        return source->next(blocks[k % 2], block_rows, needed);
+    };
+
+    std::future<bool> loading = std::async(std::launch::async, load, 0);
+    std::future<void> writing;
+    for(std::size_t k = 0; loading.get(); ++k)
+    {
+        input_block& block = blocks[k % 2];
+        loading = std::async(std::launch::async, load, k + 1);
+
+        auto& output = outputs[k % 2];
+        batch_columns columns(block.rows);
+        for(std::size_t c = 0; c < names.size(); ++c)
+        {
+            if(needed[c])
+                columns.bind(names[c], block.columns[c]);
+        }
+
+        if(native && pool)
+        {
+            std::size_t chunk = std::max<std::size_t>(block.rows / (4 * pool->size()), 1024);
+            task_group group(*pool);
+            for(std::size_t i = 0; i < trees.size(); ++i)
+            {
+                for(std::size_t first = 0; first < block.rows; first += chunk)
+                {
+                    std::size_t last = std::min(block.rows, first + chunk);
+                    group.run([&native, &columns, &output, i, first, last]
+                    {
+                        native->evaluate(i, columns, output[i], first, last);
+                    });
+                }
+            }
+            group.wait();
+        }
+        else if(native)
+        {
+            for(std::size_t i = 0; i < trees.size(); ++i)
+                native->evaluate(i, columns, output[i]);
+        }
+        else if(pool)
+            program.evaluate(*pool, columns, output.data());
+        else
+            program.evaluate(columns, output.data());
+        total += block.rows;
+
+        // The previous block's results are free for the next block once
+        // they have been written
+        if(writing.valid())
+            writing.get();
+        writing = std::async(std::launch::async, format, k, block.rows);
+    }
+
+    if(writing.valid())
+        writing.get();
+    out.flush();
+    if(!out)
+        throw pipeline_error("Error writing output");
+
+    return total;
+}
+
+#endif // PIPELINE_H_INCLUDED
@@ -0,0 +1,458 @@
+#ifndef POLYNOMIAL_H_INCLUDED
+#define POLYNOMIAL_H_INCLUDED
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <cmath>
+#include <cstddef>
+#include <utility>
+
+#include <boost/variant.hpp>
+
+#include "tree.h"
+#include "tree_transform.h"
+
+// Without a hardware FMA, std::fma is a slow exact emulation, so a plain
+// multiply and add is used instead
+template <typename NumType>
+NumType multiply_add(NumType a, NumType b, NumType c)
+{
+#ifdef FP_FAST_FMA
+    using std::fma;
+    return fma(a, b, c);
+#else
+    return a * b + c;
+#endif
+}
+
+// Degree n-1 polynomial with coefficients c[0..n-1], lowest first
+template <typename NumType>
+NumType evaluate_horner(const NumType* c, std::size_t n, NumType x)
+{
+    if(n == 0)
+        return NumType(0);
+
+    NumType r = c[n-1];
+    for(std::size_t k = n - 1; k > 0; --k)
+        r = multiply_add(r, x, c[k-1]);
+    return r;
+}
+
+// Pairs coefficients into linear terms in x, then pairs those in x^2, x^4
+// and so on. The terms at each level are independent, which exposes
+// instruction-level parallelism that Horner's serial chain does not.
+// Overwrites c.
+template <typename NumType>
+NumType evaluate_estrin(NumType* c, std::size_t n, NumType x)
+{
+    if(n == 0)
+        return NumType(0);
+
+    while(n > 1)
+    {
+        std::size_t half = n / 2;
+        for(std::size_t i = 0; i < half; ++i)
+            c[i] = multiply_add(c[2*i+1], x, c[2*i]);
+        if(n % 2)
+            c[half] = c[n-1];
+
+        n = half + n % 2;
+        x = x * x;
+    }
+    return c[0];
+}
+
+const std::size_t estrin_min_coefficients = 8;
+
+template <typename NumType>
+NumType evaluate_polynomial(NumType* c, std::size_t n, NumType x)
+{
+    if(n >= estrin_min_coefficients)
+        return evaluate_estrin(c, n, x);
+    return evaluate_horner(c, n, x);
+}
+
+struct polynomial_limits
+{
+    unsigned int max_degree;
+    std::size_t max_terms;
+
+    polynomial_limits(): max_degree(16), max_terms(64) {}
+};
+
+namespace polynomial_detail
+{
+    // Sparse multivariate polynomial, monomials being variable/exponent
+    // lists sorted by variable name
+    typedef std::vector<std::pair<std::string, unsigned int>> monomial;
+
+    template <typename NumType>
+    using terms = std::map<monomial, NumType>;
+
+    inline monomial multiply(const monomial& a, const monomial& b)
+    {
+        monomial r;
+        auto i = a.begin(), j = b.begin();
+        while(i != a.end() || j != b.end())
+        {
+            if(j == b.end() || (i != a.end() && i->first < j->first))
+                r.push_back(*i++);
+            else if(i == a.end() || j->first < i->first)
+                r.push_back(*j++);
+            else
+            {
+                r.emplace_back(i->first, i->second + j->second);
+                ++i;
+                ++j;
+            }
+        }
+        return r;
+    }
+
+    template <typename NumType>
+    bool within(const terms<NumType>& p, const polynomial_limits& limits)
+    {
+        if(p.size() > limits.max_terms)
+            return false;
+        for(const auto& t : p)
+        {
+            for(const auto& v : t.first)
+            {
+                if(v.second > limits.max_degree)
+                    return false;
+            }
+        }
+        return true;
+    }
+
+    template <typename NumType>
+    void add(terms<NumType>& a, const terms<NumType>& b, NumType sign)
+    {
+        for(const auto& t : b)
+        {
+            auto it = a.find(t.first);
+            if(it == a.end())
+                a.emplace(t.first, sign * t.second);
+            else
+                it->second += sign * t.second;
+        }
+    }
+
+    template <typename NumType>
+    terms<NumType> multiply(const terms<NumType>& a, const terms<NumType>& b)
+    {
+        terms<NumType> r;
+        for(const auto& x : a)
+        {
+            for(const auto& y : b)
+            {
+                auto m = multiply(x.first, y.first);
+                auto it = r.find(m);
+                if(it == r.end())
+                    r.emplace(std::move(m), x.second * y.second);
+                else
+                    it->second += x.second * y.second;
+            }
+        }
+        return r;
+    }
+
+    // Only rewrite where some variable is raised past the first power;
+    // linear forms gain nothing from becoming a polynomial node
+    template <typename NumType>
+    bool worthwhile(const terms<NumType>& p)
+    {
+        for(const auto& t : p)
+        {
+            for(const auto& v : t.first)
+            {
+                if(v.second >= 2)
+                    return true;
+            }
+        }
+        return false;
+    }
+
+    // Nests the polynomial by its highest-degree variable first; the
+    // coefficients of that variable become polynomials in the rest
+    template <typename NumType>
+    t_expression<NumType> build(const terms<NumType>& p)
+    {
+        const std::string* var = nullptr;
+        unsigned int degree = 0;
+        for(const auto& t : p)
+        {
+            for(const auto& v : t.first)
+            {
+                if(v.second > degree || (v.second == degree && var && v.first < *var))
+                {
+                    var = &v.first;
+                    degree = v.second;
+                }
+            }
+        }
+
+        if(!var)
+            return p.empty() ? NumType(0) : p.begin()->second;
+
+        std::vector<terms<NumType>> groups(degree + 1);
+        for(const auto& t : p)
+        {
+            monomial rest;
+            unsigned int k = 0;
+            for(const auto& v : t.first)
+            {
+                if(v.first == *var)
+                    k = v.second;
+                else
+                    rest.push_back(v);
+            }
+            groups[k].emplace(std::move(rest), t.second);
+        }
+
+        std::vector<t_expression<NumType>> coeffs;
+        coeffs.reserve(groups.size());
+        for(const auto& g : groups)
+            coeffs.push_back(build(g));
+
+        return t_polynomial<NumType>(*var, std::move(coeffs));
+    }
+
+    // Works bottom-up: each call reports whether its subtree is a polynomial
+    // and, if so, its terms. A node that is not one rewrites those of its
+    // children that are, so every maximal polynomial subtree is converted
+    // in a single walk.
+    template <typename NumType>
+    struct recognizer : public boost::static_visitor<bool>
+    {
+        terms<NumType>& out;
+        const polynomial_limits& limits;
+
+        recognizer(terms<NumType>& _out, const polynomial_limits& _limits): out(_out), limits(_limits) {}
+
+        bool recognize(t_expression<NumType>& t, terms<NumType>& p) const
+        {
+            recognizer r(p, limits);
+            return boost::apply_visitor(r, t);
+        }
+
+        void commit(t_expression<NumType>& t, const terms<NumType>& p) const
+        {
+            if(worthwhile(p))
+                t = build(p);
+        }
+
+        void rewrite(t_expression<NumType>& t) const
+        {
+            terms<NumType> p;
+            if(recognize(t, p))
+                commit(t, p);
+        }
+
+        bool operator()(NumType& n) const
+        {
+            out.emplace(monomial(), n);
+            return true;
+        }
+        bool operator()(t_var_occurrance<NumType>& t) const
+        {
+            out.emplace(monomial{std::make_pair(t.name, 1u)}, NumType(1));
+            return true;
+        }
+        bool operator()(t_negate<NumType>& t) const
+        {
+            if(!recognize(t.op, out))
+                return false;
+            for(auto& i : out)
+                i.second = -i.second;
+            return true;
+        }
+        // The next link of a left-nested chain of + and - (product false)
+        // or of * (product true), with the sign its right operand takes
+        static t_binary_op<NumType>* chain_link(t_expression<NumType>& t, bool product, NumType& sign)
+        {
+            sign = NumType(1);
+            if(product)
+                return boost::get<t_multiply<NumType>>(&t);
+            if(auto a = boost::get<t_add<NumType>>(&t))
+                return a;
+            sign = NumType(-1);
+            return boost::get<t_subtract<NumType>>(&t);
+        }
+
+        // Chains are walked in a loop rather than recursively, as the parser
+        // builds long sums and products as deep left spines. Each link is
+        // then combined bottom-up: while the chain so far and the link's
+        // right operand are both polynomials within the limits, they merge;
+        // at the first link where they do not, each is committed on its own.
+        bool chain(t_binary_op<NumType>& top, NumType top_sign, bool product) const
+        {
+            std::vector<std::pair<t_binary_op<NumType>*, NumType>> links(1, std::make_pair(&top, top_sign));
+            t_expression<NumType>* t = &top.ops[0];
+            NumType sign;
+            while(auto link = chain_link(*t, product, sign))
+            {
+                links.emplace_back(link, sign);
+                t = &link->ops[0];
+            }
+
+            terms<NumType> a;
+            bool pa = recognize(*t, a);
+            for(std::size_t i = links.size(); i-- > 0;)
+            {
+                auto& link = *links[i].first;
+                terms<NumType> b;
+                bool pb = recognize(link.ops[1], b);
+
+                terms<NumType> r;
+                bool ok = pa && pb && (!product || a.size() * b.size() <= limits.max_terms);
+                if(ok && product)
+                    r = multiply(a, b);
+                else if(ok)
+                {
+                    r = a;
+                    add(r, b, links[i].second);
+                }
+
+                if(ok && within(r, limits))
+                {
+                    a = std::move(r);
+                    continue;
+                }
+
+                if(pa)
+                    commit(link.ops[0], a);
+                if(pb)
+                    commit(link.ops[1], b);
+                pa = false;
+                a.clear();
+            }
+
+            if(pa)
+                out = std::move(a);
+            return pa;
+        }
+        bool operator()(t_add<NumType>& t) const
+        {
+            return chain(t, NumType(1), false);
+        }
+        bool operator()(t_subtract<NumType>& t) const
+        {
+            return chain(t, NumType(-1), false);
+        }
+        bool operator()(t_multiply<NumType>& t) const
+        {
+            return chain(t, NumType(1), true);
+        }
+        bool operator()(t_exponentiate<NumType>& t) const
+        {
+            using std::floor;
+
+            terms<NumType> a;
+            bool pa = recognize(t.ops[0], a);
+            const NumType* n = boost::get<NumType>(&t.ops[1]);
+
+            if(pa && n && *n >= 0 && *n <= limits.max_degree && floor(*n) == *n)
+            {
+                terms<NumType> r;
+                r.emplace(monomial(), NumType(1));
+                for(auto k = static_cast<unsigned int>(*n); k > 0 && within(r, limits); --k)
+                    r = multiply(r, a);
+                if(within(r, limits))
+                {
+                    out = std::move(r);
+                    return true;
+                }
+            }
+
+            if(pa)
+                commit(t.ops[0], a);
+            rewrite(t.ops[1]);
+            return false;
+        }
+        bool operator()(t_divide<NumType>& t) const
+        {
+            rewrite(t.ops[0]);
+            rewrite(t.ops[1]);
+            return false;
+        }
+        bool operator()(t_func_invocation<NumType>& t) const
+        {
+            for(auto& i : t.args)
+                rewrite(i);
+            return false;
+        }
+        bool nary(t_nary_op<NumType>& t, bool product) const
+        {
+            std::vector<terms<NumType>> p(t.ops.size());
+            std::vector<bool> poly(t.ops.size());
+            bool ok = true;
+            for(std::size_t i = 0; i < t.ops.size(); ++i)
+            {
+                poly[i] = recognize(t.ops[i], p[i]);
+                ok = ok && poly[i];
+            }
+
+            if(ok)
+            {
+                out = p[0];
+                for(std::size_t i = 1; ok && i < p.size(); ++i)
+                {
+                    if(!product)
+                        add(out, p[i], NumType(1));
+                    else if(out.size() * p[i].size() <= limits.max_terms)
+                        out = multiply(out, p[i]);
+                    else
+                        ok = false;
+                    ok = ok && within(out, limits);
+                }
+            }
+            if(ok)
+                return true;
+
+            for(std::size_t i = 0; i < t.ops.size(); ++i)
+                if(poly[i])
+                    commit(t.ops[i], p[i]);
+            return false;
+        }
+        bool operator()(t_sum<NumType>& t) const
+        {
+            return nary(t, false);
+        }
+        bool operator()(t_product<NumType>& t) const
+        {
+            return nary(t, true);
+        }
+        template <typename Arg>
+        bool operator()(Arg& arg) const
+        {
+            return false;
+        }
+    };
+}
+
+// Rewrites each maximal polynomial subtree into nested t_polynomial nodes.
+// Collecting like terms can round differently from the original tree.
+template <typename NumType>
+void convert_polynomials(t_expression<NumType>& t, const polynomial_limits& limits = polynomial_limits())
+{
+    polynomial_detail::terms<NumType> p;
+    polynomial_detail::recognizer<NumType> r(p, limits);
+    r.rewrite(t);
+}
+
+template <typename NumType>
+struct tree_polynomial : tree_transform<tree_polynomial<NumType>, NumType, void>
+{
+    typedef tree_transform<tree_polynomial<NumType>, NumType, void> parent;
+
+    template <typename Arg>
+    void operator()(Arg& arg)
+    {
+        convert_polynomials(parent::node);
+    }
+};
+
+#endif // POLYNOMIAL_H_INCLUDED
@@ -0,0 +1,931 @@
+#ifndef REWRITE_H_INCLUDED
+#define REWRITE_H_INCLUDED
+
+#include <array>
+#include <functional>
+#include <limits>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstring>
+#include <utility>
+
+#include <boost/optional.hpp>
+#include <boost/variant.hpp>
+
+#include "calculator.h"
+#include "tree.h"
+#include "tree_transform.h"
+
+// Equality saturation: the expression is loaded into an e-graph, a set of
+// equivalence classes of expressions, and rewrite rules only ever add
+// equivalences, never discard forms. Once the rules stop producing anything
+// new, or the budget runs out, the cheapest member of the root class is
+// extracted under a per-node cost model.
+//
+// The rules reassociate and factor floating point arithmetic, so the result
+// is equal to the input in real arithmetic but may round differently.
+
+enum class enode_op
+{
+    Constant,
+    Variable,
+    Opaque,
+    Negate,
+    Add,
+    Subtract,
+    Multiply,
+    Divide,
+    Exponentiate,
+    Count
+};
+
+template <typename NumType>
+struct enode
+{
+    enode_op op;
+    NumType value;
+    std::size_t symbol;
+    std::size_t children[2];
+
+    enode(enode_op _op, NumType _value = NumType(), std::size_t _symbol = 0): op(_op), value(_value), symbol(_symbol), children{0, 0} {}
+    enode(enode_op _op, std::size_t lhs, std::size_t rhs = 0): op(_op), value(), symbol(0), children{lhs, rhs} {}
+
+    unsigned int arity() const
+    {
+        switch(op)
+        {
+        case enode_op::Constant:
+        case enode_op::Variable:
+        case enode_op::Opaque:
+            return 0;
+        case enode_op::Negate:
+            return 1;
+        default:
+            return 2;
+        }
+    }
+
+    bool operator==(const enode& o) const
+    {
+        return op == o.op && symbol == o.symbol && children[0] == o.children[0] && children[1] == o.children[1] &&
+               std::memcmp(&value, &o.value, sizeof(value)) == 0;
+    }
+};
+
+template <typename NumType>
+struct enode_hash
+{
+    std::size_t operator()(const enode<NumType>& n) const
+    {
+        std::size_t h = static_cast<std::size_t>(n.op);
+        h = h * 1000003 ^ std::hash<NumType>()(n.value);
+        h = h * 1000003 ^ n.symbol;
+        h = h * 1000003 ^ n.children[0];
+        h = h * 1000003 ^ n.children[1];
+        return h;
+    }
+};
+
+template <typename NumType>
+class egraph
+{
+public:
+
+    typedef std::size_t class_id;
+
+private:
+
+    std::vector<class_id> parent;
+    std::vector<std::vector<std::size_t>> members;
+    std::vector<boost::optional<NumType>> constant;
+
+    std::vector<enode<NumType>> nodes;
+    std::vector<class_id> node_class;
+    std::vector<bool> alive;
+    std::size_t alive_count;
+
+    std::unordered_map<enode<NumType>, class_id, enode_hash<NumType>> hashcons;
+
+    std::vector<std::string> variables;
+    std::unordered_map<std::string, std::size_t> variable_index;
+    std::vector<t_expression<NumType>> opaque;
+
+    static boost::optional<NumType> fold(const enode<NumType>& n, const std::vector<boost::optional<NumType>>& c)
+    {
+        using std::pow;
+
+        if(n.op == enode_op::Constant)
+            return n.value;
+        if(n.arity() == 0)
+            return boost::optional<NumType>();
+
+        const auto& lhs = c[n.children[0]];
+        if(!lhs)
+            return boost::optional<NumType>();
+        if(n.op == enode_op::Negate)
+            return -*lhs;
+
+        const auto& rhs = c[n.children[1]];
+        if(!rhs)
+            return boost::optional<NumType>();
+
+        switch(n.op)
+        {
+        case enode_op::Add:
+            return *lhs + *rhs;
+        case enode_op::Subtract:
+            return *lhs - *rhs;
+        case enode_op::Multiply:
+            return *lhs * *rhs;
+        case enode_op::Divide:
+            return *lhs / *rhs;
+        default:
+            return pow(*lhs, *rhs);
+        }
+    }
+
+    enode<NumType> canonical(enode<NumType> n)
+    {
+        for(unsigned int i = 0; i < n.arity(); ++i)
+            n.children[i] = find(n.children[i]);
+        return n;
+    }
+
+    std::size_t push_node(const enode<NumType>& n, class_id c)
+    {
+        nodes.push_back(n);
+        node_class.push_back(c);
+        alive.push_back(true);
+        members[c].push_back(nodes.size() - 1);
+        ++alive_count;
+        return nodes.size() - 1;
+    }
+
+    // Records a known value for the class; the constant node makes the value
+    // itself available to extraction
+    void set_constant(class_id c, NumType value)
+    {
+        if(constant[c])
+            return;
+        constant[c] = value;
+        enode<NumType> k(enode_op::Constant, value);
+        if(!hashcons.count(k))
+            hashcons.emplace(k, c);
+        push_node(k, c);
+    }
+
+public:
+
+    egraph(): alive_count(0) {}
+
+    class_id find(class_id c) const
+    {
+        while(parent[c] != c)
+            c = parent[c];
+        return c;
+    }
+
+    class_id find(class_id c)
+    {
+        while(parent[c] != c)
+        {
+            parent[c] = parent[parent[c]];
+            c = parent[c];
+        }
+        return c;
+    }
+
+    std::size_t node_count() const
+    {
+        return alive_count;
+    }
+
+    const boost::optional<NumType>& constant_value(class_id c) const
+    {
+        return constant[find(c)];
+    }
+
+    const std::vector<std::size_t>& class_members(class_id c) const
+    {
+        return members[find(c)];
+    }
+
+    const enode<NumType>& node(std::size_t i) const
+    {
+        return nodes[i];
+    }
+
+    std::size_t node_total() const
+    {
+        return nodes.size();
+    }
+
+    bool node_alive(std::size_t i) const
+    {
+        return alive[i];
+    }
+
+    class_id node_owner(std::size_t i) const
+    {
+        return find(node_class[i]);
+    }
+
+    std::vector<class_id> classes() const
+    {
+        std::vector<class_id> result;
+        for(class_id c = 0; c < parent.size(); ++c)
+        {
+            if(parent[c] == c)
+                result.push_back(c);
+        }
+        return result;
+    }
+
+    class_id add(enode<NumType> n)
+    {
+        n = canonical(n);
+
+        auto it = hashcons.find(n);
+        if(it != hashcons.end())
+            return find(it->second);
+
+        class_id c = parent.size();
+        parent.push_back(c);
+        members.emplace_back();
+        constant.emplace_back();
+
+        hashcons.emplace(n, c);
+        push_node(n, c);
+
+        auto value = fold(n, constant);
+        if(value)
+        {
+            if(n.op == enode_op::Constant)
+                constant[c] = value;
+            else
+                set_constant(c, *value);
+        }
+
+        return c;
+    }
+
+    class_id add_variable(const std::string& name)
+    {
+        auto it = variable_index.emplace(name, variables.size());
+        if(it.second)
+            variables.push_back(name);
+        return add(enode<NumType>(enode_op::Variable, NumType(), it.first->second));
+    }
+
+    class_id add_opaque(const t_expression<NumType>& t)
+    {
+        opaque.push_back(t);
+        return add(enode<NumType>(enode_op::Opaque, NumType(), opaque.size() - 1));
+    }
+
+    const std::string& variable_name(std::size_t symbol) const
+    {
+        return variables[symbol];
+    }
+
+    const t_expression<NumType>& opaque_expression(std::size_t symbol) const
+    {
+        return opaque[symbol];
+    }
+
+    // Returns false if the classes were already the same. Classes that
+    // disagree about their constant (possible once reassociation changes
+    // rounding) keep the value of the larger class.
+    bool merge(class_id a, class_id b)
+    {
+        a = find(a);
+        b = find(b);
+        if(a == b)
+            return false;
+
+        if(members[a].size() < members[b].size())
+            std::swap(a, b);
+
+        parent[b] = a;
+        members[a].insert(members[a].end(), members[b].begin(), members[b].end());
+        members[b].clear();
+        members[b].shrink_to_fit();
+
+        if(!constant[a] && constant[b])
+            constant[a] = constant[b];
+
+        return true;
+    }
+
+    // Restores the congruence invariant after merges: nodes whose children
+    // have become equivalent are merged themselves, repeatedly, and
+    // constants are propagated to any class whose operands became known
+    void rebuild()
+    {
+        bool changed = true;
+        while(changed)
+        {
+            changed = false;
+            hashcons.clear();
+
+            for(std::size_t i = 0; i < nodes.size(); ++i)
+            {
+                if(!alive[i])
+                    continue;
+
+                nodes[i] = canonical(nodes[i]);
+                class_id c = find(node_class[i]);
+
+                auto it = hashcons.find(nodes[i]);
+                if(it == hashcons.end())
+                    hashcons.emplace(nodes[i], c);
+                else if(find(it->second) != c)
+                    changed |= merge(it->second, c);
+                else
+                {
+                    alive[i] = false;
+                    --alive_count;
+                }
+            }
+
+            for(std::size_t i = 0, n = nodes.size(); i < n; ++i)
+            {
+                class_id c = find(node_class[i]);
+                if(!alive[i] || constant[c])
+                    continue;
+
+                auto value = fold(nodes[i], constant);
+                if(value)
+                {
+                    set_constant(c, *value);
+                    changed = true;
+                }
+            }
+        }
+
+        for(auto& m : members)
+            m.clear();
+        for(std::size_t i = 0; i < nodes.size(); ++i)
+        {
+            if(alive[i])
+                members[find(node_class[i])].push_back(i);
+        }
+    }
+};
+
+// Patterns are expression shapes over numbered holes; a hole matches any
+// class, and repeated uses of one hole must match the same class
+template <typename NumType>
+struct rewrite_pattern
+{
+    enode_op op;
+    int hole;
+    NumType value;
+    std::vector<rewrite_pattern> children;
+
+    rewrite_pattern(int _hole): op(enode_op::Count), hole(_hole), value() {}
+    rewrite_pattern(enode_op _op, NumType _value): op(_op), hole(-1), value(_value) {}
+    rewrite_pattern(enode_op _op, std::vector<rewrite_pattern> _children): op(_op), hole(-1), value(), children(std::move(_children)) {}
+};
+
+template <typename NumType>
+struct rewrite_rule
+{
+    static const int max_holes = 4;
+    typedef std::array<std::size_t, max_holes> substitution;
+    typedef std::function<bool(const egraph<NumType>&, const substitution&)> condition_type;
+
+    std::string name;
+    rewrite_pattern<NumType> lhs, rhs;
+    condition_type condition;
+
+    rewrite_rule(std::string _name, rewrite_pattern<NumType> _lhs, rewrite_pattern<NumType> _rhs, condition_type _condition = condition_type()):
+        name(std::move(_name)), lhs(std::move(_lhs)), rhs(std::move(_rhs)), condition(std::move(_condition)) {}
+};
+
+namespace rewrite_detail
+{
+    template <typename NumType>
+    rewrite_pattern<NumType> hole(int i)
+    {
+        return rewrite_pattern<NumType>(i);
+    }
+
+    template <typename NumType>
+    rewrite_pattern<NumType> constant(NumType n)
+    {
+        return rewrite_pattern<NumType>(enode_op::Constant, n);
+    }
+
+    template <typename NumType>
+    rewrite_pattern<NumType> op(enode_op o, rewrite_pattern<NumType> a)
+    {
+        return rewrite_pattern<NumType>(o, std::vector<rewrite_pattern<NumType>>{std::move(a)});
+    }
+
+    template <typename NumType>
+    rewrite_pattern<NumType> op(enode_op o, rewrite_pattern<NumType> a, rewrite_pattern<NumType> b)
+    {
+        return rewrite_pattern<NumType>(o, std::vector<rewrite_pattern<NumType>>{std::move(a), std::move(b)});
+    }
+
+    template <typename NumType>
+    typename rewrite_rule<NumType>::condition_type integer_holes(int a, int b)
+    {
+        return [a, b](const egraph<NumType>& g, const typename rewrite_rule<NumType>::substitution& s)
+        {
+            using std::floor;
+            const auto& x = g.constant_value(s[a]);
+            const auto& y = g.constant_value(s[b]);
+            return x && y && floor(*x) == *x && floor(*y) == *y;
+        };
+    }
+}
+
+// Commutativity, associativity and distributivity of + and *, plus the
+// identities needed to turn repeated products into powers and back
+template <typename NumType>
+std::vector<rewrite_rule<NumType>> default_rewrite_rules()
+{
+    using namespace rewrite_detail;
+
+    auto a = hole<NumType>(0), b = hole<NumType>(1), c = hole<NumType>(2);
+    auto add = [](rewrite_pattern<NumType> x, rewrite_pattern<NumType> y) { return op(enode_op::Add, x, y); };
+    auto sub = [](rewrite_pattern<NumType> x, rewrite_pattern<NumType> y) { return op(enode_op::Subtract, x, y); };
+    auto mul = [](rewrite_pattern<NumType> x, rewrite_pattern<NumType> y) { return op(enode_op::Multiply, x, y); };
+    auto pow = [](rewrite_pattern<NumType> x, rewrite_pattern<NumType> y) { return op(enode_op::Exponentiate, x, y); };
+    auto neg = [](rewrite_pattern<NumType> x) { return op(enode_op::Negate, x); };
+
+    return std::vector<rewrite_rule<NumType>>
+    {
+        rewrite_rule<NumType>("add-commute", add(a, b), add(b, a)),
+        rewrite_rule<NumType>("mul-commute", mul(a, b), mul(b, a)),
+        rewrite_rule<NumType>("add-assoc", add(add(a, b), c), add(a, add(b, c))),
+        rewrite_rule<NumType>("add-assoc-rev", add(a, add(b, c)), add(add(a, b), c)),
+        rewrite_rule<NumType>("mul-assoc", mul(mul(a, b), c), mul(a, mul(b, c))),
+        rewrite_rule<NumType>("mul-assoc-rev", mul(a, mul(b, c)), mul(mul(a, b), c)),
+        rewrite_rule<NumType>("distribute", mul(a, add(b, c)), add(mul(a, b), mul(a, c))),
+        rewrite_rule<NumType>("factor", add(mul(a, b), mul(a, c)), mul(a, add(b, c))),
+        rewrite_rule<NumType>("factor-sub", sub(mul(a, b), mul(a, c)), mul(a, sub(b, c))),
+        rewrite_rule<NumType>("sub-neg", sub(a, neg(b)), add(a, b)),
+        rewrite_rule<NumType>("neg-neg", neg(neg(a)), a),
+        rewrite_rule<NumType>("add-zero", add(a, constant<NumType>(0)), a),
+        rewrite_rule<NumType>("mul-one", mul(a, constant<NumType>(1)), a),
+        rewrite_rule<NumType>("double", add(a, a), mul(constant<NumType>(2), a)),
+        rewrite_rule<NumType>("square", mul(a, a), pow(a, constant<NumType>(2))),
+        rewrite_rule<NumType>("pow-one", pow(a, constant<NumType>(1)), a),
+        rewrite_rule<NumType>("pow-zero", pow(a, constant<NumType>(0)), constant<NumType>(1)),
+        rewrite_rule<NumType>("pow-two", pow(a, constant<NumType>(2)), mul(a, a)),
+        rewrite_rule<NumType>("pow-mul", mul(pow(a, b), pow(a, c)), pow(a, add(b, c)), integer_holes<NumType>(1, 2)),
+        rewrite_rule<NumType>("pow-mul-base", mul(pow(a, b), a), pow(a, add(b, constant<NumType>(1))), integer_holes<NumType>(1, 1)),
+        rewrite_rule<NumType>("pow-split", pow(a, b), mul(pow(a, sub(b, constant<NumType>(1))), a),
+                              [](const egraph<NumType>& g, const typename rewrite_rule<NumType>::substitution& s)
+                              {
+                                  using std::floor;
+                                  const auto& n = g.constant_value(s[1]);
+                                  return n && floor(*n) == *n && *n > 2 && *n <= 16;
+                              })
+    };
+}
+
+// Relative evaluation cost of each node kind; extraction minimizes the sum
+// over the extracted tree. The defaults here are rough guesses; saturation
+// uses measured_rewrite_costs() unless given a model.
+struct rewrite_cost_model
+{
+    double cost[static_cast<std::size_t>(enode_op::Count)];
+
+    rewrite_cost_model()
+    {
+        cost[static_cast<std::size_t>(enode_op::Constant)] = 0.1;
+        cost[static_cast<std::size_t>(enode_op::Variable)] = 2;
+        cost[static_cast<std::size_t>(enode_op::Opaque)] = 10;
+        cost[static_cast<std::size_t>(enode_op::Negate)] = 1;
+        cost[static_cast<std::size_t>(enode_op::Add)] = 1;
+        cost[static_cast<std::size_t>(enode_op::Subtract)] = 1;
+        cost[static_cast<std::size_t>(enode_op::Multiply)] = 1;
+        cost[static_cast<std::size_t>(enode_op::Divide)] = 4;
+        cost[static_cast<std::size_t>(enode_op::Exponentiate)] = 20;
+    }
+
+    double operator[](enode_op op) const
+    {
+        return cost[static_cast<std::size_t>(op)];
+    }
+};
+
+// Times eval_expression_tree over chains of each node kind and returns the
+// per-node cost in nanoseconds. Each timing is the best of a few trials, so
+// a preempted trial does not skew the model.
+inline rewrite_cost_model measure_rewrite_costs(std::size_t chain_length = 100, unsigned int repetitions = 200, unsigned int trials = 5)
+{
+    typedef std::chrono::steady_clock clock;
+
+    calculator_state<double> c;
+    c.variable_set["x"] = 1.0000001;
+
+    const double leaf = 1.0000001;
+
+    auto time = [&](const t_expression<double>& t) -> double
+    {
+        volatile double sink = 0;
+        double best = std::numeric_limits<double>::infinity();
+        for(unsigned int k = 0; k < trials; ++k)
+        {
+            auto start = clock::now();
+            for(unsigned int i = 0; i < repetitions; ++i)
+                sink = sink + eval_expression_tree(c, t);
+            best = std::min(best, std::chrono::duration<double, std::nano>(clock::now() - start).count());
+        }
+        return best / (double(repetitions) * chain_length);
+    };
+
+    auto chain = [&](enode_op op, const t_expression<double>& l) -> t_expression<double>
+    {
+        t_expression<double> t = l;
+        for(std::size_t i = 0; i < chain_length; ++i)
+        {
+            switch(op)
+            {
+            case enode_op::Negate:
+                t = t_negate<double>(t);
+                break;
+            case enode_op::Add:
+                t = t_add<double>(l, t);
+                break;
+            case enode_op::Subtract:
+                t = t_subtract<double>(l, t);
+                break;
+            case enode_op::Multiply:
+                t = t_multiply<double>(l, t);
+                break;
+            case enode_op::Divide:
+                t = t_divide<double>(l, t);
+                break;
+            default:
+                t = t_exponentiate<double>(l, t);
+                break;
+            }
+        }
+        return t;
+    };
+
+    rewrite_cost_model m;
+    time(chain(enode_op::Add, leaf));
+
+    const enode_op measured[] = {enode_op::Negate, enode_op::Add, enode_op::Subtract, enode_op::Multiply, enode_op::Divide, enode_op::Exponentiate};
+    for(auto op : measured)
+        m.cost[static_cast<std::size_t>(op)] = time(chain(op, leaf));
+
+    double variable = time(chain(enode_op::Add, t_var_occurrance<double>("x"))) - m[enode_op::Add];
+    m.cost[static_cast<std::size_t>(enode_op::Variable)] = variable > 0 ? variable : m[enode_op::Add];
+    m.cost[static_cast<std::size_t>(enode_op::Constant)] = m[enode_op::Add] / 10;
+    m.cost[static_cast<std::size_t>(enode_op::Opaque)] = 10 * m[enode_op::Add];
+
+    return m;
+}
+
+// The cost model measured on this machine the first time it is asked for
+inline const rewrite_cost_model& measured_rewrite_costs()
+{
+    static const rewrite_cost_model costs = measure_rewrite_costs();
+    return costs;
+}
+
+// Every limit is checked while rules are being matched and applied, not
+// only between iterations, so one iteration over a large graph cannot run
+// past them. max_matches caps the matches collected per iteration.
+struct rewrite_budget
+{
+    std::size_t max_nodes, max_matches;
+    unsigned int max_iterations;
+    std::chrono::microseconds max_time;
+
+    rewrite_budget(): max_nodes(20000), max_matches(50000), max_iterations(30), max_time(std::chrono::milliseconds(50)) {}
+};
+
+template <typename NumType>
+class rewrite_engine
+{
+    typedef typename egraph<NumType>::class_id class_id;
+    typedef typename rewrite_rule<NumType>::substitution substitution;
+
+    egraph<NumType> graph;
+
+    static const std::size_t unbound = std::numeric_limits<std::size_t>::max();
+
+    struct loader : public boost::static_visitor<class_id>
+    {
+        egraph<NumType>& g;
+
+        loader(egraph<NumType>& _g): g(_g) {}
+
+        class_id binary(enode_op op, const t_binary_op<NumType>& t)
+        {
+            class_id lhs = boost::apply_visitor(*this, t.ops[0]);
+            class_id rhs = boost::apply_visitor(*this, t.ops[1]);
+            return g.add(enode<NumType>(op, lhs, rhs));
+        }
+
+        class_id operator()(const NumType& n)
+        {
+            return g.add(enode<NumType>(enode_op::Constant, n));
+        }
+        class_id operator()(const t_var_occurrance<NumType>& t)
+        {
+            return g.add_variable(t.name);
+        }
+        class_id operator()(const t_negate<NumType>& t)
+        {
+            return g.add(enode<NumType>(enode_op::Negate, boost::apply_visitor(*this, t.op)));
+        }
+        class_id operator()(const t_add<NumType>& t)
+        {
+            return binary(enode_op::Add, t);
+        }
+        class_id operator()(const t_subtract<NumType>& t)
+        {
+            return binary(enode_op::Subtract, t);
+        }
+        class_id operator()(const t_multiply<NumType>& t)
+        {
+            return binary(enode_op::Multiply, t);
+        }
+        class_id operator()(const t_divide<NumType>& t)
+        {
+            return binary(enode_op::Divide, t);
+        }
+        class_id operator()(const t_exponentiate<NumType>& t)
+        {
+            return binary(enode_op::Exponentiate, t);
+        }
+        // Loaded as binary nodes in the association they are evaluated in
+        class_id nary(enode_op op, const t_nary_op<NumType>& t)
+        {
+            return reduce_operands<class_id>(t.ops.size(), [&](std::size_t i) { return boost::apply_visitor(*this, t.ops[i]); },
+                                             [&](class_id lhs, class_id rhs) { return g.add(enode<NumType>(op, lhs, rhs)); });
+        }
+        class_id operator()(const t_sum<NumType>& t)
+        {
+            return nary(enode_op::Add, t);
+        }
+        class_id operator()(const t_product<NumType>& t)
+        {
+            return nary(enode_op::Multiply, t);
+        }
+        template <typename Arg>
+        class_id operator()(const Arg& arg)
+        {
+            return g.add_opaque(t_expression<NumType>(arg));
+        }
+    };
+
+    // Stops once out holds limit substitutions
+    void match(const rewrite_pattern<NumType>& p, class_id c, const substitution& s, std::vector<substitution>& out, std::size_t limit) const
+    {
+        if(out.size() >= limit)
+            return;
+        c = graph.find(c);
+
+        if(p.hole >= 0)
+        {
+            if(s[p.hole] == unbound)
+            {
+                substitution bound = s;
+                bound[p.hole] = c;
+                out.push_back(bound);
+            }
+            else if(graph.find(s[p.hole]) == c)
+                out.push_back(s);
+            return;
+        }
+
+        if(p.op == enode_op::Constant)
+        {
+            const auto& value = graph.constant_value(c);
+            if(value && *value == p.value)
+                out.push_back(s);
+            return;
+        }
+
+        std::vector<substitution> partial, next;
+        for(std::size_t i : graph.class_members(c))
+        {
+            const auto& n = graph.node(i);
+            if(n.op != p.op)
+                continue;
+
+            partial.assign(1, s);
+            for(std::size_t k = 0; k < p.children.size() && !partial.empty(); ++k)
+            {
+                next.clear();
+                for(const auto& q : partial)
+                    match(p.children[k], n.children[k], q, next, limit);
+                partial.swap(next);
+            }
+
+            std::size_t room = limit - out.size();
+            out.insert(out.end(), partial.begin(), partial.begin() + std::min(room, partial.size()));
+            if(out.size() >= limit)
+                return;
+        }
+    }
+
+    class_id instantiate(const rewrite_pattern<NumType>& p, const substitution& s)
+    {
+        if(p.hole >= 0)
+            return s[p.hole];
+        if(p.op == enode_op::Constant)
+            return graph.add(enode<NumType>(enode_op::Constant, p.value));
+        if(p.children.size() == 1)
+            return graph.add(enode<NumType>(p.op, instantiate(p.children[0], s)));
+        class_id lhs = instantiate(p.children[0], s);
+        class_id rhs = instantiate(p.children[1], s);
+        return graph.add(enode<NumType>(p.op, lhs, rhs));
+    }
+
+    t_expression<NumType> build(class_id c, const std::vector<std::size_t>& best) const
+    {
+        const auto& n = graph.node(best[graph.find(c)]);
+        switch(n.op)
+        {
+        case enode_op::Constant:
+            return n.value;
+        case enode_op::Variable:
+            return t_var_occurrance<NumType>(graph.variable_name(n.symbol));
+        case enode_op::Opaque:
+            return graph.opaque_expression(n.symbol);
+        case enode_op::Negate:
+            return t_negate<NumType>(build(n.children[0], best));
+        case enode_op::Add:
+            return t_add<NumType>(build(n.children[0], best), build(n.children[1], best));
+        case enode_op::Subtract:
+            return t_subtract<NumType>(build(n.children[0], best), build(n.children[1], best));
+        case enode_op::Multiply:
+            return t_multiply<NumType>(build(n.children[0], best), build(n.children[1], best));
+        case enode_op::Divide:
+            return t_divide<NumType>(build(n.children[0], best), build(n.children[1], best));
+        default:
+            return t_exponentiate<NumType>(build(n.children[0], best), build(n.children[1], best));
+        }
+    }
+
+public:
+
+    class_id load(const t_expression<NumType>& t)
+    {
+        loader l(graph);
+        return boost::apply_visitor(l, t);
+    }
+
+    const egraph<NumType>& graph_state() const
+    {
+        return graph;
+    }
+
+    // Applies the rules until nothing changes or the budget is exhausted.
+    // Returns the number of iterations run.
+    unsigned int saturate(const std::vector<rewrite_rule<NumType>>& rules, const rewrite_budget& budget)
+    {
+        auto deadline = std::chrono::steady_clock::now() + budget.max_time;
+        auto exhausted = [&]
+        {
+            return graph.node_count() > budget.max_nodes || std::chrono::steady_clock::now() > deadline;
+        };
+
+        struct pending
+        {
+            const rewrite_rule<NumType>* rule;
+            class_id c;
+            substitution s;
+        };
+
+        unsigned int iteration = 0;
+        std::size_t resume = 0;
+        std::vector<pending> matches;
+        std::vector<substitution> found;
+
+        substitution empty;
+        empty.fill(unbound);
+
+        while(iteration < budget.max_iterations)
+        {
+            ++iteration;
+
+            // Nothing has been merged yet, so running out here leaves the
+            // graph as the last iteration did. When the matches fill up,
+            // the next iteration carries on from the class after the last.
+            matches.clear();
+            auto classes = graph.classes();
+            bool truncated = false;
+            for(std::size_t i = 0; i < classes.size() && !truncated; ++i)
+            {
+                if(exhausted())
+                    return iteration;
+
+                class_id c = classes[(resume + i) % classes.size()];
+                for(const auto& r : rules)
+                {
+                    found.clear();
+                    match(r.lhs, c, empty, found, budget.max_matches - matches.size());
+                    for(const auto& s : found)
+                    {
+                        if(!r.condition || r.condition(graph, s))
+                            matches.push_back(pending{&r, c, s});
+                    }
+                }
+
+                if(matches.size() >= budget.max_matches)
+                {
+                    truncated = true;
+                    resume += i + 1;
+                }
+            }
+
+            bool changed = false, stopped = false;
+            for(std::size_t i = 0; i < matches.size(); ++i)
+            {
+                if(i % 64 == 0 && exhausted())
+                {
+                    stopped = true;
+                    break;
+                }
+                changed |= graph.merge(matches[i].c, instantiate(matches[i].rule->rhs, matches[i].s));
+            }
+            graph.rebuild();
+
+            if((!changed && !truncated) || stopped || exhausted())
+                break;
+        }
+
+        return iteration;
+    }
+
+    t_expression<NumType> extract(class_id root, const rewrite_cost_model& costs) const
+    {
+        const double infinity = std::numeric_limits<double>::infinity();
+
+        // Class ids never exceed the number of nodes, so both are indexed by class
+        std::vector<double> cost(graph.node_total(), infinity);
+        std::vector<std::size_t> best(graph.node_total(), 0);
+
+        bool changed = true;
+        while(changed)
+        {
+            changed = false;
+            for(std::size_t i = 0; i < graph.node_total(); ++i)
+            {
+                if(!graph.node_alive(i))
+                    continue;
+
+                const auto& n = graph.node(i);
+                double total = costs[n.op];
+                for(unsigned int k = 0; k < n.arity(); ++k)
+                    total += cost[graph.find(n.children[k])];
+
+                class_id c = graph.node_owner(i);
+                if(total < cost[c])
+                {
+                    cost[c] = total;
+                    best[c] = i;
+                    changed = true;
+                }
+            }
+        }
+
+        return build(root, best);
+    }
+};
+
+template <typename NumType>
+const std::size_t rewrite_engine<NumType>::unbound;
+
+template <typename NumType>
+void saturate_expression(t_expression<NumType>& t, const rewrite_budget& budget = rewrite_budget(), const rewrite_cost_model& costs = measured_rewrite_costs(),
+                         const std::vector<rewrite_rule<NumType>>& rules = default_rewrite_rules<NumType>())
+{
+    rewrite_engine<NumType> engine;
+    auto root = engine.load(t);
+    engine.saturate(rules, budget);
+    t = engine.extract(root, costs);
+}
+
+template <typename NumType>
+struct tree_saturate : tree_transform<tree_saturate<NumType>, NumType, void>
+{
+    typedef tree_transform<tree_saturate<NumType>, NumType, void> parent;
+
+    template <typename Arg>
+    void operator()(Arg& arg)
+    {
+        saturate_expression(parent::node);
+    }
+};
+
+#endif // REWRITE_H_INCLUDED
@@ -0,0 +1,628 @@
+#ifndef SERVER_H_INCLUDED
+#define SERVER_H_INCLUDED
+
+#include <sstream>
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <atomic>
+#include <chrono>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <boost/variant.hpp>
+
+#include "calculator.h"
+#include "cost.h"
+#include "output.h"
+#include "parser.h"
+#include "polynomial.h"
+#include "tiered.h"
+#include "tree.h"
+#include "tree_transform.h"
+
+// Wire protocol, integers in host byte order:
+//
+// Request:   u32 payload length | u8 opcode | payload
+// Response:  u32 payload length | u8 status | payload
+//
+// Opcodes: 0 evaluates the payload as one statement in the connection's
+// session, 1 reports server statistics. Status is 0 on success, in which
+// case the payload is the result (empty for definitions), or 1 with the
+// error message as payload. Requests on one connection are answered in the
+// order they were sent, so clients may pipeline freely. A request larger
+// than max_request_size closes its connection once the requests before it
+// are answered.
+
+enum class request_opcode : std::uint8_t
+{
+    Statement = 0,
+    Stats = 1
+};
+
+enum class response_status : std::uint8_t
+{
+    Ok = 0,
+    Error = 1
+};
+
+class server_error : public std::exception
+{
+    std::string msg;
+
+public:
+
+    server_error(std::string _msg): msg(std::move(_msg)) {}
+
+    const char* what() const noexcept
+    {
+        return msg.c_str();
+    }
+};
+
+// Runs one statement against the session, leaving either the printed result
+// or the error message in result. With a cache, expressions are shared
+// between calls by their text and move to the compiled tier once hot.
+// Statements over the limits are rejected before they are evaluated; a
+// cached expression was admitted when it was first seen.
+inline bool evaluate_statement(calculator_state<double>& c, const std::string& input, std::string& result, tiered_cache* cache = nullptr,
+                               const resource_limits& limits = resource_limits())
+{
+    auto print = [&result](double d)
+    {
+        result = format_shortest(d);
+    };
+
+    try
+    {
+        if(cache)
+        {
+            if(auto e = cache->find(input))
+            {
+                print(e->evaluate(c));
+                return true;
+            }
+        }
+
+        auto s = initialize_parser(input.begin(), input.end(), limits);
+
+        t_statement<double> t;
+        parse_root(s, t);
+
+        auto type = identify_statement(t);
+        if(type == statement_type::Expression)
+        {
+            auto& e = boost::get<t_expression<double>>(t);
+            check_expression_limits(e, limits);
+            apply_transform<tree_fold<double>>(e);
+            apply_transform<tree_polynomial<double>>(e);
+            apply_transform<tree_flatten<double>>(e);
+            apply_transform<tree_fold<double>>(e);
+
+            if(cache)
+                print(cache->insert(input, std::move(e))->evaluate(c));
+            else
+                print(eval_expression_tree(c, e));
+        }
+        else if(type == statement_type::VarDefinition)
+        {
+            check_expression_limits(boost::get<t_var_definition<double>>(t).val, limits);
+            process_variable_definition(c, boost::get<t_var_definition<double>>(t));
+            result.clear();
+        }
+        else
+            throw std::logic_error("Unimplemented");
+
+        return true;
+    }
+    catch(const std::exception& e)
+    {
+        result = e.what();
+        return false;
+    }
+}
+
+// Request latencies are kept in a fixed ring of recent samples, so
+// percentiles describe the recent past rather than the whole uptime
+class server_stats
+{
+    static const std::size_t sample_capacity = 1 << 16;
+
+    std::atomic<std::uint64_t> request_count, error_count;
+    std::chrono::steady_clock::time_point start;
+
+    mutable std::mutex sample_lock;
+    std::vector<std::uint32_t> samples;
+    std::size_t next_sample;
+
+public:
+
+    server_stats(): request_count(0), error_count(0), start(std::chrono::steady_clock::now()), next_sample(0) {}
+
+    void record(std::chrono::steady_clock::duration latency, bool ok)
+    {
+        ++request_count;
+        if(!ok)
+            ++error_count;
+
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(latency).count();
+        auto sample = static_cast<std::uint32_t>(std::min<long long>(ns, UINT32_MAX));
+
+        std::lock_guard<std::mutex> guard(sample_lock);
+        if(samples.size() < sample_capacity)
+            samples.push_back(sample);
+        else
+            samples[next_sample] = sample;
+        next_sample = (next_sample + 1) % sample_capacity;
+    }
+
+    std::string report() const
+    {
+        std::vector<std::uint32_t> sorted;
+        {
+            std::lock_guard<std::mutex> guard(sample_lock);
+            sorted = samples;
+        }
+        std::sort(sorted.begin(), sorted.end());
+
+        auto percentile = [&](double p) -> double
+        {
+            if(sorted.empty())
+                return 0;
+            auto index = static_cast<std::size_t>(p * (sorted.size() - 1) + 0.5);
+            return sorted[index] / 1000.0;
+        };
+
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        std::ostringstream o;
+        o << "requests " << request_count << '\n'
+          << "errors " << error_count << '\n'
+          << "throughput " << (seconds > 0 ? request_count / seconds : 0) << " req/s\n"
+          << "latency_p50 " << percentile(0.50) << " us\n"
+          << "latency_p90 " << percentile(0.90) << " us\n"
+          << "latency_p99 " << percentile(0.99) << " us\n"
+          << "latency_max " << percentile(1.0) << " us\n";
+        return o.str();
+    }
+};
+
+class evaluation_server
+{
+    struct pending_request
+    {
+        request_opcode opcode;
+        std::string payload;
+        std::chrono::steady_clock::time_point received;
+    };
+
+    // A connection is handed to at most one worker at a time, which keeps
+    // its session single-threaded and its responses in request order
+    struct connection
+    {
+        int fd;
+        calculator_state<double> session;
+
+        std::string input;
+
+        std::mutex lock;
+        std::deque<pending_request> pending;
+        std::string output;
+        bool scheduled, want_write, peer_closed;
+
+        connection(int _fd): fd(_fd), scheduled(false), want_write(false), peer_closed(false) {}
+    };
+
+    typedef std::shared_ptr<connection> connection_ptr;
+
+    // Unparsed input is read up to about this much at a time, so no
+    // connection can make the server buffer more
+    static const std::uint32_t max_request_size = 16 << 20;
+
+    int listen_fd, epoll_fd, wake_fd;
+    std::atomic<bool> running;
+
+    std::unordered_map<int, connection_ptr> connections;
+
+    std::mutex queue_lock;
+    std::condition_variable queue_ready;
+    std::deque<connection_ptr> run_queue;
+    std::vector<std::thread> workers;
+
+    std::mutex writable_lock;
+    std::vector<connection_ptr> writable;
+
+    server_stats stats;
+    tiered_cache expressions;
+    resource_limits limits;
+
+    void wake()
+    {
+        std::uint64_t one = 1;
+        ssize_t written = ::write(wake_fd, &one, sizeof(one));
+        (void)written;
+    }
+
+    void schedule(const connection_ptr& c)
+    {
+        {
+            std::lock_guard<std::mutex> guard(queue_lock);
+            run_queue.push_back(c);
+        }
+        queue_ready.notify_one();
+    }
+
+    static void put_response(std::string& out, response_status status, const std::string& payload)
+    {
+        std::uint32_t size = payload.size();
+        out.append(reinterpret_cast<const char*>(&size), sizeof(size));
+        out.push_back(static_cast<char>(status));
+        out.append(payload);
+    }
+
+    void post_writable(const connection_ptr& c)
+    {
+        {
+            std::lock_guard<std::mutex> guard(writable_lock);
+            writable.push_back(c);
+        }
+        wake();
+    }
+
+    // Drains every request queued on the connection in one pass, so a
+    // pipelining client is served in batches rather than one wakeup per request
+    void serve(const connection_ptr& c)
+    {
+        std::deque<pending_request> batch;
+        std::string out, result;
+
+        while(true)
+        {
+            {
+                std::lock_guard<std::mutex> guard(c->lock);
+                if(c->pending.empty())
+                {
+                    c->scheduled = false;
+                    break;
+                }
+                batch.swap(c->pending);
+            }
+
+            out.clear();
+            for(auto& r : batch)
+            {
+                bool ok = true;
+                if(r.opcode == request_opcode::Statement)
+                    ok = evaluate_statement(c->session, r.payload, result, &expressions, limits);
+                else if(r.opcode == request_opcode::Stats)
+                {
+                    result = stats.report();
+                    result += "expressions_cached " + std::to_string(expressions.size()) + '\n';
+                    result += "expressions_compiled " + std::to_string(expressions.promotions()) + '\n';
+                }
+                else
+                {
+                    ok = false;
+                    result = "Unknown opcode";
+                }
+
+                put_response(out, ok ? response_status::Ok : response_status::Error, result);
+                stats.record(std::chrono::steady_clock::now() - r.received, ok);
+            }
+            batch.clear();
+
+            bool notify;
+            {
+                std::lock_guard<std::mutex> guard(c->lock);
+                c->output += out;
+                notify = !c->want_write;
+                c->want_write = true;
+            }
+
+            if(notify)
+                post_writable(c);
+        }
+
+        // Lets the event loop retire a connection whose peer hung up while
+        // this batch was running
+        post_writable(c);
+    }
+
+    void worker_loop()
+    {
+        while(true)
+        {
+            connection_ptr c;
+            {
+                std::unique_lock<std::mutex> guard(queue_lock);
+                queue_ready.wait(guard, [this] { return !run_queue.empty() || !running; });
+                if(run_queue.empty())
+                    return;
+                c = std::move(run_queue.front());
+                run_queue.pop_front();
+            }
+            serve(c);
+        }
+    }
+
+    void close_connection(const connection_ptr& c)
+    {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->fd, nullptr);
+        ::close(c->fd);
+        connections.erase(c->fd);
+        c->fd = -1;
+    }
+
+    void watch(const connection_ptr& c)
+    {
+        epoll_event ev;
+        ev.events = (c->peer_closed ? 0u : EPOLLIN) | (c->want_write ? EPOLLOUT : 0u);
+        ev.data.fd = c->fd;
+        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+    }
+
+    void accept_connections()
+    {
+        while(true)
+        {
+            int fd = ::accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if(fd < 0)
+                return;
+
+            epoll_event ev;
+            ev.events = EPOLLIN;
+            ev.data.fd = fd;
+            epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+            connections[fd] = std::make_shared<connection>(fd);
+        }
+    }
+
+    void read_requests(const connection_ptr& c)
+    {
+        char buf[65536];
+        std::size_t header = sizeof(std::uint32_t) + 1;
+        while(c->input.size() < header + max_request_size)
+        {
+            ssize_t n = ::read(c->fd, buf, sizeof(buf));
+            if(n > 0)
+                c->input.append(buf, n);
+            else if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                break;
+            else
+            {
+                // The peer may half-close after its last request, so answer
+                // what has arrived before letting go of the connection
+                c->peer_closed = true;
+                break;
+            }
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        std::size_t head = 0;
+        bool start = false;
+
+        {
+            std::lock_guard<std::mutex> guard(c->lock);
+            while(c->input.size() - head >= header)
+            {
+                std::uint32_t size;
+                std::memcpy(&size, c->input.data() + head, sizeof(size));
+                if(size > max_request_size)
+                {
+                    // Nothing after it is read, as if the peer had closed
+                    c->peer_closed = true;
+                    head = c->input.size();
+                    break;
+                }
+                if(c->input.size() - head - header < size)
+                    break;
+
+                pending_request r;
+                r.opcode = static_cast<request_opcode>(c->input[head + sizeof(size)]);
+                r.payload.assign(c->input, head + header, size);
+                r.received = now;
+                c->pending.push_back(std::move(r));
+
+                head += header + size;
+            }
+            c->input.erase(0, head);
+
+            if(!c->pending.empty() && !c->scheduled)
+                start = c->scheduled = true;
+        }
+
+        if(start)
+            schedule(c);
+        if(c->peer_closed)
+            write_responses(c);
+    }
+
+    void write_responses(const connection_ptr& c)
+    {
+        bool done;
+        {
+            std::lock_guard<std::mutex> guard(c->lock);
+            while(!c->output.empty())
+            {
+                ssize_t n = ::send(c->fd, c->output.data(), c->output.size(), MSG_NOSIGNAL);
+                if(n < 0)
+                {
+                    if(errno != EAGAIN && errno != EWOULDBLOCK)
+                    {
+                        c->output.clear();
+                        c->peer_closed = true;
+                    }
+                    break;
+                }
+                c->output.erase(0, n);
+            }
+
+            c->want_write = !c->output.empty();
+            done = c->peer_closed && !c->want_write && !c->scheduled;
+            if(!done)
+                watch(c);
+        }
+
+        if(done)
+            close_connection(c);
+    }
+
+    // The peer is gone both ways, so nothing more can be read or written.
+    // The fd leaves epoll at once, since a hangup is reported however it is
+    // watched, and is closed when no worker holds the connection.
+    void hang_up(const connection_ptr& c)
+    {
+        bool done;
+        {
+            std::lock_guard<std::mutex> guard(c->lock);
+            c->peer_closed = true;
+            c->output.clear();
+            c->want_write = false;
+            done = !c->scheduled;
+        }
+
+        if(done)
+            close_connection(c);
+        else
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->fd, nullptr);
+    }
+
+    void flush_writable()
+    {
+        std::vector<connection_ptr> ready;
+        {
+            std::lock_guard<std::mutex> guard(writable_lock);
+            ready.swap(writable);
+        }
+        for(auto& c : ready)
+        {
+            if(c->fd >= 0)
+                write_responses(c);
+        }
+    }
+
+public:
+
+    evaluation_server(const std::string& socket_path, unsigned int threads, const resource_limits& _limits = resource_limits()):
+        listen_fd(-1), epoll_fd(-1), wake_fd(-1), running(true), limits(_limits)
+    {
+        sockaddr_un addr;
+        std::memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if(socket_path.size() >= sizeof(addr.sun_path))
+            throw server_error("Socket path too long");
+        std::strcpy(addr.sun_path, socket_path.c_str());
+
+        ::unlink(socket_path.c_str());
+        listen_fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if(listen_fd < 0 || ::bind(listen_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || ::listen(listen_fd, SOMAXCONN) != 0)
+            throw server_error("Cannot listen on " + socket_path);
+
+        epoll_fd = ::epoll_create1(EPOLL_CLOEXEC);
+        wake_fd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if(epoll_fd < 0 || wake_fd < 0)
+            throw server_error("Cannot create event loop");
+
+        epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.fd = listen_fd;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev);
+        ev.data.fd = wake_fd;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev);
+
+        if(threads == 0)
+            threads = 1;
+        for(unsigned int i = 0; i < threads; ++i)
+            workers.emplace_back(&evaluation_server::worker_loop, this);
+    }
+
+    ~evaluation_server()
+    {
+        stop();
+        queue_ready.notify_all();
+        for(auto& t : workers)
+            t.join();
+
+        for(auto& c : connections)
+            ::close(c.first);
+        ::close(listen_fd);
+        ::close(epoll_fd);
+        ::close(wake_fd);
+    }
+
+    // May be called from any thread
+    void stop()
+    {
+        running = false;
+        wake();
+    }
+
+    const server_stats& statistics() const
+    {
+        return stats;
+    }
+
+    void run()
+    {
+        epoll_event events[256];
+
+        while(running)
+        {
+            int n = epoll_wait(epoll_fd, events, 256, -1);
+            if(n < 0)
+            {
+                if(errno == EINTR)
+                    continue;
+                throw server_error("epoll_wait failed");
+            }
+
+            for(int i = 0; i < n; ++i)
+            {
+                int fd = events[i].data.fd;
+                if(fd == listen_fd)
+                    accept_connections();
+                else if(fd == wake_fd)
+                {
+                    std::uint64_t count;
+                    ssize_t r = ::read(wake_fd, &count, sizeof(count));
+                    (void)r;
+                    flush_writable();
+                }
+                else
+                {
+                    auto it = connections.find(fd);
+                    if(it == connections.end())
+                        continue;
+                    connection_ptr c = it->second;
+
+                    if(events[i].events & (EPOLLHUP | EPOLLERR))
+                        hang_up(c);
+                    else if(events[i].events & EPOLLIN)
+                        read_requests(c);
+                    if(c->fd >= 0 && (events[i].events & EPOLLOUT))
+                        write_responses(c);
+                }
+            }
+        }
+    }
+};
+
+#endif // SERVER_H_INCLUDED
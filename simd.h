@@ -0,0 +1,178 @@
+#ifndef SIMD_H_INCLUDED
+#define SIMD_H_INCLUDED
+
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+
+// Vector kernels are written once against an instruction set policy
+// (simd_sse2 or simd_avx2) using GCC vector extensions, and instantiated per
+// policy. AVX2 instantiations are compiled with a function-level target
+// attribute and only called once the CPU has been checked at runtime, so
+// the program itself needs no -mavx2.
+
+#if defined(__GNUC__) && defined(__SSE2__) && (defined(__x86_64__) || defined(__i386__))
+#define MEP_SIMD_X86 1
+#include <immintrin.h>
+#endif
+
+// AVX2 kernels depend on flatten inlining every helper into the
+// target-attributed entry point; GCC only does that when optimizing, so
+// unoptimized builds stop at SSE2
+#if defined(MEP_SIMD_X86) && defined(__OPTIMIZE__)
+#define MEP_SIMD_AVX2 1
+#endif
+
+enum class simd_level
+{
+    Scalar,
+    SSE2,
+    AVX2
+};
+
+inline simd_level detect_simd_level()
+{
+#ifdef MEP_SIMD_X86
+#ifdef MEP_SIMD_AVX2
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        return simd_level::AVX2;
+#endif
+    return simd_level::SSE2;
+#else
+    return simd_level::Scalar;
+#endif
+}
+
+// The detected level, optionally capped by the MEP_SIMD environment
+// variable ("scalar", "sse2" or "avx2")
+inline simd_level active_simd_level()
+{
+    static const simd_level level = []
+    {
+        simd_level l = detect_simd_level();
+        const char* cap = std::getenv("MEP_SIMD");
+        if(cap && std::strcmp(cap, "scalar") == 0)
+            l = simd_level::Scalar;
+        else if(cap && std::strcmp(cap, "sse2") == 0 && l == simd_level::AVX2)
+            l = simd_level::SSE2;
+        return l;
+    }();
+    return level;
+}
+
+#ifdef MEP_SIMD_X86
+
+// Vectors are passed by value between inlined helpers only, so the ABI
+// notes GCC emits for 32-byte vectors outside AVX code do not apply. The
+// notes for kernel templates are reported at the end of the translation
+// unit instead, and a program that instantiates them turns them off there.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpsabi"
+
+#define MEP_TARGET_AVX2 __attribute__((target("avx2,fma")))
+#define MEP_FLATTEN __attribute__((flatten))
+
+struct simd_sse2
+{
+    typedef double vec __attribute__((vector_size(16)));
+    typedef long long ivec __attribute__((vector_size(16)));
+    static const std::size_t width = 2;
+
+    static vec load(const double* p)
+    {
+        vec v;
+        std::memcpy(&v, p, sizeof(v));
+        return v;
+    }
+    static void store(double* p, vec v)
+    {
+        std::memcpy(p, &v, sizeof(v));
+    }
+    static vec splat(double d)
+    {
+        vec v = {d, d};
+        return v;
+    }
+    static ivec splat_int(long long i)
+    {
+        ivec v = {i, i};
+        return v;
+    }
+    static vec sqrt(vec v)
+    {
+        return (vec)_mm_sqrt_pd((__m128d)v);
+    }
+    static vec fma(vec a, vec b, vec c)
+    {
+#ifdef __FMA__
+        return (vec)_mm_fmadd_pd((__m128d)a, (__m128d)b, (__m128d)c);
+#else
+        return a * b + c;
+#endif
+    }
+    // a * b + c with the product rounded first; the empty asm keeps the
+    // compiler from contracting the two into an FMA
+    static vec multiply_add(vec a, vec b, vec c)
+    {
+        vec p = a * b;
+        __asm__("" : "+x"(p));
+        return p + c;
+    }
+    static bool any(ivec m)
+    {
+        return _mm_movemask_pd((__m128d)m) != 0;
+    }
+};
+
+#ifdef MEP_SIMD_AVX2
+
+struct simd_avx2
+{
+    typedef double vec __attribute__((vector_size(32)));
+    typedef long long ivec __attribute__((vector_size(32)));
+    static const std::size_t width = 4;
+
+    MEP_TARGET_AVX2 static vec load(const double* p)
+    {
+        return (vec)_mm256_loadu_pd(p);
+    }
+    MEP_TARGET_AVX2 static void store(double* p, vec v)
+    {
+        _mm256_storeu_pd(p, (__m256d)v);
+    }
+    MEP_TARGET_AVX2 static vec splat(double d)
+    {
+        return (vec)_mm256_set1_pd(d);
+    }
+    MEP_TARGET_AVX2 static ivec splat_int(long long i)
+    {
+        return (ivec)_mm256_set1_epi64x(i);
+    }
+    MEP_TARGET_AVX2 static vec sqrt(vec v)
+    {
+        return (vec)_mm256_sqrt_pd((__m256d)v);
+    }
+    MEP_TARGET_AVX2 static vec fma(vec a, vec b, vec c)
+    {
+        return (vec)_mm256_fmadd_pd((__m256d)a, (__m256d)b, (__m256d)c);
+    }
+    MEP_TARGET_AVX2 static vec multiply_add(vec a, vec b, vec c)
+    {
+        vec p = a * b;
+        __asm__("" : "+x"(p));
+        return p + c;
+    }
+    MEP_TARGET_AVX2 static bool any(ivec m)
+    {
+        return _mm256_movemask_pd((__m256d)m) != 0;
+    }
+};
+
+#endif // MEP_SIMD_AVX2
+
+#pragma GCC diagnostic pop
+
+#endif // MEP_SIMD_X86
+
+#endif // SIMD_H_INCLUDED
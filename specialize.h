@@ -0,0 +1,157 @@
+#ifndef SPECIALIZE_H_INCLUDED
+#define SPECIALIZE_H_INCLUDED
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <cstddef>
+#include <utility>
+
+#include <boost/variant.hpp>
+
+#include "calculator.h"
+#include "polynomial.h"
+#include "tree.h"
+#include "tree_transform.h"
+
+namespace specialize_detail
+{
+    template <typename NumType>
+    const NumType* bound_value(const std::unordered_map<std::string, NumType>& bound, const std::string& name)
+    {
+        auto it = bound.find(name);
+        return it != bound.end() ? &it->second : nullptr;
+    }
+
+    template <typename NumType>
+    const NumType* bound_value(const variable_store<NumType>& bound, const std::string& name)
+    {
+        return bound.find(name);
+    }
+
+    template <typename NumType, typename Bindings>
+    void substitute(t_expression<NumType>& t, const Bindings& bound);
+
+    // Replaces bound variables in place. A polynomial in a bound variable
+    // becomes a constant if its coefficients are, and otherwise its Horner
+    // form with the value substituted.
+    template <typename NumType, typename Bindings>
+    struct substituter : public boost::static_visitor<void>
+    {
+        t_expression<NumType>& node;
+        const Bindings& bound;
+
+        substituter(t_expression<NumType>& _node, const Bindings& _bound): node(_node), bound(_bound) {}
+
+        void operator()(t_var_occurrance<NumType>& t)
+        {
+            if(const NumType* value = bound_value(bound, t.name))
+                node = *value;
+        }
+        void operator()(t_func_invocation<NumType>& t)
+        {
+            for(auto& i : t.args)
+                substitute(i, bound);
+        }
+        void operator()(t_negate<NumType>& t)
+        {
+            substitute(t.op, bound);
+        }
+        void binary(t_binary_op<NumType>& t)
+        {
+            substitute(t.ops[0], bound);
+            substitute(t.ops[1], bound);
+        }
+        void operator()(t_add<NumType>& t) { binary(t); }
+        void operator()(t_subtract<NumType>& t) { binary(t); }
+        void operator()(t_multiply<NumType>& t) { binary(t); }
+        void operator()(t_divide<NumType>& t) { binary(t); }
+        void operator()(t_exponentiate<NumType>& t) { binary(t); }
+        void operator()(t_sum<NumType>& t)
+        {
+            for(auto& i : t.ops)
+                substitute(i, bound);
+        }
+        void operator()(t_product<NumType>& t)
+        {
+            for(auto& i : t.ops)
+                substitute(i, bound);
+        }
+        void operator()(t_polynomial<NumType>& t)
+        {
+            for(auto& i : t.coeffs)
+            {
+                substitute(i, bound);
+                apply_transform<tree_fold<NumType>>(i);
+            }
+
+            const NumType* value = bound_value(bound, t.var);
+            if(!value)
+                return;
+
+            NumType x = *value;
+            std::vector<NumType> values;
+            for(const auto& i : t.coeffs)
+            {
+                const NumType* c = boost::get<NumType>(&i);
+                if(!c)
+                    break;
+                values.push_back(*c);
+            }
+
+            if(values.size() == t.coeffs.size())
+            {
+                node = evaluate_polynomial(values.data(), values.size(), x);
+                return;
+            }
+
+            t_expression<NumType> r = t.coeffs.back();
+            for(std::size_t k = t.coeffs.size() - 1; k > 0; --k)
+                r = t_add<NumType>(t.coeffs[k-1], t_multiply<NumType>(x, std::move(r)));
+            node = std::move(r);
+        }
+        template <typename Arg>
+        void operator()(Arg& arg)
+        {
+        }
+    };
+
+    template <typename NumType, typename Bindings>
+    void substitute(t_expression<NumType>& t, const Bindings& bound)
+    {
+        substituter<NumType, Bindings> s(t, bound);
+        boost::apply_visitor(s, t);
+    }
+}
+
+// Partially evaluates t with the given variables fixed: each bound variable
+// is replaced by its value and every subtree left without free variables is
+// folded to a constant, as tree_fold would. Free variables stay symbolic,
+// so evaluating the residual with the remaining variables gives the same
+// result as evaluating t with all of them, except that a polynomial in a
+// bound variable with symbolic coefficients is rounded as Horner's rule.
+template <typename NumType>
+t_expression<NumType> specialize_expression(t_expression<NumType> t, const std::unordered_map<std::string, NumType>& bound)
+{
+    specialize_detail::substitute(t, bound);
+    apply_transform<tree_fold<NumType>>(t);
+    return t;
+}
+
+template <typename NumType>
+t_expression<NumType> specialize_expression(t_expression<NumType> t, const variable_store<NumType>& bound)
+{
+    specialize_detail::substitute(t, bound);
+    apply_transform<tree_fold<NumType>>(t);
+    return t;
+}
+
+// Binds every variable currently defined in c
+template <typename NumType>
+t_expression<NumType> specialize_expression(t_expression<NumType> t, const calculator_state<NumType>& c)
+{
+    return specialize_expression(std::move(t), c.variable_set);
+}
+
+#endif // SPECIALIZE_H_INCLUDED
@@ -0,0 +1,286 @@
+#ifndef THREAD_POOL_H_INCLUDED
+#define THREAD_POOL_H_INCLUDED
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <exception>
+#include <utility>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// Fixed set of worker threads, each owning a deque of tasks. A worker
+// pushes and pops at the back of its own deque, so recently spawned (and
+// cache-warm) work runs first, and steals from the front of the others'
+// when it runs dry. Tasks submitted from outside the pool are spread over
+// the deques round-robin. Idle workers sleep until something is queued.
+
+class work_stealing_pool
+{
+    struct worker_queue
+    {
+        std::mutex lock;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    struct current_worker
+    {
+        const work_stealing_pool* pool;
+        unsigned int index;
+    };
+
+    static current_worker& current()
+    {
+        static thread_local current_worker w = {nullptr, 0};
+        return w;
+    }
+
+    std::vector<std::unique_ptr<worker_queue>> queues;
+    std::vector<std::thread> workers;
+
+    std::atomic<std::size_t> queued;
+    std::atomic<unsigned int> next_queue;
+    std::atomic<bool> stopping;
+
+    std::mutex sleep_lock;
+    std::condition_variable work_ready;
+
+    bool pop(unsigned int q, bool back, std::function<void()>& task)
+    {
+        std::lock_guard<std::mutex> guard(queues[q]->lock);
+        auto& tasks = queues[q]->tasks;
+        if(tasks.empty())
+            return false;
+
+        if(back)
+        {
+            task = std::move(tasks.back());
+            tasks.pop_back();
+        }
+        else
+        {
+            task = std::move(tasks.front());
+            tasks.pop_front();
+        }
+        --queued;
+        return true;
+    }
+
+    void work(unsigned int index)
+    {
+        current().pool = this;
+        current().index = index;
+
+        while(true)
+        {
+            if(run_one())
+                continue;
+
+            std::unique_lock<std::mutex> guard(sleep_lock);
+            work_ready.wait(guard, [this]{ return stopping || queued > 0; });
+            if(stopping && queued == 0)
+                return;
+        }
+    }
+
+    static void pin(std::thread& t, unsigned int cpu)
+    {
+#ifdef __linux__
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        pthread_setaffinity_np(t.native_handle(), sizeof(set), &set);
+#endif
+    }
+
+public:
+    // With pin_threads, worker i is bound to CPU i modulo the number of CPUs
+    explicit work_stealing_pool(unsigned int threads = std::thread::hardware_concurrency(), bool pin_threads = false):
+        queued(0), next_queue(0), stopping(false)
+    {
+        if(threads == 0)
+            threads = 1;
+
+        for(unsigned int i = 0; i < threads; ++i)
+            queues.emplace_back(new worker_queue);
+
+        // Workers read queues as soon as they start, so it is complete first
+        unsigned int cpus = std::thread::hardware_concurrency();
+        workers.reserve(threads);
+        for(unsigned int i = 0; i < threads; ++i)
+        {
+            workers.emplace_back(&work_stealing_pool::work, this, i);
+            if(pin_threads && cpus)
+                pin(workers.back(), i % cpus);
+        }
+    }
+
+    // Runs every task already queued before returning
+    ~work_stealing_pool()
+    {
+        {
+            std::lock_guard<std::mutex> guard(sleep_lock);
+            stopping = true;
+        }
+        work_ready.notify_all();
+        for(auto& t : workers)
+            t.join();
+    }
+
+    work_stealing_pool(const work_stealing_pool&) = delete;
+    work_stealing_pool& operator=(const work_stealing_pool&) = delete;
+
+    unsigned int size() const
+    {
+        return static_cast<unsigned int>(queues.size());
+    }
+
+    // Index of the calling worker thread, or size() when called from a
+    // thread outside the pool
+    unsigned int worker_index() const
+    {
+        return current().pool == this ? current().index : size();
+    }
+
+    // Tasks must not throw; task_group collects exceptions for callers that
+    // need them
+    void submit(std::function<void()> task)
+    {
+        unsigned int q = worker_index();
+        if(q == size())
+            q = next_queue++ % size();
+
+        {
+            std::lock_guard<std::mutex> guard(queues[q]->lock);
+            queues[q]->tasks.push_back(std::move(task));
+        }
+        ++queued;
+
+        std::lock_guard<std::mutex> guard(sleep_lock);
+        work_ready.notify_one();
+    }
+
+    // Runs one queued task on the calling thread, preferring the caller's
+    // own deque. Returns false if every deque was empty.
+    bool run_one()
+    {
+        std::function<void()> task;
+        unsigned int self = worker_index();
+        unsigned int n = size();
+
+        bool found = self < n && pop(self, true, task);
+        for(unsigned int i = 1; !found && i <= n; ++i)
+            found = pop((self + i) % n, false, task);
+
+        if(found)
+            task();
+        return found;
+    }
+};
+
+// Tracks a set of tasks spawned on a pool. wait() runs queued tasks on the
+// waiting thread until the group is done, so groups may be waited on from
+// inside pool tasks without tying up a worker. Once there is nothing left
+// to steal, the waiter sleeps until the group's last task finishes, looking
+// for new work now and then, rather than spinning while a long task runs
+// elsewhere. The first exception thrown by a task is rethrown from wait().
+class task_group
+{
+    // Empty steals before a waiter goes to sleep
+    static const unsigned int spin_attempts = 16;
+
+    work_stealing_pool& pool;
+    std::atomic<std::size_t> pending;
+
+    std::mutex error_lock;
+    std::exception_ptr error;
+
+    // A task finishes under done_lock, so a waiter that sees pending reach
+    // zero under it knows no task still touches the group
+    std::mutex done_lock;
+    std::condition_variable done;
+
+    void join()
+    {
+        unsigned int misses = 0;
+        while(pending > 0)
+        {
+            if(pool.run_one())
+            {
+                misses = 0;
+                continue;
+            }
+            if(++misses < spin_attempts)
+            {
+                std::this_thread::yield();
+                continue;
+            }
+
+            std::unique_lock<std::mutex> guard(done_lock);
+            done.wait_for(guard, std::chrono::milliseconds(1), [this]{ return pending == 0; });
+        }
+
+        // Waits out a task that is still notifying
+        std::lock_guard<std::mutex> guard(done_lock);
+    }
+
+public:
+    explicit task_group(work_stealing_pool& _pool): pool(_pool), pending(0) {}
+
+    task_group(const task_group&) = delete;
+    task_group& operator=(const task_group&) = delete;
+
+    ~task_group()
+    {
+        join();
+    }
+
+    template <typename Function>
+    void run(Function f)
+    {
+        ++pending;
+        pool.submit([this, f]
+        {
+            try
+            {
+                f();
+            }
+            catch(...)
+            {
+                std::lock_guard<std::mutex> guard(error_lock);
+                if(!error)
+                    error = std::current_exception();
+            }
+
+            std::lock_guard<std::mutex> guard(done_lock);
+            if(--pending == 0)
+                done.notify_all();
+        });
+    }
+
+    void wait()
+    {
+        join();
+
+        std::exception_ptr e;
+        {
+            std::lock_guard<std::mutex> guard(error_lock);
+            std::swap(e, error);
+        }
+        if(e)
+            std::rethrow_exception(e);
+    }
+};
+
+#endif // THREAD_POOL_H_INCLUDED
@@ -0,0 +1,709 @@
+#ifndef TIERED_H_INCLUDED
+#define TIERED_H_INCLUDED
+
+#include <ostream>
+
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <stdexcept>
+#include <utility>
+
+#include <boost/variant.hpp>
+
+#include "calculator.h"
+#include "functions.h"
+#include "polynomial.h"
+#include "rewrite.h"
+#include "tree.h"
+#include "tree_transform.h"
+
+// Expressions start out interpreted by eval_expression_tree and are counted
+// as they run. Past a threshold an expression is promoted: its tree is
+// optimized (polynomial conversion, flattening, folding) and compiled to a
+// flat stack program with each variable looked up once per evaluation. Promotion happens once, started by whichever
+// caller crosses the threshold. Given a background runner it takes place
+// there, and that caller goes on interpreting like the rest; without one it
+// takes place on that caller. Either way, callers keep interpreting until
+// the compiled form is published.
+//
+// Those passes are the ones callers already run before evaluating, so a
+// promoted expression returns what it returned while interpreted. Equality
+// saturation can be asked for with tier_options::saturate, but it is off by
+// default: it reassociates and factors, rewrites some NaN-producing forms
+// into finite ones, and stops at a wall-clock budget, so results would
+// change on promotion and vary between runs. Every variable of the original
+// expression is still looked up, so a missing one is reported exactly as
+// before.
+
+enum class execution_tier
+{
+    Interpreted,
+    Compiled
+};
+
+inline const char* tier_name(execution_tier t)
+{
+    return t == execution_tier::Interpreted ? "interpreted" : "compiled";
+}
+
+// Node kinds in t_expression alternative order
+const std::size_t node_kind_count = 13;
+
+inline const char* node_kind_name(std::size_t kind)
+{
+    static const char* const names[node_kind_count] = {"number", "variable", "function", "placeholder", "negate", "add",
+                                                       "subtract", "multiply", "divide", "exponentiate", "polynomial",
+                                                       "sum", "product"};
+    return kind < node_kind_count ? names[kind] : "unknown";
+}
+
+namespace tiered_detail
+{
+    enum class opcode : unsigned char
+    {
+        Constant,
+        Variable,
+        Negate,
+        Add,
+        Subtract,
+        Multiply,
+        Divide,
+        Exponentiate,
+        Call,
+        Polynomial,
+        Sum,
+        Product
+    };
+
+    // operand is the argument count of a call, the coefficient count of a
+    // polynomial, or the operand count of a sum or product
+    struct instruction
+    {
+        opcode op;
+        unsigned int operand;
+        unsigned int slot;
+        double constant;
+        const builtin_function* function;
+    };
+
+    // Adds the kind of every node under t to a histogram
+    struct kind_counter : public boost::static_visitor<void>
+    {
+        std::array<std::uint64_t, node_kind_count>& kinds;
+
+        kind_counter(std::array<std::uint64_t, node_kind_count>& _kinds): kinds(_kinds) {}
+
+        void count(const t_expression<double>& t)
+        {
+            ++kinds[t.which()];
+            boost::apply_visitor(*this, t);
+        }
+
+        void operator()(const t_func_invocation<double>& t)
+        {
+            for(const auto& i : t.args)
+                count(i);
+        }
+        void operator()(const t_negate<double>& t)
+        {
+            count(t.op);
+        }
+        void binary(const t_binary_op<double>& t)
+        {
+            count(t.ops[0]);
+            count(t.ops[1]);
+        }
+        void operator()(const t_add<double>& t) { binary(t); }
+        void operator()(const t_subtract<double>& t) { binary(t); }
+        void operator()(const t_multiply<double>& t) { binary(t); }
+        void operator()(const t_divide<double>& t) { binary(t); }
+        void operator()(const t_exponentiate<double>& t) { binary(t); }
+        void operator()(const t_polynomial<double>& t)
+        {
+            for(const auto& i : t.coeffs)
+                count(i);
+        }
+        void operator()(const t_sum<double>& t)
+        {
+            for(const auto& i : t.ops)
+                count(i);
+        }
+        void operator()(const t_product<double>& t)
+        {
+            for(const auto& i : t.ops)
+                count(i);
+        }
+        template <typename Arg>
+        void operator()(const Arg& arg)
+        {
+        }
+    };
+
+    // Lists every variable occurrence under t, with repeats
+    struct variable_collector : public boost::static_visitor<void>
+    {
+        std::vector<std::string>& out;
+
+        variable_collector(std::vector<std::string>& _out): out(_out) {}
+
+        void collect(const t_expression<double>& t)
+        {
+            boost::apply_visitor(*this, t);
+        }
+
+        void operator()(const t_var_occurrance<double>& t)
+        {
+            out.push_back(t.name);
+        }
+        void operator()(const t_func_invocation<double>& t)
+        {
+            for(const auto& i : t.args)
+                collect(i);
+        }
+        void operator()(const t_negate<double>& t)
+        {
+            collect(t.op);
+        }
+        void binary(const t_binary_op<double>& t)
+        {
+            collect(t.ops[0]);
+            collect(t.ops[1]);
+        }
+        void operator()(const t_add<double>& t) { binary(t); }
+        void operator()(const t_subtract<double>& t) { binary(t); }
+        void operator()(const t_multiply<double>& t) { binary(t); }
+        void operator()(const t_divide<double>& t) { binary(t); }
+        void operator()(const t_exponentiate<double>& t) { binary(t); }
+        void operator()(const t_polynomial<double>& t)
+        {
+            out.push_back(t.var);
+            for(const auto& i : t.coeffs)
+                collect(i);
+        }
+        void operator()(const t_sum<double>& t)
+        {
+            for(const auto& i : t.ops)
+                collect(i);
+        }
+        void operator()(const t_product<double>& t)
+        {
+            for(const auto& i : t.ops)
+                collect(i);
+        }
+        template <typename Arg>
+        void operator()(const Arg& arg)
+        {
+        }
+    };
+}
+
+class compiled_expression
+{
+    typedef tiered_detail::instruction instruction;
+    typedef tiered_detail::opcode opcode;
+
+    std::vector<instruction> code;
+    std::vector<std::string> variables;
+    std::unordered_map<std::string, unsigned int> slots;
+    std::size_t max_depth;
+
+    unsigned int slot(const std::string& name)
+    {
+        auto it = slots.emplace(name, static_cast<unsigned int>(variables.size())).first;
+        if(it->second == variables.size())
+            variables.push_back(name);
+        return it->second;
+    }
+
+    void emit(opcode op, std::size_t& depth, std::size_t pops, unsigned int operand = 0, unsigned int s = 0, double constant = 0,
+              const builtin_function* function = nullptr)
+    {
+        instruction i = {op, operand, s, constant, function};
+        code.push_back(i);
+        depth = depth - pops + 1;
+        max_depth = std::max(max_depth, depth);
+    }
+
+    void compile(const t_expression<double>& t, std::size_t& depth)
+    {
+        struct visitor_t : public boost::static_visitor<void>
+        {
+            compiled_expression& p;
+            std::size_t& depth;
+
+            visitor_t(compiled_expression& _p, std::size_t& _depth): p(_p), depth(_depth) {}
+
+            void operator()(double n)
+            {
+                p.emit(opcode::Constant, depth, 0, 0, 0, n);
+            }
+            void operator()(const t_var_occurrance<double>& t)
+            {
+                p.emit(opcode::Variable, depth, 0, 0, p.slot(t.name));
+            }
+            void operator()(const t_arg_placeholder<double>& t)
+            {
+                throw std::logic_error("t_arg_placeholder encountered while evaluating expression");
+            }
+            void operator()(const t_func_invocation<double>& t)
+            {
+                const builtin_function* f = find_builtin_function(t.name);
+                if(!f)
+                    throw eval_error("Undefined function");
+                if(t.args.size() != f->arity)
+                    throw eval_error("Wrong number of arguments to " + t.name);
+
+                for(const auto& i : t.args)
+                    p.compile(i, depth);
+                p.emit(opcode::Call, depth, f->arity, f->arity, 0, 0, f);
+            }
+            void operator()(const t_negate<double>& t)
+            {
+                p.compile(t.op, depth);
+                p.emit(opcode::Negate, depth, 1);
+            }
+            void binary(const t_binary_op<double>& t, opcode op)
+            {
+                p.compile(t.ops[0], depth);
+                p.compile(t.ops[1], depth);
+                p.emit(op, depth, 2);
+            }
+            void operator()(const t_add<double>& t)
+            {
+                binary(t, opcode::Add);
+            }
+            void operator()(const t_subtract<double>& t)
+            {
+                binary(t, opcode::Subtract);
+            }
+            void operator()(const t_multiply<double>& t)
+            {
+                binary(t, opcode::Multiply);
+            }
+            void operator()(const t_divide<double>& t)
+            {
+                binary(t, opcode::Divide);
+            }
+            void operator()(const t_exponentiate<double>& t)
+            {
+                binary(t, opcode::Exponentiate);
+            }
+            void operator()(const t_polynomial<double>& t)
+            {
+                for(const auto& i : t.coeffs)
+                    p.compile(i, depth);
+                auto n = static_cast<unsigned int>(t.coeffs.size());
+                p.emit(opcode::Polynomial, depth, n, n, p.slot(t.var));
+            }
+            void nary(const t_nary_op<double>& t, opcode op)
+            {
+                for(const auto& i : t.ops)
+                    p.compile(i, depth);
+                auto n = static_cast<unsigned int>(t.ops.size());
+                p.emit(op, depth, n, n);
+            }
+            void operator()(const t_sum<double>& t)
+            {
+                nary(t, opcode::Sum);
+            }
+            void operator()(const t_product<double>& t)
+            {
+                nary(t, opcode::Product);
+            }
+        } visitor(*this, depth);
+
+        boost::apply_visitor(visitor, t);
+    }
+
+public:
+    // Variables of the unoptimized expression are passed in required so
+    // that they are all looked up even if optimization removed some
+    compiled_expression(const t_expression<double>& t, const std::vector<std::string>& required): max_depth(0)
+    {
+        for(const auto& v : required)
+            slot(v);
+
+        std::size_t depth = 0;
+        compile(t, depth);
+    }
+
+    std::size_t size() const
+    {
+        return code.size();
+    }
+
+    template <typename State>
+    double evaluate(const State& c) const
+    {
+        double small_values[16], small_stack[32];
+        std::vector<double> large_values, large_stack;
+
+        double* values = small_values;
+        if(variables.size() > 16)
+        {
+            large_values.resize(variables.size());
+            values = large_values.data();
+        }
+        double* stack = small_stack;
+        if(max_depth > 32)
+        {
+            large_stack.resize(max_depth);
+            stack = large_stack.data();
+        }
+
+        for(std::size_t i = 0; i < variables.size(); ++i)
+        {
+            const double* value = lookup_variable(c, variables[i]);
+            if(!value)
+                throw eval_error("Undefined variable");
+            values[i] = *value;
+        }
+
+        double* top = stack;
+        for(const auto& i : code)
+        {
+            switch(i.op)
+            {
+            case opcode::Constant:
+                *top++ = i.constant;
+                break;
+            case opcode::Variable:
+                *top++ = values[i.slot];
+                break;
+            case opcode::Negate:
+                top[-1] = -top[-1];
+                break;
+            case opcode::Add:
+                --top;
+                top[-1] = top[-1] + top[0];
+                break;
+            case opcode::Subtract:
+                --top;
+                top[-1] = top[-1] - top[0];
+                break;
+            case opcode::Multiply:
+                --top;
+                top[-1] = top[-1] * top[0];
+                break;
+            case opcode::Divide:
+                --top;
+                top[-1] = top[-1] / top[0];
+                break;
+            case opcode::Exponentiate:
+                --top;
+                top[-1] = std::pow(top[-1], top[0]);
+                break;
+            case opcode::Call:
+                top -= i.operand;
+                *top = i.function->scalar(top);
+                ++top;
+                break;
+            case opcode::Polynomial:
+                top -= i.operand;
+                *top = evaluate_polynomial(top, i.operand, values[i.slot]);
+                ++top;
+                break;
+            case opcode::Sum:
+                top -= i.operand;
+                *top = reduce_operands<double>(i.operand, [top](std::size_t k) { return top[k]; }, std::plus<double>());
+                ++top;
+                break;
+            case opcode::Product:
+                top -= i.operand;
+                *top = reduce_operands<double>(i.operand, [top](std::size_t k) { return top[k]; }, std::multiplies<double>());
+                ++top;
+                break;
+            }
+        }
+        return top[-1];
+    }
+};
+
+// background, if set, is handed each promotion to run later on another
+// thread; the expression must then be owned by a shared_ptr, which the
+// promotion holds until it has run
+struct tier_options
+{
+    std::uint64_t promote_after;
+    bool saturate;
+    rewrite_budget budget;
+    std::function<void(std::function<void()>)> background;
+
+    tier_options(): promote_after(1000), saturate(false) {}
+};
+
+class tiered_expression : public std::enable_shared_from_this<tiered_expression>
+{
+    t_expression<double> tree;
+    tier_options options;
+    std::array<std::uint64_t, node_kind_count> kinds;
+
+    std::atomic<std::uint64_t> count;
+    std::atomic<bool> promoting;
+    std::atomic<const compiled_expression*> compiled;
+    std::unique_ptr<compiled_expression> owned;
+    std::chrono::nanoseconds promotion_time;
+
+    std::function<void(const tiered_expression&)> on_promote;
+
+    // An expression that cannot be compiled, such as one calling an
+    // unknown function, stays interpreted so that it keeps failing the
+    // same way
+    void promote()
+    {
+        auto start = std::chrono::steady_clock::now();
+        try
+        {
+            std::vector<std::string> variables;
+            tiered_detail::variable_collector(variables).collect(tree);
+
+            t_expression<double> optimized = tree;
+            if(options.saturate)
+                saturate_expression(optimized, options.budget);
+            convert_polynomials(optimized);
+            apply_transform<tree_flatten<double>>(optimized);
+            apply_transform<tree_fold<double>>(optimized);
+
+            owned.reset(new compiled_expression(optimized, variables));
+        }
+        catch(const std::exception&)
+        {
+            return;
+        }
+        promotion_time = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start);
+        compiled.store(owned.get(), std::memory_order_release);
+
+        if(on_promote)
+            on_promote(*this);
+    }
+
+public:
+    explicit tiered_expression(t_expression<double> _tree, const tier_options& _options = tier_options(),
+                               std::function<void(const tiered_expression&)> _on_promote = nullptr):
+        tree(std::move(_tree)), options(_options), count(0), promoting(false), compiled(nullptr), promotion_time(0),
+        on_promote(std::move(_on_promote))
+    {
+        kinds.fill(0);
+        tiered_detail::kind_counter(kinds).count(tree);
+    }
+
+    template <typename State>
+    double evaluate(const State& c)
+    {
+        const compiled_expression* p = compiled.load(std::memory_order_acquire);
+        ++count;
+        if(p)
+            return p->evaluate(c);
+
+        if(count >= options.promote_after && !promoting.exchange(true))
+        {
+            if(options.background)
+            {
+                auto self = shared_from_this();
+                options.background([self] { self->promote(); });
+            }
+            else
+            {
+                promote();
+                if((p = compiled.load(std::memory_order_acquire)))
+                    return p->evaluate(c);
+            }
+        }
+        return eval_expression_tree(c, tree);
+    }
+
+    execution_tier tier() const
+    {
+        return compiled.load(std::memory_order_acquire) ? execution_tier::Compiled : execution_tier::Interpreted;
+    }
+
+    std::uint64_t executions() const
+    {
+        return count;
+    }
+
+    // Nothing in an expression is conditional, so every node runs once per
+    // execution; per-kind counts are the kind's node count times that
+    std::uint64_t node_executions(std::size_t kind) const
+    {
+        return kind < node_kind_count ? kinds[kind] * count : 0;
+    }
+
+    // Zero until promoted
+    std::chrono::nanoseconds time_to_promote() const
+    {
+        return tier() == execution_tier::Compiled ? promotion_time : std::chrono::nanoseconds(0);
+    }
+
+    std::size_t compiled_size() const
+    {
+        const compiled_expression* p = compiled.load(std::memory_order_acquire);
+        return p ? p->size() : 0;
+    }
+
+    void report(std::ostream& o) const
+    {
+        o << "tier " << tier_name(tier()) << '\n'
+          << "executions " << executions() << '\n';
+        if(tier() == execution_tier::Compiled)
+            o << "promotion_us " << time_to_promote().count() / 1000.0 << '\n'
+              << "instructions " << compiled_size() << '\n';
+        for(std::size_t k = 0; k < node_kind_count; ++k)
+        {
+            if(kinds[k])
+                o << "node_" << node_kind_name(k) << ' ' << node_executions(k) << '\n';
+        }
+    }
+};
+
+// Shares tiered expressions between callers by source text, so a formula
+// sent many times accumulates one execution count. At most capacity
+// expressions are kept, the least recently used being dropped first, and
+// texts longer than max_text are not kept at all. Promotions run one at a
+// time on the cache's own thread, so no caller waits for one.
+class tiered_cache
+{
+    typedef std::list<std::string> usage_list;
+
+    struct entry
+    {
+        std::shared_ptr<tiered_expression> expression;
+        usage_list::iterator used;
+    };
+
+    tier_options options;
+    std::size_t capacity, max_text;
+
+    mutable std::mutex lock;
+    std::unordered_map<std::string, entry> entries;
+    // Most recently used first
+    usage_list usage;
+    std::atomic<std::uint64_t> promoted;
+
+    std::mutex jobs_lock;
+    std::condition_variable jobs_ready;
+    std::deque<std::function<void()>> jobs;
+    bool stopping;
+    std::thread promoter;
+
+    void promote_loop()
+    {
+        while(true)
+        {
+            std::function<void()> job;
+            {
+                std::unique_lock<std::mutex> guard(jobs_lock);
+                jobs_ready.wait(guard, [this] { return stopping || !jobs.empty(); });
+                if(stopping)
+                    return;
+                job = std::move(jobs.front());
+                jobs.pop_front();
+            }
+            job();
+        }
+    }
+
+public:
+    static const std::size_t default_capacity = 4096;
+    static const std::size_t default_max_text = 4096;
+
+    explicit tiered_cache(const tier_options& _options = tier_options(), std::size_t _capacity = default_capacity,
+                          std::size_t _max_text = default_max_text):
+        options(_options), capacity(std::max<std::size_t>(_capacity, 1)), max_text(_max_text), promoted(0), stopping(false)
+    {
+        options.background = [this](std::function<void()> job)
+        {
+            {
+                std::lock_guard<std::mutex> guard(jobs_lock);
+                jobs.push_back(std::move(job));
+            }
+            jobs_ready.notify_one();
+        };
+        promoter = std::thread(&tiered_cache::promote_loop, this);
+    }
+
+    // Promotions not yet started are dropped, leaving their expressions
+    // interpreted
+    ~tiered_cache()
+    {
+        {
+            std::lock_guard<std::mutex> guard(jobs_lock);
+            stopping = true;
+        }
+        jobs_ready.notify_all();
+        promoter.join();
+    }
+
+    tiered_cache(const tiered_cache&) = delete;
+    tiered_cache& operator=(const tiered_cache&) = delete;
+
+    std::shared_ptr<tiered_expression> find(const std::string& text)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        auto it = entries.find(text);
+        if(it == entries.end())
+            return nullptr;
+        usage.splice(usage.begin(), usage, it->second.used);
+        return it->second.expression;
+    }
+
+    // If another caller inserted the same text first, theirs is kept. A
+    // text too long to keep gets an expression of its own.
+    std::shared_ptr<tiered_expression> insert(const std::string& text, t_expression<double> tree)
+    {
+        auto e = std::make_shared<tiered_expression>(std::move(tree), options, [this](const tiered_expression&)
+        {
+            ++promoted;
+        });
+        if(text.size() > max_text)
+            return e;
+
+        std::lock_guard<std::mutex> guard(lock);
+        auto it = entries.find(text);
+        if(it != entries.end())
+        {
+            usage.splice(usage.begin(), usage, it->second.used);
+            return it->second.expression;
+        }
+
+        if(entries.size() >= capacity)
+        {
+            entries.erase(usage.back());
+            usage.pop_back();
+        }
+        usage.push_front(text);
+        entry added = {e, usage.begin()};
+        entries.emplace(text, std::move(added));
+        return e;
+    }
+
+    std::size_t size() const
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        return entries.size();
+    }
+
+    std::uint64_t promotions() const
+    {
+        return promoted;
+    }
+};
+
+#endif // TIERED_H_INCLUDED
@@ -3,13 +3,18 @@
 
 #include <iostream>
 
+#include <string>
 #include <vector>
 
 #include <cmath>
+#include <cstddef>
+#include <limits>
 #include <utility>
 
 #include <boost/variant.hpp>
 
+#include "output.h"
+
 template <typename> struct t_unary_op;
 template <typename> struct t_binary_op;
 template <typename> struct t_nary_op;
@@ -67,6 +72,15 @@ struct t_var_occurrance
 template <typename>
 struct t_func_invocation;
 
+template <typename>
+struct t_polynomial;
+
+template <typename>
+struct t_sum;
+
+template <typename>
+struct t_product;
+
 template <typename NumType>
 struct t_arg_placeholder
 {
@@ -86,7 +100,10 @@ using t_expression = boost::variant<
                                     boost::recursive_wrapper<t_subtract<NumType>>,
                                     boost::recursive_wrapper<t_multiply<NumType>>,
                                     boost::recursive_wrapper<t_divide<NumType>>,
-                                    boost::recursive_wrapper<t_exponentiate<NumType>>
+                                    boost::recursive_wrapper<t_exponentiate<NumType>>,
+                                    boost::recursive_wrapper<t_polynomial<NumType>>,
+                                    boost::recursive_wrapper<t_sum<NumType>>,
+                                    boost::recursive_wrapper<t_product<NumType>>
                                     >;
 
 template <typename NumType>
@@ -98,6 +115,32 @@ struct t_func_invocation
     t_func_invocation(std::string _name, std::vector<t_expression<NumType>> _args): name(std::move(_name)), args(std::move(_args)) {}
 };
 
+// Polynomial in one variable, coeffs[k] being the coefficient of var^k.
+// Coefficients are expressions themselves, so nesting polynomials in other
+// variables as coefficients expresses multivariate polynomials.
+template <typename NumType>
+struct t_polynomial
+{
+    std::string var;
+    std::vector<t_expression<NumType>> coeffs;
+
+    t_polynomial(std::string _var, std::vector<t_expression<NumType>> _coeffs): var(std::move(_var)), coeffs(std::move(_coeffs)) {}
+};
+
+// Sum and product of any number of operands, produced by tree_flatten from
+// chains of t_add and t_multiply
+template <typename NumType>
+struct t_sum : public t_nary_op<NumType>
+{
+    t_sum(std::vector<t_expression<NumType>> _ops): t_nary_op<NumType>(std::move(_ops)) {}
+};
+
+template <typename NumType>
+struct t_product : public t_nary_op<NumType>
+{
+    t_product(std::vector<t_expression<NumType>> _ops): t_nary_op<NumType>(std::move(_ops)) {}
+};
+
 template <typename NumType>
 struct t_unary_op
 {
@@ -123,8 +166,47 @@ struct t_nary_op
 
     template <typename... Ops>
     t_nary_op(Ops&&... _ops): ops{std::forward<Ops>(_ops)...} {}
+    t_nary_op(std::vector<t_expression<NumType>> _ops): ops(std::move(_ops)) {}
 };
 
+// Reduces operand(0), ..., operand(n - 1), n > 0, with combine. This is the
+// one association every evaluator of t_sum and t_product uses, so they all
+// round alike. Short lists are folded left to right, exactly as the binary
+// chain they came from. Longer ones are spread over four accumulators,
+// operand i going to accumulator i % 4, so that four independent
+// dependency chains run at once; the accumulators are combined as
+// (a0 op a1) op (a2 op a3). Operands are requested in order.
+const std::size_t nary_interleave_min = 8;
+
+template <typename T, typename Operand, typename Combine>
+T reduce_operands(std::size_t n, Operand operand, Combine combine)
+{
+    if(n < nary_interleave_min)
+    {
+        T r = operand(0);
+        for(std::size_t i = 1; i < n; ++i)
+            r = combine(r, operand(i));
+        return r;
+    }
+
+    T a0 = operand(0), a1 = operand(1), a2 = operand(2), a3 = operand(3);
+    std::size_t i = 4;
+    for(; i + 4 <= n; i += 4)
+    {
+        a0 = combine(a0, operand(i));
+        a1 = combine(a1, operand(i + 1));
+        a2 = combine(a2, operand(i + 2));
+        a3 = combine(a3, operand(i + 3));
+    }
+    if(i < n)
+        a0 = combine(a0, operand(i++));
+    if(i < n)
+        a1 = combine(a1, operand(i++));
+    if(i < n)
+        a2 = combine(a2, operand(i++));
+    return combine(combine(a0, a1), combine(a2, a3));
+}
+
 template <typename NumType>
 struct t_var_definition
 {
@@ -173,119 +255,245 @@ statement_type identify_statement(const t_statement<NumType>& t)
 }
 
 template <typename NumType>
-void print_expression_tree(const t_expression<NumType>& t)
+void print_expression_tree(output_buffer& o, const t_expression<NumType>& t)
 {
-    using namespace std;
-
     struct visitor_t : public boost::static_visitor<>
     {
+        output_buffer& o;
         unsigned int offset;
 
-        visitor_t(unsigned int o): offset(o) {}
+        visitor_t(output_buffer& _o, unsigned int _offset): o(_o), offset(_offset) {}
+
+        void children(const t_expression<NumType>* first, const t_expression<NumType>* last) const
+        {
+            visitor_t child(o, offset + 1);
+            for(; first != last; ++first)
+                boost::apply_visitor(child, *first);
+        }
 
         void operator()(const NumType& n) const
         {
-            for(auto i = offset; i > 0; --i)
-                cout.put(' ');
-            cout << n << endl;
+            o.indent(offset) << n << '\n';
         }
         void operator()(const t_var_occurrance<NumType>& t) const
         {
-            for(auto i = offset; i > 0; --i)
-                cout.put(' ');
-            cout << "Variable " << t.name << endl;
+            o.indent(offset) << "Variable " << t.name << '\n';
         }
         void operator()(const t_func_invocation<NumType>& t) const
         {
-            for(auto i = offset; i > 0; --i)
-                cout.put(' ');
-            cout << "Function " << t.name << endl;
-
-            for(const auto& i : t.args)
-            {
-                boost::apply_visitor(visitor_t(offset+1), i);
-            }
+            o.indent(offset) << "Function " << t.name << '\n';
+            children(t.args.data(), t.args.data() + t.args.size());
         }
         void operator()(const t_arg_placeholder<NumType>& t) const
         {
-            for(auto i = offset; i > 0; --i)
-                cout.put(' ');
-            cout << "Argument " << t.index << endl;
+            o.indent(offset) << "Argument " << t.index << '\n';
         }
         void operator()(const t_negate<NumType>& t) const
         {
-            for(auto i = offset; i > 0; --i)
-                cout.put(' ');
-            cout << "Negate" << endl;
-            boost::apply_visitor(visitor_t(offset+1), t.op);
+            o.indent(offset) << "Negate\n";
+            children(&t.op, &t.op + 1);
         }
         void operator()(const t_add<NumType>& t) const
         {
-            for(auto i = offset; i > 0; --i)
-                cout.put(' ');
-            cout << "Add" << endl;
-            boost::apply_visitor(visitor_t(offset+1), t.ops[0]);
-            boost::apply_visitor(visitor_t(offset+1), t.ops[1]);
+            o.indent(offset) << "Add\n";
+            children(t.ops, t.ops + 2);
         }
         void operator()(const t_subtract<NumType>& t) const
         {
-            for(auto i = offset; i > 0; --i)
-                cout.put(' ');
-            cout << "Subtract" << endl;
-            boost::apply_visitor(visitor_t(offset+1), t.ops[0]);
-            boost::apply_visitor(visitor_t(offset+1), t.ops[1]);
+            o.indent(offset) << "Subtract\n";
+            children(t.ops, t.ops + 2);
         }
         void operator()(const t_multiply<NumType>& t) const
         {
-            for(auto i = offset; i > 0; --i)
-                cout.put(' ');
-            cout << "Multiply" << endl;
-            boost::apply_visitor(visitor_t(offset+1), t.ops[0]);
-            boost::apply_visitor(visitor_t(offset+1), t.ops[1]);
+            o.indent(offset) << "Multiply\n";
+            children(t.ops, t.ops + 2);
         }
         void operator()(const t_divide<NumType>& t) const
         {
-            for(auto i = offset; i > 0; --i)
-                cout.put(' ');
-            cout << "Divide" << endl;
-            boost::apply_visitor(visitor_t(offset+1), t.ops[0]);
-            boost::apply_visitor(visitor_t(offset+1), t.ops[1]);
+            o.indent(offset) << "Divide\n";
+            children(t.ops, t.ops + 2);
         }
         void operator()(const t_exponentiate<NumType>& t) const
         {
-            for(auto i = offset; i > 0; --i)
-                cout.put(' ');
-            cout << "Exponentiate" << endl;
-            boost::apply_visitor(visitor_t(offset+1), t.ops[0]);
-            boost::apply_visitor(visitor_t(offset+1), t.ops[1]);
+            o.indent(offset) << "Exponentiate\n";
+            children(t.ops, t.ops + 2);
         }
-    } visitor(0);
+        void operator()(const t_polynomial<NumType>& t) const
+        {
+            o.indent(offset) << "Polynomial in " << t.var << '\n';
+            children(t.coeffs.data(), t.coeffs.data() + t.coeffs.size());
+        }
+        void operator()(const t_sum<NumType>& t) const
+        {
+            o.indent(offset) << "Sum\n";
+            children(t.ops.data(), t.ops.data() + t.ops.size());
+        }
+        void operator()(const t_product<NumType>& t) const
+        {
+            o.indent(offset) << "Product\n";
+            children(t.ops.data(), t.ops.data() + t.ops.size());
+        }
+    } visitor(o, 0);
 
     boost::apply_visitor(visitor, t);
 }
 
 template <typename NumType>
-void print_statement_tree(const t_statement<NumType>& t)
+void print_expression_tree(const t_expression<NumType>& t)
 {
-    using namespace std;
+    output_buffer o(std::cout);
+    print_expression_tree(o, t);
+}
 
+template <typename NumType>
+void print_statement_tree(output_buffer& o, const t_statement<NumType>& t)
+{
     struct visitor_t : public boost::static_visitor<>
     {
+        output_buffer& o;
+
+        visitor_t(output_buffer& _o): o(_o) {}
+
         void operator()(const t_expression<NumType>& t) const
         {
-            cout << "Expression:" << endl;
-            print_expression_tree(t);
+            o << "Expression:\n";
+            print_expression_tree(o, t);
         }
         void operator()(const t_var_definition<NumType>& t) const
         {
-            cout << "Variable \"" << t.name << "\" definition:" << endl;
-            print_expression_tree(t.val);
+            o << "Variable \"" << t.name << "\" definition:\n";
+            print_expression_tree(o, t.val);
         }
         void operator()(const t_func_definition<NumType>& t) const
         {
-            throw logic_error("Unimplemented");
+            throw std::logic_error("Unimplemented");
+        }
+    } visitor(o);
+
+    boost::apply_visitor(visitor, t);
+}
+
+template <typename NumType>
+void print_statement_tree(const t_statement<NumType>& t)
+{
+    output_buffer o(std::cout);
+    print_statement_tree(o, t);
+}
+
+// Writes the expression back out as fully parenthesized infix text, for
+// reading. parse_expression does not accept all of it: numbers that need an
+// exponent (1e+300), infinities, NaNs and #n placeholders have no form in
+// the input language, so the text is not a way to store a tree.
+template <typename NumType>
+void write_expression(std::ostream& os, const t_expression<NumType>& t)
+{
+    struct visitor_t : public boost::static_visitor<>
+    {
+        std::ostream& os;
+
+        visitor_t(std::ostream& _os): os(_os) {}
+
+        void write_binary(const t_binary_op<NumType>& t, char op) const
+        {
+            os.put('(');
+            boost::apply_visitor(*this, t.ops[0]);
+            os.put(op);
+            boost::apply_visitor(*this, t.ops[1]);
+            os.put(')');
+        }
+
+        void write_nary(const t_nary_op<NumType>& t, char op) const
+        {
+            os.put('(');
+            for(std::size_t i = 0; i < t.ops.size(); ++i)
+            {
+                if(i != 0)
+                    os.put(op);
+                boost::apply_visitor(*this, t.ops[i]);
+            }
+            os.put(')');
+        }
+
+        void operator()(const NumType& n) const
+        {
+            char buf[format_buffer_size];
+            if(n < 0)
+            {
+                os << "(-";
+                os.write(buf, format_shortest(buf, -n));
+                os.put(')');
+            }
+            else
+                os.write(buf, format_shortest(buf, n));
+        }
+        void operator()(const t_var_occurrance<NumType>& t) const
+        {
+            os << t.name;
+        }
+        void operator()(const t_func_invocation<NumType>& t) const
+        {
+            os << t.name << '(';
+            for(std::size_t i = 0; i < t.args.size(); ++i)
+            {
+                if(i != 0)
+                    os.put(',');
+                boost::apply_visitor(*this, t.args[i]);
+            }
+            os.put(')');
+        }
+        void operator()(const t_arg_placeholder<NumType>& t) const
+        {
+            os << '#' << t.index;
+        }
+        void operator()(const t_negate<NumType>& t) const
+        {
+            os << "(-";
+            boost::apply_visitor(*this, t.op);
+            os.put(')');
+        }
+        void operator()(const t_add<NumType>& t) const
+        {
+            write_binary(t, '+');
+        }
+        void operator()(const t_subtract<NumType>& t) const
+        {
+            write_binary(t, '-');
+        }
+        void operator()(const t_multiply<NumType>& t) const
+        {
+            write_binary(t, '*');
+        }
+        void operator()(const t_divide<NumType>& t) const
+        {
+            write_binary(t, '/');
+        }
+        void operator()(const t_exponentiate<NumType>& t) const
+        {
+            write_binary(t, '^');
+        }
+        void operator()(const t_polynomial<NumType>& t) const
+        {
+            if(t.coeffs.empty())
+                os.put('0');
+            for(std::size_t i = 0; i < t.coeffs.size(); ++i)
+            {
+                os.put('(');
+                boost::apply_visitor(*this, t.coeffs[i]);
+                if(i + 1 < t.coeffs.size())
+                    os << '+' << t.var << '*';
+            }
+            for(std::size_t i = 0; i < t.coeffs.size(); ++i)
+                os.put(')');
+        }
+        void operator()(const t_sum<NumType>& t) const
+        {
+            write_nary(t, '+');
+        }
+        void operator()(const t_product<NumType>& t) const
+        {
+            write_nary(t, '*');
         }
-    } visitor;
+    } visitor(os);
 
     boost::apply_visitor(visitor, t);
 }
@@ -1,11 +1,17 @@
 #ifndef TREE_TRANSFORM_H_INCLUDED
 #define TREE_TRANSFORM_H_INCLUDED
 
+#include <vector>
+
+#include <cmath>
+#include <cstddef>
+#include <functional>
 #include <utility>
 
 #include <boost/variant.hpp>
 #include <boost/optional.hpp>
 
+#include "functions.h"
 #include "tree.h"
 
 template <typename Child, typename NumType, typename ResultType>
@@ -31,86 +37,205 @@ typename TransformType::result_type apply_transform(t_expression<typename Transf
     return boost::apply_visitor(transform, tree);
 }
 
+// One step of constant folding: folds a node whose operands have already
+// been folded, so that the constant ones are NumType leaves. Returns the
+// node's value if it became constant. tree_fold takes this step at every
+// node on the way up; parallel_fold (parallel.h) takes it at nodes whose
+// operands were folded by other tasks.
 template <typename NumType>
-struct tree_fold : tree_transform<tree_fold<NumType>, NumType, boost::optional<NumType>>
+struct tree_fold_step : tree_transform<tree_fold_step<NumType>, NumType, boost::optional<NumType>>
 {
-    typedef tree_transform<tree_fold<NumType>, NumType, boost::optional<NumType>> parent;
-    boost::optional<NumType> operator()(NumType n)
+    typedef tree_transform<tree_fold_step<NumType>, NumType, boost::optional<NumType>> parent;
+
+    explicit tree_fold_step(t_expression<NumType>& _node): parent(_node) {}
+
+    static boost::optional<NumType> constant(const t_expression<NumType>& t)
     {
-        return n;
+        if(auto n = boost::get<NumType>(&t))
+            return *n;
+        return boost::optional<NumType>();
     }
-    boost::optional<NumType> operator()(t_add<NumType>& t)
+
+    template <typename Combine>
+    boost::optional<NumType> binary(t_binary_op<NumType>& t, Combine combine)
     {
-        auto lhs = apply_transform<tree_fold>(t.ops[0]),
-             rhs = apply_transform<tree_fold>(t.ops[1]);
+        auto lhs = constant(t.ops[0]),
+             rhs = constant(t.ops[1]);
 
         if(lhs && rhs)
         {
-            auto result = *lhs + *rhs;
+            NumType result = combine(*lhs, *rhs);
             parent::node = result;
             return result;
         }
         else
             return boost::optional<NumType>();
     }
-    boost::optional<NumType> operator()(t_subtract<NumType>& t)
+
+    boost::optional<NumType> operator()(NumType n)
     {
-        auto lhs = apply_transform<tree_fold>(t.ops[0]),
-             rhs = apply_transform<tree_fold>(t.ops[1]);
+        return n;
+    }
+    boost::optional<NumType> operator()(t_negate<NumType>& t)
+    {
+        auto op = constant(t.op);
 
-        if(lhs && rhs)
+        if(op)
         {
-            auto result = *lhs - *rhs;
+            auto result = -*op;
             parent::node = result;
             return result;
         }
         else
             return boost::optional<NumType>();
     }
+    boost::optional<NumType> operator()(t_add<NumType>& t)
+    {
+        return binary(t, [](NumType lhs, NumType rhs) { return lhs + rhs; });
+    }
+    boost::optional<NumType> operator()(t_subtract<NumType>& t)
+    {
+        return binary(t, [](NumType lhs, NumType rhs) { return lhs - rhs; });
+    }
     boost::optional<NumType> operator()(t_multiply<NumType>& t)
     {
-        auto lhs = apply_transform<tree_fold>(t.ops[0]),
-             rhs = apply_transform<tree_fold>(t.ops[1]);
+        return binary(t, [](NumType lhs, NumType rhs) { return lhs * rhs; });
+    }
+    boost::optional<NumType> operator()(t_divide<NumType>& t)
+    {
+        return binary(t, [](NumType lhs, NumType rhs) { return lhs / rhs; });
+    }
+    boost::optional<NumType> operator()(t_exponentiate<NumType>& t)
+    {
+        using std::pow;
 
-        if(lhs && rhs)
+        return binary(t, [](NumType lhs, NumType rhs) { return pow(lhs, rhs); });
+    }
+    // Calls to built-in functions with constant arguments fold to their
+    // scalar result; unknown names and wrong arities are left for the
+    // evaluator to report
+    boost::optional<NumType> operator()(t_func_invocation<NumType>& t)
+    {
+        double args[builtin_max_arity];
+        bool constant = true;
+        for(std::size_t i = 0; i < t.args.size(); ++i)
         {
-            auto result = *lhs * *rhs;
-            parent::node = result;
-            return result;
+            auto arg = tree_fold_step::constant(t.args[i]);
+            if(!arg || i >= builtin_max_arity)
+                constant = false;
+            else
+                args[i] = *arg;
         }
-        else
+
+        const builtin_function* f = find_builtin_function(t.name);
+        if(!constant || !f || f->arity != t.args.size())
             return boost::optional<NumType>();
+
+        NumType result = f->scalar(args);
+        parent::node = result;
+        return result;
     }
-    boost::optional<NumType> operator()(t_divide<NumType>& t)
+    // All constant operands are combined into one, in a single step, that
+    // takes the place of the first. This reassociates them with the rest.
+    template <typename Node, typename Combine>
+    boost::optional<NumType> nary(Node& t, Combine combine)
     {
-        auto lhs = apply_transform<tree_fold>(t.ops[0]),
-             rhs = apply_transform<tree_fold>(t.ops[1]);
+        std::vector<NumType> constants;
+        for(auto& i : t.ops)
+        {
+            auto op = constant(i);
+            if(op)
+                constants.push_back(*op);
+        }
 
-        if(lhs && rhs)
+        if(constants.size() == t.ops.size())
         {
-            auto result = *lhs / *rhs;
+            NumType result = reduce_operands<NumType>(constants.size(), [&](std::size_t i) { return constants[i]; }, combine);
             parent::node = result;
             return result;
         }
-        else
+        if(constants.size() < 2)
             return boost::optional<NumType>();
+
+        std::vector<t_expression<NumType>> ops;
+        ops.reserve(t.ops.size() - constants.size() + 1);
+        ops.push_back(reduce_operands<NumType>(constants.size(), [&](std::size_t i) { return constants[i]; }, combine));
+        for(auto& i : t.ops)
+            if(!boost::get<NumType>(&i))
+                ops.push_back(std::move(i));
+
+        parent::node = Node(std::move(ops));
+        return boost::optional<NumType>();
     }
-    boost::optional<NumType> operator()(t_exponentiate<NumType>& t)
+    boost::optional<NumType> operator()(t_sum<NumType>& t)
+    {
+        return nary(t, std::plus<NumType>());
+    }
+    boost::optional<NumType> operator()(t_product<NumType>& t)
+    {
+        return nary(t, std::multiplies<NumType>());
+    }
+    template <typename Arg>
+    boost::optional<NumType> operator()(Arg& arg)
     {
-        auto lhs = apply_transform<tree_fold>(t.ops[0]),
-             rhs = apply_transform<tree_fold>(t.ops[1]);
+        return boost::optional<NumType>();
+    }
+};
 
-        using std::pow;
+template <typename NumType>
+struct tree_fold : tree_transform<tree_fold<NumType>, NumType, boost::optional<NumType>>
+{
+    typedef tree_transform<tree_fold<NumType>, NumType, boost::optional<NumType>> parent;
 
-        if(lhs && rhs)
-        {
-            auto result = pow(*lhs, *rhs);
-            parent::node = result;
-            return result;
-        }
-        else
-            return boost::optional<NumType>();
+    template <typename Node>
+    boost::optional<NumType> step(Node& t)
+    {
+        return tree_fold_step<NumType>(parent::node)(t);
     }
+
+    boost::optional<NumType> operator()(NumType n)
+    {
+        return n;
+    }
+    boost::optional<NumType> operator()(t_negate<NumType>& t)
+    {
+        apply_transform<tree_fold>(t.op);
+        return step(t);
+    }
+    template <typename Node>
+    boost::optional<NumType> binary(Node& t)
+    {
+        apply_transform<tree_fold>(t.ops[0]);
+        apply_transform<tree_fold>(t.ops[1]);
+        return step(t);
+    }
+    boost::optional<NumType> operator()(t_add<NumType>& t) { return binary(t); }
+    boost::optional<NumType> operator()(t_subtract<NumType>& t) { return binary(t); }
+    boost::optional<NumType> operator()(t_multiply<NumType>& t) { return binary(t); }
+    boost::optional<NumType> operator()(t_divide<NumType>& t) { return binary(t); }
+    boost::optional<NumType> operator()(t_exponentiate<NumType>& t) { return binary(t); }
+    boost::optional<NumType> operator()(t_func_invocation<NumType>& t)
+    {
+        for(auto& i : t.args)
+            apply_transform<tree_fold>(i);
+        return step(t);
+    }
+    boost::optional<NumType> operator()(t_polynomial<NumType>& t)
+    {
+        for(auto& i : t.coeffs)
+            apply_transform<tree_fold>(i);
+
+        return boost::optional<NumType>();
+    }
+    template <typename Node>
+    boost::optional<NumType> nary(Node& t)
+    {
+        for(auto& i : t.ops)
+            apply_transform<tree_fold>(i);
+        return step(t);
+    }
+    boost::optional<NumType> operator()(t_sum<NumType>& t) { return nary(t); }
+    boost::optional<NumType> operator()(t_product<NumType>& t) { return nary(t); }
     template <typename Arg>
     boost::optional<NumType> operator()(Arg& arg)
     {
@@ -118,4 +243,149 @@ struct tree_fold : tree_transform<tree_fold<NumType>, NumType, boost::optional<N
     }
 };
 
+// Rewrites chains of three or more additions and subtractions into one
+// t_sum, and chains of multiplications into one t_product, so that long
+// chains are reduced with independent accumulators instead of one serial
+// dependency. Only the left operand of each link is followed, as the
+// parser builds chains that way, which keeps the left-to-right order that
+// reduce_operands uses for short lists: sums and products of fewer than
+// nary_interleave_min operands round exactly as before. a - b becomes
+// a + (-b), which rounds the same.
+template <typename NumType>
+struct tree_flatten : tree_transform<tree_flatten<NumType>, NumType, void>
+{
+    typedef tree_transform<tree_flatten<NumType>, NumType, void> parent;
+
+    // The next link of a chain of + and -, and whether it subtracts, or
+    // null where the chain ends
+    static t_binary_op<NumType>* sum_link(t_expression<NumType>& t, bool& negated)
+    {
+        negated = false;
+        if(auto a = boost::get<t_add<NumType>>(&t))
+            return a;
+        negated = true;
+        return boost::get<t_subtract<NumType>>(&t);
+    }
+    static t_binary_op<NumType>* product_link(t_expression<NumType>& t, bool& negated)
+    {
+        negated = false;
+        return boost::get<t_multiply<NumType>>(&t);
+    }
+
+    // Chains are followed in loops, since they may be far deeper than the
+    // stack allows recursion
+    template <typename Link>
+    static std::size_t chain_length(const t_expression<NumType>& t, Link link)
+    {
+        std::size_t n = 1;
+        bool negated;
+        for(auto i = link(const_cast<t_expression<NumType>&>(t), negated); i; i = link(i->ops[0], negated))
+            ++n;
+        return n;
+    }
+    static std::size_t sum_length(const t_expression<NumType>& t)
+    {
+        return chain_length(t, sum_link);
+    }
+    static std::size_t product_length(const t_expression<NumType>& t)
+    {
+        return chain_length(t, product_link);
+    }
+
+    // Moves the chain's operands into ops, left to right, flattening each
+    template <typename Link>
+    static void collect(t_expression<NumType>& t, std::vector<t_expression<NumType>>& ops, Link link)
+    {
+        std::vector<std::pair<t_binary_op<NumType>*, bool>> links;
+        t_expression<NumType>* base = &t;
+        bool negated;
+        while(auto i = link(*base, negated))
+        {
+            links.emplace_back(i, negated);
+            base = &i->ops[0];
+        }
+
+        ops.reserve(links.size() + 1);
+        ops.push_back(std::move(*base));
+        apply_transform<tree_flatten>(ops.back());
+        for(std::size_t i = links.size(); i-- > 0;)
+        {
+            auto& rhs = links[i].first->ops[1];
+            if(links[i].second)
+                ops.push_back(t_negate<NumType>(std::move(rhs)));
+            else
+                ops.push_back(std::move(rhs));
+            apply_transform<tree_flatten>(ops.back());
+        }
+    }
+    static void collect_sum(t_expression<NumType>& t, std::vector<t_expression<NumType>>& ops)
+    {
+        collect(t, ops, sum_link);
+    }
+    static void collect_product(t_expression<NumType>& t, std::vector<t_expression<NumType>>& ops)
+    {
+        collect(t, ops, product_link);
+    }
+
+    void binary(t_binary_op<NumType>& t)
+    {
+        apply_transform<tree_flatten>(t.ops[0]);
+        apply_transform<tree_flatten>(t.ops[1]);
+    }
+    void operator()(t_add<NumType>& t)
+    {
+        if(sum_length(parent::node) < 3)
+            return binary(t);
+        std::vector<t_expression<NumType>> ops;
+        collect_sum(parent::node, ops);
+        parent::node = t_sum<NumType>(std::move(ops));
+    }
+    void operator()(t_subtract<NumType>& t)
+    {
+        if(sum_length(parent::node) < 3)
+            return binary(t);
+        std::vector<t_expression<NumType>> ops;
+        collect_sum(parent::node, ops);
+        parent::node = t_sum<NumType>(std::move(ops));
+    }
+    void operator()(t_multiply<NumType>& t)
+    {
+        if(product_length(parent::node) < 3)
+            return binary(t);
+        std::vector<t_expression<NumType>> ops;
+        collect_product(parent::node, ops);
+        parent::node = t_product<NumType>(std::move(ops));
+    }
+    void operator()(t_divide<NumType>& t) { binary(t); }
+    void operator()(t_exponentiate<NumType>& t) { binary(t); }
+    void operator()(t_negate<NumType>& t)
+    {
+        apply_transform<tree_flatten>(t.op);
+    }
+    void operator()(t_func_invocation<NumType>& t)
+    {
+        for(auto& i : t.args)
+            apply_transform<tree_flatten>(i);
+    }
+    void operator()(t_polynomial<NumType>& t)
+    {
+        for(auto& i : t.coeffs)
+            apply_transform<tree_flatten>(i);
+    }
+    void operator()(t_sum<NumType>& t)
+    {
+        for(auto& i : t.ops)
+            apply_transform<tree_flatten>(i);
+    }
+    void operator()(t_product<NumType>& t)
+    {
+        for(auto& i : t.ops)
+            apply_transform<tree_flatten>(i);
+    }
+    template <typename Arg>
+    void operator()(Arg& arg)
+    {
+    }
+};
+
 #endif // TREE_TRANSFORM_H_INCLUDED
@@ -0,0 +1,304 @@
+#ifndef VARIABLE_STORE_H_INCLUDED
+#define VARIABLE_STORE_H_INCLUDED
+
+#include <string>
+#include <vector>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <utility>
+
+// 64-bit hash of a variable name, read eight bytes at a time
+inline std::uint64_t hash_variable_name(const char* p, std::size_t n)
+{
+    std::uint64_t h = 0x9e3779b97f4a7c15ULL ^ n;
+    for(; n >= 8; p += 8, n -= 8)
+    {
+        std::uint64_t w;
+        std::memcpy(&w, p, 8);
+        h = (h ^ w) * 0xbf58476d1ce4e5b9ULL;
+        h ^= h >> 31;
+    }
+    std::uint64_t w = 0;
+    std::memcpy(&w, p, n);
+    h = (h ^ w) * 0x94d049bb133111ebULL;
+    h ^= h >> 29;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    return h ^ (h >> 32);
+}
+
+// Map from variable names to values laid out in three flat arrays, in place
+// of a node and a string allocation per variable:
+//
+// - entries, in insertion order: the name's hash, the value, and the name
+//   itself if it is short, else where it lies in the key arena;
+// - the key arena, every longer name packed end to end;
+// - an open-addressing table probed linearly, each slot holding the
+//   upper half of a hash beside the index of its entry, so that a probe
+//   only touches an entry, and its name, when the hashes agree.
+//
+// Hashes are kept, so growing the table never rereads a name. Variables
+// are only ever added or changed, never removed one by one. An entry's
+// index is its handle: it stays valid until clear(), and bulk updates
+// through handles skip hashing altogether.
+template <typename NumType>
+class variable_store
+{
+    // Names this short are found without touching the arena
+    static const std::size_t inline_length = 12;
+
+    struct entry
+    {
+        std::uint64_t hash;
+        NumType value;
+        std::uint32_t length;
+        // The name, or its offset in keys if longer than inline_length
+        char key[inline_length];
+    };
+
+    std::vector<entry> entries;
+    std::vector<char> keys;
+    // (hash >> 32) << 32 | (index + 1), or 0 when empty
+    std::vector<std::uint64_t> slots;
+
+    // The table is grown past three quarters full
+    static bool crowded(std::size_t count, std::size_t capacity)
+    {
+        return count * 4 > capacity * 3;
+    }
+
+    static std::uint64_t tag(std::uint64_t hash)
+    {
+        return hash >> 32 << 32;
+    }
+
+    void place(std::uint64_t hash, std::size_t index)
+    {
+        std::size_t mask = slots.size() - 1;
+        std::size_t i = hash & mask;
+        while(slots[i])
+            i = (i + 1) & mask;
+        slots[i] = tag(hash) | (index + 1);
+    }
+
+    void rehash(std::size_t capacity)
+    {
+        slots.assign(capacity, 0);
+        for(std::size_t i = 0; i < entries.size(); ++i)
+            place(entries[i].hash, i);
+    }
+
+    void grow_for(std::size_t count)
+    {
+        std::size_t capacity = slots.empty() ? 16 : slots.size();
+        while(crowded(count, capacity))
+            capacity *= 2;
+        if(capacity != slots.size())
+            rehash(capacity);
+    }
+
+    const char* key_data(const entry& e) const
+    {
+        if(e.length <= inline_length)
+            return e.key;
+        std::uint32_t offset;
+        std::memcpy(&offset, e.key, sizeof(offset));
+        return keys.data() + offset;
+    }
+
+    std::size_t locate(const char* name, std::size_t length, std::uint64_t hash) const
+    {
+        if(slots.empty())
+            return npos;
+
+        std::size_t mask = slots.size() - 1;
+        for(std::size_t i = hash & mask; slots[i]; i = (i + 1) & mask)
+        {
+            std::uint64_t s = slots[i];
+            if((s ^ hash) >> 32)
+                continue;
+            std::size_t index = static_cast<std::size_t>(s & 0xffffffffu) - 1;
+            const entry& e = entries[index];
+            if(e.length == length && std::memcmp(key_data(e), name, length) == 0)
+                return index;
+        }
+        return npos;
+    }
+
+public:
+    typedef std::size_t handle;
+    static const handle npos = ~handle(0);
+
+    std::size_t size() const
+    {
+        return entries.size();
+    }
+
+    bool empty() const
+    {
+        return entries.empty();
+    }
+
+    // Makes room for count variables whose names longer than twelve bytes
+    // total key_bytes
+    void reserve(std::size_t count, std::size_t key_bytes = 0)
+    {
+        entries.reserve(count);
+        keys.reserve(key_bytes);
+        grow_for(count);
+    }
+
+    void clear()
+    {
+        entries.clear();
+        keys.clear();
+        slots.assign(slots.size(), 0);
+    }
+
+    // npos if name is not defined
+    handle find_handle(const char* name, std::size_t length, std::uint64_t hash) const
+    {
+        return locate(name, length, hash);
+    }
+
+    handle find_handle(const std::string& name) const
+    {
+        return locate(name.data(), name.size(), hash_variable_name(name.data(), name.size()));
+    }
+
+    // Adds name with a value of zero if it is not defined
+    handle insert(const char* name, std::size_t length, std::uint64_t hash)
+    {
+        handle h = locate(name, length, hash);
+        if(h != npos)
+            return h;
+
+        if(keys.size() + length > 0xffffffffu || entries.size() >= 0xffffffffu)
+            throw std::length_error("variable_store is full");
+
+        grow_for(entries.size() + 1);
+
+        entry e;
+        e.hash = hash;
+        e.value = NumType();
+        e.length = static_cast<std::uint32_t>(length);
+        if(length <= inline_length)
+            std::memcpy(e.key, name, length);
+        else
+        {
+            auto offset = static_cast<std::uint32_t>(keys.size());
+            std::memcpy(e.key, &offset, sizeof(offset));
+            keys.insert(keys.end(), name, name + length);
+        }
+        entries.push_back(e);
+
+        place(hash, entries.size() - 1);
+        return entries.size() - 1;
+    }
+
+    handle insert(const std::string& name)
+    {
+        return insert(name.data(), name.size(), hash_variable_name(name.data(), name.size()));
+    }
+
+    // The value of name, or null if it is not defined
+    const NumType* find(const std::string& name) const
+    {
+        handle h = find_handle(name);
+        return h != npos ? &entries[h].value : nullptr;
+    }
+
+    NumType* find(const std::string& name)
+    {
+        handle h = find_handle(name);
+        return h != npos ? &entries[h].value : nullptr;
+    }
+
+    // The reference is invalidated by the next insertion
+    NumType& operator[](const std::string& name)
+    {
+        return entries[insert(name)].value;
+    }
+
+    NumType& value(handle h)
+    {
+        return entries[h].value;
+    }
+
+    const NumType& value(handle h) const
+    {
+        return entries[h].value;
+    }
+
+    std::string name(handle h) const
+    {
+        const entry& e = entries[h];
+        return std::string(key_data(e), e.length);
+    }
+
+    // Defines every (name, value) pair in [first, last), later pairs
+    // overriding earlier ones, with the arrays sized once up front
+    template <typename Iterator>
+    void load(Iterator first, Iterator last)
+    {
+        std::size_t count = 0, key_bytes = 0;
+        for(Iterator i = first; i != last; ++i)
+        {
+            ++count;
+            if(i->first.size() > inline_length)
+                key_bytes += i->first.size();
+        }
+        reserve(entries.size() + count, keys.size() + key_bytes);
+
+        for(; first != last; ++first)
+            entries[insert(first->first)].value = first->second;
+    }
+
+    // Handles for names, defining the missing ones, for use with update()
+    std::vector<handle> resolve(const std::vector<std::string>& names)
+    {
+        std::vector<handle> handles;
+        handles.reserve(names.size());
+        for(const auto& n : names)
+            handles.push_back(insert(n));
+        return handles;
+    }
+
+    // Sets the variable behind handles[i] to values[i]
+    void update(const std::vector<handle>& handles, const NumType* values)
+    {
+        for(std::size_t i = 0; i < handles.size(); ++i)
+            entries[handles[i]].value = values[i];
+    }
+
+    // Calls f(name, value) for every variable, in the order they were
+    // first defined. name is a buffer reused between calls.
+    template <typename Function>
+    void for_each(Function f) const
+    {
+        std::string name;
+        for(const auto& e : entries)
+        {
+            name.assign(key_data(e), e.length);
+            f(static_cast<const std::string&>(name), e.value);
+        }
+    }
+
+    // Bytes allocated by the store, and their share per variable
+    std::size_t memory_usage() const
+    {
+        return entries.capacity() * sizeof(entry) + keys.capacity() + slots.capacity() * sizeof(std::uint64_t);
+    }
+
+    double bytes_per_entry() const
+    {
+        return entries.empty() ? 0 : double(memory_usage()) / entries.size();
+    }
+};
+
+template <typename NumType>
+const typename variable_store<NumType>::handle variable_store<NumType>::npos;
+
+#endif // VARIABLE_STORE_H_INCLUDED